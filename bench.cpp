@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <atomic>
+#include <cstdlib>
+#include <ftw.h>
+#include <new>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "crtc.h"
+#include "simrandr.h"
+#include "stats.h"
+#include "uevent.h"
+
+/*
+ * Times capture and apply against simulated RandR
+ * servers of growing size, with per-object and with
+ * pipelined queries, and reports the round trips and
+ * heap allocations. Fails if a warm apply allocates,
+ * the server refuses a request of an apply, or a
+ * failed apply isn't rolled back.
+ */
+
+#define BENCH_ITERATIONS 20
+
+struct Topology {
+    const char *name;
+    int crtcs;
+    int outputs;
+    int modes;
+    int active;
+};
+
+static const Topology topologies[] = {
+    { "laptop",      1,  1,   16,  1 },
+    { "dock",        3,  6,   64,  2 },
+    { "workstation", 4, 12,  256,  3 },
+    { "wall",        8, 32, 1024,  6 },
+    { "max",        16, 64, 4096, 16 },
+};
+
+struct Result {
+    double ms;
+    unsigned long roundTrips;
+    unsigned long allocations;
+};
+
+/* Counts every C++ heap allocation made by the benchmarked code */
+static std::atomic<unsigned long> allocations(0);
+static bool warmAllocated = false;
+static bool rejected = false;
+
+void *operator new(size_t size)
+{
+    allocations++;
+
+    void *ptr = malloc(size ? size : 1);
+
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+/*
+ * Builds the simulated server and a profile that lights
+ * the first `active` CRTCs, one output each, side by side
+ */
+static void buildTopology(const Topology &topology, long connectDelayMs, SimRandR *randr, Profile *profile)
+{
+
+    vector<RRMode> modes;
+    char name[32];
+
+    for (int i = 0; i < topology.modes; i++) {
+        /* Several refresh rates per size, like real panels */
+        unsigned int width = 1024 + (i / 4) % 64 * 32;
+        unsigned int height = width * 9 / 16;
+        snprintf(name, sizeof(name), "%ux%u", width, height);
+        modes.push_back(randr->addMode(name, width, height, 60000000UL + (unsigned long) (i % 4) * 30000000UL));
+    }
+
+    vector<RRCrtc> crtcs;
+
+    for (int i = 0; i < topology.crtcs; i++) {
+        crtcs.push_back(randr->addCrtc());
+    }
+
+    vector<std::string> outputNames;
+    vector<RRMode> outputModes;
+
+    for (int i = 0; i < topology.outputs; i++) {
+
+        vector<RRMode> supported;
+
+        for (int j = i % topology.outputs; j < topology.modes; j += topology.outputs) {
+            supported.push_back(modes[j]);
+        }
+
+        snprintf(name, sizeof(name), "%s-%d", i == 0 ? "eDP" : "DP", i);
+
+        /* The internal panel is always there, the rest come up with the dock */
+        randr->addOutput(name, supported, i == 0 ? 0 : connectDelayMs);
+
+        outputNames.push_back(name);
+        outputModes.push_back(supported.empty() ? None : supported[0]);
+
+    }
+
+    ScreenResources resources;
+    randr->getScreenResources(&resources);
+
+    profile->controllers.clear();
+    profile->width = 0;
+    profile->height = 0;
+    profile->generation = 1;
+
+    for (int i = 0; i < topology.crtcs; i++) {
+
+        Profile::Controller controller;
+
+        controller.crtc = crtcs[i];
+        controller.x = 0;
+        controller.y = 0;
+        controller.mode = "None";
+        controller.rotation = RR_Rotate_0;
+        controller.timing = Profile::Timing();
+
+        if (i < topology.active && i < topology.outputs && outputModes[i] != None) {
+
+            for (const ModeInfo &mode : resources.modes) {
+                if (mode.id == outputModes[i]) {
+                    controller.mode = mode.name;
+                    controller.timing.width = (int) mode.width;
+                    controller.timing.height = (int) mode.height;
+                    controller.timing.dotClock = mode.dotClock / 1000;
+                    controller.timing.hTotal = mode.hTotal;
+                    controller.timing.vTotal = mode.vTotal;
+                    controller.timing.flags = mode.modeFlags;
+                    controller.x = profile->width;
+                    profile->width += (int) mode.width;
+                    if ((int) mode.height > profile->height) {
+                        profile->height = (int) mode.height;
+                    }
+                }
+            }
+
+            controller.outputs.push_back(outputNames[i]);
+
+        }
+
+        profile->controllers.push_back(controller);
+
+    }
+
+    profile->mm_width = profile->width / 4;
+    profile->mm_height = profile->height / 4;
+
+}
+
+static void report(const char *topology, const char *backend, const char *operation, const Result &result)
+{
+    printf("%-12s %-10s %-14s %10.3f ms %8lu round trips %8lu allocations\n",
+           topology, backend, operation, result.ms, result.roundTrips, result.allocations);
+}
+
+static void run(const Topology &topology, bool pipelined, long latencyUs)
+{
+
+    const char *backend = pipelined ? "pipelined" : "per-object";
+
+    Result capture = { 0, 0, 0 };
+    Result cold = { 0, 0, 0 };
+    Result warm = { 0, 0, 0 };
+    Result hotplug = { 0, 0, 0 };
+    unsigned long rejectedRequests = 0;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+
+        SimRandR randr;
+        Profile profile;
+
+        buildTopology(topology, 0, &randr, &profile);
+        randr.setPipelined(pipelined);
+        randr.setLatency(latencyUs);
+
+        CRTControllerManager manager(&randr);
+
+        /* First apply resolves the plan and sets every CRTC */
+        randr.resetRoundTrips();
+        unsigned long allocated = allocations;
+        uint64_t start = Stats::now();
+        manager.applyProfile(CRTControllerManager::DockState::DOCKED, profile);
+        cold.ms += (Stats::now() - start) / 1e6;
+        cold.roundTrips += randr.getRoundTrips();
+        cold.allocations += allocations - allocated;
+
+        /* The first replay sizes the buffers for the lit CRTCs */
+        manager.applyProfile(CRTControllerManager::DockState::DOCKED, profile);
+
+        /* Later applies replay the cached plan and skip unchanged CRTCs */
+        randr.resetRoundTrips();
+        allocated = allocations;
+        start = Stats::now();
+        manager.applyProfile(CRTControllerManager::DockState::DOCKED, profile);
+        warm.ms += (Stats::now() - start) / 1e6;
+        warm.roundTrips += randr.getRoundTrips();
+        warm.allocations += allocations - allocated;
+
+        Ini ini;
+
+        randr.resetRoundTrips();
+        allocated = allocations;
+        start = Stats::now();
+        manager.captureConfig(ini);
+        capture.ms += (Stats::now() - start) / 1e6;
+        capture.roundTrips += randr.getRoundTrips();
+        capture.allocations += allocations - allocated;
+        rejectedRequests += randr.getRejected();
+
+    }
+
+    /* Outputs that connect 50 ms after the dock event */
+    for (int i = 0; i < BENCH_ITERATIONS / 4; i++) {
+
+        SimRandR randr;
+        Profile profile;
+
+        buildTopology(topology, 50, &randr, &profile);
+        randr.setPipelined(pipelined);
+        randr.setLatency(latencyUs);
+        randr.plug();
+
+        CRTControllerManager manager(&randr);
+
+        randr.resetRoundTrips();
+        unsigned long allocated = allocations;
+        uint64_t start = Stats::now();
+        manager.applyProfile(CRTControllerManager::DockState::DOCKED, profile);
+        hotplug.ms += (Stats::now() - start) / 1e6;
+        hotplug.roundTrips += randr.getRoundTrips();
+        hotplug.allocations += allocations - allocated;
+        rejectedRequests += randr.getRejected();
+
+    }
+
+    if (warm.allocations > 0) {
+        warmAllocated = true;
+    }
+
+    if (rejectedRequests > 0) {
+        rejected = true;
+    }
+
+    capture.ms /= BENCH_ITERATIONS;
+    capture.roundTrips /= BENCH_ITERATIONS;
+    capture.allocations /= BENCH_ITERATIONS;
+    cold.ms /= BENCH_ITERATIONS;
+    cold.roundTrips /= BENCH_ITERATIONS;
+    cold.allocations /= BENCH_ITERATIONS;
+    warm.ms /= BENCH_ITERATIONS;
+    warm.roundTrips /= BENCH_ITERATIONS;
+    warm.allocations /= BENCH_ITERATIONS;
+    hotplug.ms /= BENCH_ITERATIONS / 4;
+    hotplug.roundTrips /= BENCH_ITERATIONS / 4;
+    hotplug.allocations /= BENCH_ITERATIONS / 4;
+
+    report(topology.name, backend, "capture", capture);
+    report(topology.name, backend, "apply (cold)", cold);
+    report(topology.name, backend, "apply (warm)", warm);
+    report(topology.name, backend, "apply (50ms)", hotplug);
+
+}
+
+/* A laptop panel on the first CRTC and a dock monitor that can also do 1440p */
+class RollbackServer {
+public:
+    SimRandR randr;
+    RRCrtc crtcs[2];
+    RROutput outputs[2];
+    RRMode modes[2];
+
+    RollbackServer() {
+        modes[0] = randr.addMode("1920x1080", 1920, 1080, 148500000);
+        modes[1] = randr.addMode("2560x1440", 2560, 1440, 241500000);
+        outputs[0] = randr.addOutput("eDP-1", vector<RRMode>(1, modes[0]), 0);
+        outputs[1] = randr.addOutput("DP-1", vector<RRMode>(modes, modes + 2), 0);
+        crtcs[0] = randr.addCrtc();
+        crtcs[1] = randr.addCrtc();
+    }
+
+    void light(int crtc, int output, int x, int mode) {
+        randr.setCrtcConfig(crtcs[crtc], x, 0, modes[mode], RR_Rotate_0, &outputs[output], 1);
+    }
+
+    /* The CRTCs and screen as the server has them, for comparing */
+    std::string describe() {
+        ScreenSize size;
+        vector<CrtcInfo> infos;
+        char line[128];
+
+        randr.waitForEvent(0);
+        randr.getScreenSize(&size);
+        randr.getCrtcInfos(vector<RRCrtc>(crtcs, crtcs + 2), &infos);
+
+        snprintf(line, sizeof(line), "%dx%d", size.width, size.height);
+        std::string layout = line;
+
+        for (const CrtcInfo &info : infos) {
+            snprintf(line, sizeof(line), " %lu+%d+%d/%zu", info.mode, info.x, info.y, info.outputs.size());
+            layout += line;
+        }
+
+        return layout;
+    }
+};
+
+static Profile::Controller rollbackController(RRCrtc crtc, const char *output, int x, const char *mode)
+{
+
+    Profile::Controller controller;
+
+    controller.crtc = crtc;
+    controller.x = x;
+    controller.y = 0;
+    controller.mode = mode ? mode : "None";
+    controller.rotation = RR_Rotate_0;
+    controller.timing = Profile::Timing();
+
+    if (output) {
+        controller.outputs.push_back(output);
+    }
+
+    return controller;
+
+}
+
+static int removeFile(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static bool check(const char *name, bool passed)
+{
+    printf("%-40s %s\n", name, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+/*
+ * Breaks applies that resize the screen on purpose and
+ * checks the layout and size come back, and that the
+ * previous version of a profile is tried afterwards
+ */
+static bool runRollbacks()
+{
+
+    bool passed = true;
+
+    /* The dock monitor is refused after the screen grew for it */
+    {
+        RollbackServer server;
+        server.randr.setScreenSize(1920, 1080, 480, 270);
+        server.light(0, 0, 0, 0);
+
+        Profile profile;
+        profile.width = 3840;
+        profile.height = 1080;
+        profile.mm_width = 960;
+        profile.mm_height = 270;
+        profile.generation = 1;
+        profile.controllers.push_back(rollbackController(server.crtcs[0], "eDP-1", 0, "1920x1080"));
+        profile.controllers.push_back(rollbackController(server.crtcs[1], "DP-1", 1920, "1920x1080"));
+
+        CRTControllerManager manager(&server.randr);
+        std::string before = server.describe();
+
+        server.randr.refuseCrtc(server.crtcs[1]);
+
+        bool applied = manager.applyProfile(CRTControllerManager::DockState::DOCKED, profile);
+
+        passed &= check("rollback after a refused CRTC",
+                                !applied && manager.wasRolledBack() && server.describe() == before &&
+                                server.randr.getRejected() == 0);
+    }
+
+    /* The new layout is accepted but leaves every output dark */
+    {
+        RollbackServer server;
+        server.randr.setScreenSize(1920, 1080, 480, 270);
+        server.light(0, 0, 0, 0);
+
+        Profile profile;
+        profile.width = 2560;
+        profile.height = 1440;
+        profile.mm_width = 640;
+        profile.mm_height = 360;
+        profile.generation = 1;
+        profile.controllers.push_back(rollbackController(server.crtcs[0], NULL, 0, NULL));
+        profile.controllers.push_back(rollbackController(server.crtcs[1], "DP-1", 0, "2560x1440"));
+
+        CRTControllerManager manager(&server.randr);
+        std::string before = server.describe();
+
+        server.randr.blankCrtc(server.crtcs[1]);
+
+        bool applied = manager.applyProfile(CRTControllerManager::DockState::DOCKED, profile);
+
+        passed &= check("rollback after a dark apply",
+                                !applied && manager.wasRolledBack() && server.describe() == before &&
+                                server.randr.getRejected() == 0);
+    }
+
+    /* A profile that can't be applied falls back to the version before it */
+    {
+        char directory[] = "/tmp/dockd-bench-XXXXXX";
+
+        if (mkdtemp(directory) == NULL) {
+            return check("fallback to the previous profile", false);
+        }
+
+        DisplayConfig display;
+        display.screen = -1;
+        display.directory = directory;
+
+        std::string previous;
+
+        {
+            RollbackServer capture;
+            capture.randr.setScreenSize(1920, 1080, 480, 270);
+            capture.light(0, 0, 0, 0);
+
+            CRTControllerManager manager(display, &capture.randr);
+            manager.writeConfigToDisk(CRTControllerManager::DockState::DOCKED);
+            previous = capture.describe();
+
+            capture.randr.setScreenSize(3840, 1080, 960, 270);
+            capture.light(1, 1, 1920, 0);
+            manager.writeConfigToDisk(CRTControllerManager::DockState::DOCKED);
+        }
+
+        RollbackServer server;
+        server.randr.setScreenSize(1920, 1080, 480, 270);
+        server.light(1, 1, 0, 0);
+        server.randr.refuseCrtc(server.crtcs[1]);
+
+        CRTControllerManager manager(display, &server.randr);
+
+        bool applied = manager.applyConfiguration(CRTControllerManager::DockState::DOCKED);
+        bool kept = access(CRTControllerManager::getHistoryPath(manager.getConfigLocation(
+                           CRTControllerManager::DockState::DOCKED), 1).c_str(), F_OK) == 0;
+
+        passed &= check("fallback to the previous profile",
+                                applied && kept && server.describe() == previous && server.randr.getRejected() == 0);
+
+        nftw(directory, &removeFile, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    return passed;
+
+}
+
+/* Keeps what the monitor thread handed over */
+class CountingHandler : public UEventHandler {
+public:
+    std::atomic<int> count;
+    UEvent last;
+
+    CountingHandler() : count(0) { }
+
+    void handleUEvent(const UEvent &event) {
+        last = event;
+        count++;
+    }
+};
+
+static bool writeFile(const std::string &path, const char *contents)
+{
+
+    FILE *file = fopen(path.c_str(), "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    fputs(contents, file);
+
+    return fclose(file) == 0;
+
+}
+
+/*
+ * Feeds a fake uevent stream through a socketpair, with a
+ * fake connector tree in place of /sys/class/drm, and checks
+ * only the connector hotplug gets through
+ */
+static bool runUEvents()
+{
+
+    char directory[] = "/tmp/dockd-bench-XXXXXX";
+
+    if (mkdtemp(directory) == NULL) {
+        return check("uevent hotplug", false);
+    }
+
+    std::string drm = directory;
+    bool created = mkdir((drm + "/card0-eDP-1").c_str(), 0755) == 0 &&
+                   mkdir((drm + "/card0-DP-1").c_str(), 0755) == 0 &&
+                   mkdir((drm + "/card0-HDMI-A-1").c_str(), 0755) == 0 &&
+                   writeFile(drm + "/card0-eDP-1/status", "connected\n") &&
+                   writeFile(drm + "/card0-DP-1/status", "connected\n") &&
+                   writeFile(drm + "/card0-HDMI-A-1/status", "disconnected\n");
+
+    int pair[2];
+
+    if (!created || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+        nftw(directory, &removeFile, 16, FTW_DEPTH | FTW_PHYS);
+        return check("uevent hotplug", false);
+    }
+
+    CountingHandler handler;
+    UEventMonitor monitor(drm);
+
+    if (!monitor.start(&handler, pair[0])) {
+        close(pair[0]);
+        close(pair[1]);
+        nftw(directory, &removeFile, 16, FTW_DEPTH | FTW_PHYS);
+        return check("uevent hotplug", false);
+    }
+
+    static const char backlight[] = "change@/devices/pci0000:00/0000:00:02.0/backlight/intel_backlight\0"
+                                    "ACTION=change\0SUBSYSTEM=backlight\0";
+    static const char cut[] = "change@/devices/pci0000:00/0000:00:02.0/drm/card0\0ACTION=change\0SUBSYS";
+    static const char hotplug[] = "change@/devices/pci0000:00/0000:00:02.0/drm/card0\0"
+                                  "ACTION=change\0SUBSYSTEM=drm\0HOTPLUG=1\0";
+
+    /* Larger than the receive buffer, so it arrives truncated */
+    std::string oversized(hotplug, sizeof(hotplug) - 1);
+    oversized.append(UEVENT_BUFFER_SIZE, 'x');
+
+    bool sent = send(pair[1], backlight, sizeof(backlight) - 1, 0) > 0 &&
+                send(pair[1], cut, sizeof(cut) - 1, 0) > 0 &&
+                send(pair[1], oversized.data(), oversized.size(), 0) > 0 &&
+                send(pair[1], "", 0, 0) == 0 &&
+                send(pair[1], hotplug, sizeof(hotplug) - 1, 0) > 0;
+
+    /* The stream is handled in order, so nothing else can come after the hotplug */
+    for (int waited = 0; sent && handler.count.load() == 0 && waited < 1000; waited++) {
+        usleep(1000);
+    }
+
+    bool passed = sent && handler.count.load() == 1 &&
+                  handler.last.action == "change" &&
+                  handler.last.devpath == "/devices/pci0000:00/0000:00:02.0/drm/card0" &&
+                  handler.last.subsystem == "drm" && handler.last.hotplug &&
+                  monitor.countExternalConnected() == 1;
+
+    /* The listener stops once the writer is gone, the reading end stays with it */
+    close(pair[1]);
+    nftw(directory, &removeFile, 16, FTW_DEPTH | FTW_PHYS);
+
+    return check("uevent hotplug", passed);
+
+}
+
+int main(int argc, char *argv[])
+{
+
+    /* Injected latency per round trip, a local X server is ~50-200 us */
+    long latencyUs = argc > 1 ? atol(argv[1]) : 100;
+
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    printf("dockd benchmark, %ld us per round trip, %d iterations\n\n", latencyUs, BENCH_ITERATIONS);
+
+    for (const Topology &topology : topologies) {
+        run(topology, false, latencyUs);
+        run(topology, true, latencyUs);
+    }
+
+    printf("\n");
+
+    bool rolledBack = runRollbacks();
+    bool hotplugged = runUEvents();
+
+    if (warmAllocated) {
+        printf("\nFAIL: a warm apply allocated on the heap\n");
+        return EXIT_FAILURE;
+    }
+
+    if (rejected) {
+        printf("\nFAIL: the server refused a CRTC or screen change, the apply is out of order\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!rolledBack) {
+        printf("\nFAIL: a failed apply did not get the previous layout back\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!hotplugged) {
+        printf("\nFAIL: an injected uevent stream was not handled as expected\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+
+}
@@ -0,0 +1,241 @@
+#include "control.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define CONTROL_MAX_COMMAND 4096
+
+/* A client gets this long to send its command, the server handles one at a time */
+#define CONTROL_READ_TIMEOUT_MS 1000
+
+static bool fillAddress(struct sockaddr_un *address)
+{
+    std::string path = ControlServer::socketPath();
+
+    if (path.size() >= sizeof(address->sun_path)) {
+        return false;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path.c_str());
+
+    return true;
+}
+
+static int connectToDaemon()
+{
+    struct sockaddr_un address;
+
+    if (!fillAddress(&address)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* A peer that hung up is an error here, not a SIGPIPE that kills the daemon */
+static bool writeAll(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = send(fd, data, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= (size_t) ret;
+    }
+
+    return true;
+}
+
+std::string ControlServer::socketPath()
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime && runtime[0] == '/') {
+        return std::string(runtime) + "/dockd.sock";
+    }
+
+    return "/tmp/dockd-" + std::to_string(getuid()) + ".sock";
+}
+
+bool ControlServer::start(ControlHandler *handler)
+{
+
+    struct sockaddr_un address;
+
+    if (!fillAddress(&address)) {
+        syslog(LOG_ERR, "Control socket path too long\n");
+        return false;
+    }
+
+    /* Refuse to steal the socket from a daemon that is still alive */
+    int running = connectToDaemon();
+
+    if (running >= 0) {
+        close(running);
+        syslog(LOG_ERR, "Another dockd is already listening on %s\n", address.sun_path);
+        return false;
+    }
+
+    unlink(address.sun_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create the control socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || chmod(address.sun_path, 0600) != 0 ||
+        listen(fd, 4) != 0) {
+        syslog(LOG_ERR, "Failed to listen on %s: %s\n", address.sun_path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    this->handler = handler;
+
+    if (pthread_create(&thread, NULL, &ControlServer::serve, this) != 0) {
+        syslog(LOG_ERR, "Failed to start the control server\n");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    pthread_detach(thread);
+
+    return true;
+
+}
+
+void *ControlServer::serve(void *server)
+{
+
+    ControlServer *self = (ControlServer *) server;
+
+    for (;;) {
+
+        int client = accept4(self->fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            syslog(LOG_ERR, "Control server stopped: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = CONTROL_READ_TIMEOUT_MS / 1000;
+        timeout.tv_usec = (CONTROL_READ_TIMEOUT_MS % 1000) * 1000;
+
+        if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+            syslog(LOG_ERR, "Failed to set the control read timeout: %s\n", strerror(errno));
+        }
+
+        /* One command per connection, terminated by a newline or EOF */
+
+        std::string command;
+        char buffer[256];
+        bool stalled = false;
+
+        while (command.size() < CONTROL_MAX_COMMAND && command.find('\n') == std::string::npos) {
+            ssize_t len = read(client, buffer, sizeof(buffer));
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                stalled = true;
+                break;
+            }
+            if (len <= 0) {
+                break;
+            }
+            command.append(buffer, (size_t) len);
+        }
+
+        /* Don't act on half a command from a client that went quiet */
+        if (stalled) {
+            syslog(LOG_WARNING, "Dropped a control client that sent no command\n");
+            close(client);
+            continue;
+        }
+
+        size_t end = command.find('\n');
+
+        if (end != std::string::npos) {
+            command.erase(end);
+        }
+
+        std::string reply = self->handler->handleCommand(command);
+
+        writeAll(client, reply.data(), reply.size());
+        close(client);
+
+    }
+
+}
+
+bool ControlServer::request(const std::string &command, std::string *reply)
+{
+
+    int fd = connectToDaemon();
+
+    if (fd < 0) {
+        return false;
+    }
+
+    std::string line = command + "\n";
+
+    if (!writeAll(fd, line.data(), line.size())) {
+        close(fd);
+        return false;
+    }
+
+    shutdown(fd, SHUT_WR);
+
+    char buffer[4096];
+    ssize_t len;
+
+    reply->clear();
+
+    while ((len = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        reply->append(buffer, (size_t) len);
+    }
+
+    close(fd);
+
+    return true;
+
+}
@@ -0,0 +1,36 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <pthread.h>
+#include <string>
+
+class ControlHandler {
+public:
+    virtual std::string handleCommand(const std::string &command) = 0;
+};
+
+/*
+ * A per-user unix socket the running daemon listens on.
+ * Clients send a single command line and read the reply
+ * until the daemon closes the connection.
+ */
+class ControlServer {
+
+private:
+
+    int fd = -1;
+    ControlHandler *handler = NULL;
+    pthread_t thread;
+
+    static void *serve(void *server);
+
+public:
+
+    bool start(ControlHandler *handler);
+
+    static std::string socketPath();
+    static bool request(const std::string &command, std::string *reply);
+
+};
+
+#endif // CONTROL_H
@@ -1,72 +1,556 @@
 #include "crtc.h"
-
+#include "stats.h"
+#include "trace.h"
+#include "x11randr.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
 #include <cstring>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <syslog.h>
 
-//#define DRYRUN
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
 
-CRTControllerManager::CRTControllerManager()
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
 {
-    connectToX();
+    const unsigned char *bytes = (const unsigned char *) data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
 }
 
-CRTControllerManager::~CRTControllerManager()
+static uint64_t timingKey(unsigned int width, unsigned int height, unsigned long dotClock,
+                          unsigned int hTotal, unsigned int vTotal, unsigned long flags)
+{
+    uint64_t hash = FNV_OFFSET;
+
+    hash = fnv1a(hash, &width, sizeof(width));
+    hash = fnv1a(hash, &height, sizeof(height));
+    hash = fnv1a(hash, &dotClock, sizeof(dotClock));
+    hash = fnv1a(hash, &hTotal, sizeof(hTotal));
+    hash = fnv1a(hash, &vTotal, sizeof(vTotal));
+    hash = fnv1a(hash, &flags, sizeof(flags));
+
+    return hash;
+}
+
+static uint64_t sizeKey(unsigned int width, unsigned int height)
 {
-    XRRFreeScreenResources(resources);
-    XCloseDisplay(display);
+    return ((uint64_t) width << 32) | height;
 }
 
-bool CRTControllerManager::applyConfiguration(CRTControllerManager::DockState state)
+/* Hashes what a CRTC shows, independent of the order outputs are listed in */
+static uint64_t fingerprintCrtc(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                                const vector<RROutput> &outputs)
 {
+    uint64_t hash = FNV_OFFSET;
+    uint64_t outputSet = 0;
+    int rotate = (int) rotation;
+
+    hash = fnv1a(hash, &crtc, sizeof(crtc));
+    hash = fnv1a(hash, &mode, sizeof(mode));
+
+    /* A disabled CRTC has no meaningful position */
+    if (mode != None) {
+        hash = fnv1a(hash, &x, sizeof(x));
+        hash = fnv1a(hash, &y, sizeof(y));
+        hash = fnv1a(hash, &rotate, sizeof(rotate));
+    }
 
-    /* Reconnect to the server */
+    for (RROutput output : outputs) {
+        outputSet += fnv1a(FNV_OFFSET, &output, sizeof(output));
+    }
 
-    disconnectFromX();
-    connectToX();
+    return fnv1a(hash, &outputSet, sizeof(outputSet));
+}
+
+/* Only for what the profile sets, anything else is left as the server has it */
+static uint64_t fingerprintExtras(uint64_t hash, const CrtcTransform *transform, const Panning *panning)
+{
+    if (transform) {
+        hash = fnv1a(hash, transform->matrix.matrix, sizeof(transform->matrix.matrix));
+        hash = fnv1a(hash, transform->filter.data(), transform->filter.size());
+        hash = fnv1a(hash, transform->params.data(), transform->params.size() * sizeof(XFixed));
+    }
+
+    if (panning) {
+        hash = fnv1a(hash, panning, sizeof(*panning));
+    }
+
+    return hash;
+}
+
+static uint64_t fingerprintScreen(uint64_t hash, int width, int height, int mm_width, int mm_height)
+{
+    hash = fnv1a(hash, &width, sizeof(width));
+    hash = fnv1a(hash, &height, sizeof(height));
+    hash = fnv1a(hash, &mm_width, sizeof(mm_width));
+    return fnv1a(hash, &mm_height, sizeof(mm_height));
+}
+
+/* Dot clock in kHz */
+static double refreshRate(unsigned long dotClock, unsigned int hTotal, unsigned int vTotal)
+{
+    if (hTotal == 0 || vTotal == 0) {
+        return 0;
+    }
+
+    return dotClock * 1000.0 / ((double) hTotal * vTotal);
+}
+
+/*
+ * Moves every version of a profile one step down its
+ * history, with its binary copy, dropping the oldest
+ */
+static void keepHistory(const std::string &path)
+{
+
+    for (int version = PROFILE_HISTORY; version > 0; version--) {
+
+        std::string from = version > 1 ? CRTControllerManager::getHistoryPath(path, version - 1) : path;
+        std::string to = CRTControllerManager::getHistoryPath(path, version);
+
+        /*
+         * The live version is linked rather than moved, so it stays in
+         * place until the new one replaces it. Either way the mtime is
+         * kept, so the binary stays valid for the INI it goes with.
+         */
+
+        if (version == 1) {
+            unlink(to.c_str());
+        }
+
+        if ((version > 1 ? rename(from.c_str(), to.c_str()) : link(from.c_str(), to.c_str())) != 0) {
+
+            if (errno != ENOENT) {
+                Trace::log(LOG_ERR, "Can't keep %s as %s: %s\n", from.c_str(), to.c_str(), strerror(errno));
+            }
+
+            continue;
+
+        }
+
+        from += PROFILE_BINARY_SUFFIX;
+        to += PROFILE_BINARY_SUFFIX;
+
+        unlink(to.c_str());
+
+        if ((version > 1 ? rename(from.c_str(), to.c_str()) : link(from.c_str(), to.c_str())) != 0) {
+            unlink(to.c_str());
+        }
+
+    }
+
+}
+
+static bool readFile(const std::string &path, std::string *contents)
+{
+
+    FILE *file = fopen(path.c_str(), "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    char buffer[4096];
+    size_t length;
+
+    contents->clear();
+
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents->append(buffer, length);
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+
+    return ok;
+
+}
+
+/*
+ * Writes the INI and its binary copy next to the live profile
+ * and renames them over it, so a failed write leaves the old
+ * profile alone and the watch never sees a half written one.
+ * The old INI goes into the history, for when the new one
+ * can't be applied, unless nothing changed.
+ */
+static bool writeProfile(Ini &ini, const std::string &path)
+{
+
+    std::string temporary = path + ".tmp";
+    std::string binary = path + PROFILE_BINARY_SUFFIX;
+
+    if (!ini.writeIni(temporary.c_str())) {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    std::string written;
+    std::string current;
+
+    /* Capturing the same layout again would only push the real history out */
+    if (readFile(temporary, &written) && readFile(path, &current) && written == current) {
+        Trace::log(LOG_INFO, "%s is unchanged, keeping it\n", path.c_str());
+        unlink(temporary.c_str());
+        return true;
+    }
+
+    keepHistory(path);
 
     /*
-     * Step 0: Check config files
-     * Step 1: Open the right config file
-     * Step 3: Apply the crtc configuration
-     * Step 4: Apply the screen configuration
+     * Round trip through the parser, so the binary holds exactly what
+     * the INI says. The binary is checked against the mtime and size
+     * of the INI, so it only becomes valid once the INI follows it.
      */
+    Profile profile;
+
+    if (!profile.load(temporary.c_str()) || !profile.writeBinary(temporary.c_str()) ||
+        rename((temporary + PROFILE_BINARY_SUFFIX).c_str(), binary.c_str()) != 0) {
+        Trace::log(LOG_ERR, "No binary copy of %s, the INI will be parsed instead\n", path.c_str());
+        unlink((temporary + PROFILE_BINARY_SUFFIX).c_str());
+        unlink(binary.c_str());
+    }
+
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        Trace::log(LOG_ERR, "Can't replace %s: %s\n", path.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    return true;
+
+}
+
+CRTControllerManager::CRTControllerManager() : ownedRandR(new X11RandR), randr(ownedRandR.get())
+{
+    connectToX();
+}
+
+CRTControllerManager::CRTControllerManager(const DisplayConfig &display) :
+    ownedRandR(new X11RandR(display.name, display.screen)), randr(ownedRandR.get()),
+    configDirectory(display.directory)
+{
+    connectToX();
+}
+
+CRTControllerManager::CRTControllerManager(RandR *randr) : randr(randr)
+{
+    connectToX();
+}
+
+CRTControllerManager::CRTControllerManager(const DisplayConfig &display, RandR *randr) :
+    randr(randr), configDirectory(display.directory)
+{
+    connectToX();
+}
+
+CRTControllerManager::~CRTControllerManager()
+{
+    disconnectFromX();
+}
 
-    /* Step 0 */
+bool CRTControllerManager::applyConfiguration(CRTControllerManager::DockState state, ApplyReport *report)
+{
+
+    Profile profile;
+
+    if (state != DOCKED && state != UNDOCKED) {
+        return false;
+    }
 
-    if (access(CONFIG_LOCATION_DOCKED, R_OK) != 0) {
-        syslog(LOG_ERR, "Can't open config file %s, aborting\n", CONFIG_LOCATION_DOCKED);
+    if (!profile.load(getConfigLocation(state).c_str())) {
         return false;
     }
 
-    if (access(CONFIG_LOCATION_UNDOCKED, R_OK) != 0) {
-        syslog(LOG_ERR, "Can't open config file %s, aborting\n", CONFIG_LOCATION_UNDOCKED);
+    return applyProfileOrPrevious(state, profile, report);
+
+}
+
+bool CRTControllerManager::applyProfileOrPrevious(CRTControllerManager::DockState state, const Profile &profile,
+                                                  ApplyReport *report)
+{
+
+    if (applyProfile(state, profile, report)) {
+        return true;
+    }
+
+    /* A profile that never got as far as the server won't do better in an older version */
+    if (!rolledBack) {
         return false;
     }
 
+    return applyPreviousVersion(state, profile, report);
+
+}
+
+bool CRTControllerManager::applyPreviousVersion(CRTControllerManager::DockState state, const Profile &profile,
+                                                ApplyReport *report)
+{
+
+    for (int version = 1; version <= PROFILE_HISTORY && !profile.path.empty(); version++) {
+
+        std::string path = getHistoryPath(profile.path, version);
+        Profile previous;
+
+        if (access(path.c_str(), F_OK) != 0) {
+            break;
+        }
+
+        if (!previous.load(path.c_str())) {
+            continue;
+        }
+
+        Trace::log(LOG_WARNING, "Falling back to %s\n", path.c_str());
+
+        if (applyProfile(state, previous, report)) {
+            Stats::count(Stats::FALLBACKS);
+            return true;
+        }
+
+    }
+
+    Trace::log(LOG_ERR, "No working version of %s left, keeping the last known good layout\n",
+               profile.path.empty() ? "the profile" : profile.path.c_str());
+
+    return false;
+
+}
+
+bool CRTControllerManager::wasRolledBack()
+{
+    return rolledBack;
+}
+
+bool CRTControllerManager::applyProfile(CRTControllerManager::DockState state, const Profile &profile,
+                                        ApplyReport *report)
+{
+
+    this->report = report;
+
+    /*
+     * Stay on the warm connection and catch up on what changed
+     * since the last apply. It's only opened again after the
+     * server refused a request or stopped answering queries.
+     */
+
+    uint64_t start = Stats::now();
+
+    randr->resetRoundTrips();
+
+    if (reconnect || !refreshConnection()) {
+        disconnectFromX();
+        connectToX();
+    }
+
+    reportPhase("connect", start, 0);
+
+    uint64_t phaseStart = Stats::now();
+    unsigned long phaseRoundTrips = randr->getRoundTrips();
+
+    /*
+     * The profile was already parsed and validated
+     * when it was loaded, so no file I/O happens here.
+     *
+     * Step 1: Find a cached plan or resolve a new one
+     * Step 2: Commit the plan to X
+     */
+
     /* Step 1 */
 
-    Ini config;
+    ApplyPlan *plan = findPlan(state, profile);
+
+    if (plan) {
+        /* Only the current CRTC state is needed to diff against */
+        Trace::log(LOG_INFO, "Reusing the apply plan resolved at config time %lu\n", plan->configTimestamp);
+        Stats::count(Stats::PLAN_HITS);
+        snapshotCrtcs();
+    } else {
+        uint64_t resolveStart = Stats::now();
+        takeSnapshot();
+        plan = buildPlan(state, profile, true);
+        Stats::observeSince(Stats::OUTPUT_RESOLUTION, resolveStart);
+    }
+
+    reportPhase("resolve", phaseStart, phaseRoundTrips);
 
-    switch (state) {
-    case DOCKED:
-        config.readIni(CONFIG_LOCATION_DOCKED);
-        break;
-    case UNDOCKED:
-        config.readIni(CONFIG_LOCATION_UNDOCKED);
-        break;
+    if (!plan) {
+        Stats::count(Stats::APPLY_FAILURES);
+        this->report = NULL;
+        return false;
     }
 
+    /* Step 2 */
 
-    /* Step 3 */
+    bool applied = commitPlan(*plan);
+
+    /* A dry run says nothing about how long applies take */
+    if (!dryRun) {
+        Stats::observeSince(Stats::APPLY, start);
+        Stats::count(applied ? Stats::APPLIES : Stats::APPLY_FAILURES);
+    }
+
+    this->report = NULL;
+
+    return applied;
+
+}
+
+bool CRTControllerManager::preparePlan(CRTControllerManager::DockState state, const Profile &profile)
+{
+
+    if (findPlan(state, profile)) {
+        return true;
+    }
+
+    /*
+     * The outputs of the other state are not expected to be
+     * there yet, so don't wait for them. If they are missing the
+     * plan is simply resolved again when the event comes.
+     */
+
+    takeSnapshot();
+
+    return buildPlan(state, profile, false) != NULL;
+
+}
+
+bool CRTControllerManager::isApplied(CRTControllerManager::DockState state, const Profile &profile)
+{
+
+    /*
+     * Step 1: Catch up on screen changes and find the plan for the current config
+     * Step 2: Compare the CRTCs and the screen with what the plan would set
+     *
+     * This stays on the open connection, anything that doesn't
+     * match, including a dead connection, means a full apply.
+     */
+
+    /* Step 1 */
+
+    randr->waitForEvent(0);
+
+    if (!randr->getScreenResources(&resources)) {
+        return false;
+    }
 
-    vector<IniSection*> configControllers = config.getSections("CRTC");
+    modeIndex.valid = false;
 
-    if (configControllers.size() > resources->ncrtc) {
-        syslog(LOG_ERR, "Not enough CRT controllers to set config, aborting\n");
+    ApplyPlan *plan = findPlan(state, profile);
+
+    if (!plan) {
         return false;
     }
 
+    /* Step 2 */
+
+    snapshotCrtcs();
+
+    ScreenSize size;
+    randr->getScreenSize(&size);
+
+    return fingerprintCurrent(*plan, size) == plan->fingerprint;
+
+}
+
+uint64_t CRTControllerManager::fingerprintPlan(const ApplyPlan &plan)
+{
+
+    uint64_t hash = FNV_OFFSET;
+
+    for (const CRTConfig &controller : plan.controllers) {
+        uint64_t crtc = fingerprintCrtc(controller.crtc, controller.x, controller.y, controller.mode,
+                                        controller.rotation, controller.outputs);
+        hash = fnv1a(hash, &crtc, sizeof(crtc));
+
+        if (controller.mode != None) {
+            hash = fingerprintExtras(hash, controller.hasTransform ? &controller.transform : NULL,
+                                     controller.hasPanning ? &controller.panning : NULL);
+        }
+    }
+
+    hash = fnv1a(hash, &plan.primary, sizeof(plan.primary));
+
+    return fingerprintScreen(hash, plan.width, plan.height, plan.mm_width, plan.mm_height);
+
+}
+
+uint64_t CRTControllerManager::fingerprintCurrent(const ApplyPlan &plan, const ScreenSize &size)
+{
+
+    uint64_t hash = FNV_OFFSET;
+
+    for (const CRTConfig &controller : plan.controllers) {
+
+        auto it = snapshot.crtcs.find(controller.crtc);
+
+        if (it == snapshot.crtcs.end()) {
+            return 0;
+        }
+
+        const CrtcState &current = it->second;
+        uint64_t crtc = fingerprintCrtc(controller.crtc, current.x, current.y, current.mode,
+                                        current.rotation, current.outputs);
+
+        hash = fnv1a(hash, &crtc, sizeof(crtc));
+
+        if (current.mode != None) {
+            hash = fingerprintExtras(hash, controller.hasTransform ? &current.transform : NULL,
+                                     controller.hasPanning ? &current.panning : NULL);
+        }
+
+    }
+
+    /* Costs a round trip, so only ask when the plan sets one */
+    RROutput primary = plan.primary != None ? randr->getPrimaryOutput() : None;
+    hash = fnv1a(hash, &primary, sizeof(primary));
+
+    return fingerprintScreen(hash, size.width, size.height, size.mm_width, size.mm_height);
+
+}
+
+CRTControllerManager::ApplyPlan *CRTControllerManager::findPlan(CRTControllerManager::DockState state,
+                                                                const Profile &profile)
+{
+
+    auto it = plans.find(state);
+
+    if (it == plans.end()) {
+        return NULL;
+    }
+
+    ApplyPlan *plan = &it->second;
+
+    /* Any output, CRTC or mode list change bumps the config timestamp */
+    if (plan->configTimestamp != resources.configTimestamp || plan->profileGeneration != profile.generation) {
+        plans.erase(it);
+        return NULL;
+    }
+
+    return plan;
+
+}
+
+CRTControllerManager::ApplyPlan *CRTControllerManager::buildPlan(CRTControllerManager::DockState state,
+                                                                 const Profile &profile, bool wait)
+{
+
+    const vector<Profile::Controller> &configControllers = profile.controllers;
+
+    if (configControllers.size() > resources.crtcs.size()) {
+        Trace::log(LOG_ERR, "Not enough CRT controllers to set config, aborting\n");
+        return NULL;
+    }
+
     /*
      * Let's match a CRTC to some controller,
      * to see if the list of underlying controllers has changed
@@ -74,24 +558,21 @@ bool CRTControllerManager::applyConfiguration(CRTControllerManager::DockState st
 
     int matched = 0;
 
-    for (int i = 0; i < resources->ncrtc; i++) {
-        RRCrtc *rrCrtc = (resources->crtcs + i);
-        for (IniSection* section : configControllers) {
-            RRCrtc crtc = (RRCrtc) section->getInt("crtc");
-            if (*rrCrtc == crtc) {
+    for (RRCrtc rrCrtc : resources.crtcs) {
+        for (const Profile::Controller &controller : configControllers) {
+            if (rrCrtc == controller.crtc) {
                 matched++;
             }
         }
 
     }
 
-    if (matched != resources->ncrtc) {
-        syslog(LOG_ERR, "CRTC map changed, please re-run the configuration utlity\n");
-        return false;
+    if (matched != (int) resources.crtcs.size()) {
+        Trace::log(LOG_ERR, "CRTC map changed, please re-run the configuration utlity\n");
+        return NULL;
     }
 
-    vector<CRTConfig*> controllerConfigs;
-    bool isControllerConfigValid = true;
+    ApplyPlan plan;
 
     /*
      * For each section of CRTC's in the configuration
@@ -101,14 +582,14 @@ bool CRTControllerManager::applyConfiguration(CRTControllerManager::DockState st
      * output mode specified in the configuration file
      */
 
-    for (IniSection *configSection : configControllers) {
+    for (const Profile::Controller &configSection : configControllers) {
 
         /*
          * Get the stored outputs in the configuration
          * file and check if there are any, if there are
          * not we don't really need to configure anything
          */
-        vector<const char *> configOutputNames = configSection->getStringArray("outputs");
+        const vector<std::string> &configOutputNames = configSection.outputs;
 
         OutputConfigs configs;
         configs.mode = None;
@@ -121,144 +602,911 @@ bool CRTControllerManager::applyConfiguration(CRTControllerManager::DockState st
         }
 
         if (!outputOff) {
-            configs = getOutputConfigs(&configOutputNames, configSection);
+            configs = getOutputConfigs(configSection, wait);
         }
 
 
         if (configs.error != 0) {
-            syslog(LOG_ERR, "Mode lookup error: %s\n", strerror(-configs.error));
-            isControllerConfigValid = false;
-            break;
+            if (wait) {
+                Trace::log(LOG_ERR, "Mode lookup error: %s\n", strerror(-configs.error));
+                Trace::log(LOG_ERR, "Controller config is not valid, not committing changes to X\n");
+            }
+            return NULL;
         }
 
-        CRTConfig *crtcConfig = new CRTConfig;
+        CRTConfig crtcConfig;
+
+        crtcConfig.crtc = configSection.crtc;
+        crtcConfig.x = configSection.x;
+        crtcConfig.y = configSection.y;
+        crtcConfig.mode = configs.mode;
+        crtcConfig.rotation = configSection.rotation;
+        crtcConfig.outputs = configs.outputs;
+        crtcConfig.hasTransform = configSection.hasTransform;
+        crtcConfig.transform = configSection.transform;
+        crtcConfig.hasPanning = configSection.hasPanning;
+        crtcConfig.panning = configSection.panning;
+
+        plan.controllers.push_back(crtcConfig);
+
+    }
+
+    plan.width = profile.width;
+    plan.height = profile.height;
+    plan.mm_width = profile.mm_width;
+    plan.mm_height = profile.mm_height;
+
+    /* A primary output that isn't connected is simply not set */
+    plan.primary = None;
+
+    if (!profile.primary.empty()) {
 
-        crtcConfig->crtc = (RRCrtc) configSection->getInt("crtc");
-        crtcConfig->x = configSection->getInt("x");
-        crtcConfig->y = configSection->getInt("y");
-        crtcConfig->mode = configs.mode;
-        crtcConfig->rotation = (Rotation) configSection->getInt("rotation");
-        crtcConfig->outputs = (RROutput *) calloc(configs.outputs.size(), sizeof(RROutput));
-        crtcConfig->noutputs = configs.outputs.size();
+        RROutput primary = getRROutputByName(profile.primary.c_str());
 
-        for (size_t i = 0; i < crtcConfig->noutputs; i++) {
-            *(crtcConfig->outputs + i) = configs.outputs.at(i);
+        if (primary == None || primary == (RROutput) -EAGAIN) {
+            Trace::log(LOG_WARNING, "Primary output %s is not connected, leaving the primary alone\n",
+                       profile.primary.c_str());
+        } else {
+            plan.primary = primary;
         }
 
-        controllerConfigs.push_back(crtcConfig);
+    }
+
+    plan.configTimestamp = resources.configTimestamp;
+    plan.profileGeneration = profile.generation;
+    plan.fingerprint = fingerprintPlan(plan);
+
+    ApplyPlan &cached = plans[state];
+    cached = plan;
+
+    return &cached;
+
+}
+
+bool CRTControllerManager::commitPlan(const ApplyPlan &plan)
+{
+
+    /*
+     * Only touch the CRTCs that differ from what the server
+     * already shows, every mode set makes the monitors resync.
+     *
+     * Everything goes out under a single grab, in the order
+     * the server can accept it: CRTCs that go dark first, then
+     * the screen size, then the CRTCs that light up with their
+     * transforms and panning, then the primary output, so no
+     * CRTC ever has to fit into the old screen and each monitor
+     * goes through at most one mode set.
+     *
+     * The snapshot taken before the grab is the last known
+     * good layout. If the server refuses a CRTC, or nothing is
+     * lit once it caught up, the layout is put back from it.
+     */
+
+    CommitProgress progress;
+
+    rolledBack = false;
+
+    /* Screen */
+
+    ScreenSize current;
+    randr->getScreenSize(&current);
+
+    RROutput primary = plan.primary != None ? randr->getPrimaryOutput() : None;
+
+    uint64_t grabbed = Stats::now();
+
+    if (!dryRun) {
+        randr->grab();
+    }
+
+    bool committed = sendPlan(plan, current, primary, 0, &progress);
+
+    /* Xlib only hears of our own resize from its event, so go by what was sent */
+    ScreenSize left = current;
+
+    if (progress.screenChanged) {
+        left.width = plan.width;
+        left.height = plan.height;
+        left.mm_width = plan.mm_width;
+        left.mm_height = plan.mm_height;
+    }
+
+    /* Still under the grab, so nobody gets to see the half applied layout */
+    if (!committed) {
+        reconnect = true;
+        Trace::log(LOG_ERR, "The server refused the new layout, rolling back\n");
+        rollBack(current, primary, left);
+    }
+
+    /* Step 4: Release the server and wait for it to catch up, once */
+
+    uint64_t start = Stats::now();
+    unsigned long roundTrips = randr->getRoundTrips();
+
+    uint64_t holdNs = 0;
+    uint64_t blankNs = 0;
+
+    if (!dryRun) {
+
+        randr->ungrab();
+        randr->sync();
+
+        uint64_t synced = Stats::now();
+
+        holdNs = synced - grabbed;
+        blankNs = progress.blanked != 0 ? synced - progress.blanked : 0;
+
+        Stats::observe(Stats::SET_CRTC, progress.crtcNs);
+        Stats::observe(Stats::SERVER_GRAB, holdNs);
+        Trace::span(Trace::PHASE, "sync", start);
+        Trace::span(Trace::PHASE, "server grab", grabbed);
+
+        if (blankNs != 0) {
+            Stats::observe(Stats::BLANK, blankNs);
+            Trace::span(Trace::PHASE, "blank", progress.blanked);
+        }
+
+    }
+
+    reportPhase("sync", start, roundTrips);
+
+    Trace::log(LOG_INFO, "Configuration %s: %d CRTCs changed (%d disabled first), %d skipped, screen %s, "
+                     "server grabbed for %.3f ms, blank for %.3f ms, %lu X round trips\n",
+           dryRun ? "planned" : committed ? "applied" : "rolled back", progress.changed, progress.darkened,
+           progress.skipped, progress.screenChanged ? "resized" : "unchanged",
+           holdNs / 1e6, blankNs / 1e6, randr->getRoundTrips());
+
+    if (!committed || dryRun || progress.changed == 0) {
+        return committed;
+    }
+
+    /* Step 5: Make sure the user can still see something */
+
+    start = Stats::now();
+    roundTrips = randr->getRoundTrips();
+
+    bool verified = verifyCommit();
+
+    reportPhase("verify", start, roundTrips);
+
+    if (verified) {
+        return true;
+    }
+
+    Trace::log(LOG_ERR, "No output is lit after the apply, rolling back\n");
+
+    randr->grab();
+    rollBack(current, primary, left);
+    randr->ungrab();
+    randr->sync();
+
+    return false;
+
+}
+
+bool CRTControllerManager::sendPlan(const ApplyPlan &plan, const ScreenSize &current, RROutput primary,
+                                    uint64_t deadline, CommitProgress *progress)
+{
+
+    /*
+     * An apply gives up at the first CRTC the server refuses.
+     * A rollback carries on with the rest, as long as it has
+     * time left, to put back as much of the layout as it can.
+     */
+
+    bool sent = true;
+
+    bool screenUnchanged = plan.width == current.width &&
+                           plan.height == current.height &&
+                           plan.mm_width == current.mm_width &&
+                           plan.mm_height == current.mm_height;
+
+    /* Step 1: Disable the CRTCs that go dark or are in the way */
+
+    uint64_t start = Stats::now();
+    unsigned long roundTrips = randr->getRoundTrips();
+
+    for (const CRTConfig &controller : plan.controllers) {
+
+        /* A new panning is set in step 3 without a mode set, but it's still a change */
+        if (isCrtcUnchanged(&controller)) {
+            if (isPanningUnchanged(controller)) {
+                progress->skipped++;
+            } else {
+                progress->changed++;
+            }
+            continue;
+        }
+
+        progress->changed++;
+
+        if (!mustGoDark(plan, controller)) {
+            continue;
+        }
+
+        progress->darkened++;
+
+        if (progress->blanked == 0 && isCrtcLit(controller.crtc)) {
+            progress->blanked = Stats::now();
+        }
+
+        if (!setCrtc(controller, true)) {
+            sent = false;
+        }
+
+        if ((!sent && deadline == 0) || (deadline != 0 && Stats::now() > deadline)) {
+            progress->crtcNs += Stats::now() - start;
+            return false;
+        }
+
+    }
+
+    progress->crtcNs += Stats::now() - start;
+    Trace::span(Trace::PHASE, "disable", start, "crtcs", progress->darkened);
+    reportPhase("disable", start, roundTrips);
+
+    /* Step 2: Resize the screen once */
+
+    start = Stats::now();
+    roundTrips = randr->getRoundTrips();
+
+    if (!screenUnchanged) {
+
+        Trace::log(LOG_INFO, "Setting screen size: height: %d, width: %d\n", plan.height, plan.width);
+
+        if (report) {
+            reportRequest("XRRSetScreenSize(width=%d, height=%d, mm_width=%d, mm_height=%d)",
+                          plan.width, plan.height, plan.mm_width, plan.mm_height);
+        }
+
+        if (!dryRun) {
+            randr->setScreenSize(plan.width, plan.height, plan.mm_width, plan.mm_height);
+            Stats::observeSince(Stats::SET_SCREEN, start);
+            Trace::span(Trace::X_REQUEST, "XRRSetScreenSize", start, "width", plan.width, "height", plan.height);
+        }
+
+        progress->screenChanged = true;
+
+    }
+
+    reportPhase("set screen", start, roundTrips);
+
+    /* Step 3: Enable or reconfigure the rest */
+
+    start = Stats::now();
+    roundTrips = randr->getRoundTrips();
+
+    for (const CRTConfig &controller : plan.controllers) {
+
+        if (controller.mode == None) {
+            continue;
+        }
+
+        if (!isCrtcUnchanged(&controller)) {
+
+            /* A mode set on a lit CRTC blanks it as well */
+            if (progress->blanked == 0 && isCrtcLit(controller.crtc)) {
+                progress->blanked = Stats::now();
+            }
+
+            if (!setCrtc(controller, false)) {
+                sent = false;
+            }
+
+            if ((!sent && deadline == 0) || (deadline != 0 && Stats::now() > deadline)) {
+                progress->crtcNs += Stats::now() - start;
+                return false;
+            }
+
+        } else if (isPanningUnchanged(controller)) {
+            continue;
+        }
+
+        if (controller.hasPanning && !isPanningUnchanged(controller)) {
+            setPanning(controller);
+        }
+
+    }
+
+    if (plan.primary != None && plan.primary != primary) {
+
+        Trace::log(LOG_INFO, "Setting primary output: %lu\n", plan.primary);
+
+        if (report) {
+            reportRequest("XRRSetOutputPrimary(output=%s)", describeOutputs(vector<RROutput>(1, plan.primary)).c_str());
+        }
+
+        if (!dryRun) {
+            uint64_t primaryStart = Stats::now();
+            randr->setPrimaryOutput(plan.primary);
+            Trace::span(Trace::X_REQUEST, "XRRSetOutputPrimary", primaryStart, "output", (int64_t) plan.primary);
+        }
+
+    }
+
+    progress->crtcNs += Stats::now() - start;
+    Trace::span(Trace::PHASE, "enable", start, "crtcs", progress->changed - progress->darkened);
+    reportPhase("enable", start, roundTrips);
+
+    return sent;
+
+}
+
+void CRTControllerManager::rollBack(const ScreenSize &size, RROutput primary, const ScreenSize &left)
+{
+
+    /*
+     * Runs under the caller's grab and never waits for
+     * outputs, so it's done after one request per CRTC,
+     * or ROLLBACK_TIMEOUT_MS, whichever comes first.
+     *
+     * Step 1: Turn the snapshot taken before the apply into a plan
+     * Step 2: Find out where the apply left the CRTCs, the caller knows the screen size
+     * Step 3: Send the difference
+     */
+
+    uint64_t start = Stats::now();
+
+    rolledBack = true;
+    Stats::count(Stats::ROLLBACKS);
+
+    /* Step 1 */
+
+    ApplyPlan &plan = lastGood;
+
+    plan.width = size.width;
+    plan.height = size.height;
+    plan.mm_width = size.mm_width;
+    plan.mm_height = size.mm_height;
+    plan.primary = primary;
+    plan.controllers.resize(snapshot.crtcs.size());
+
+    size_t i = 0;
+
+    for (const auto &entry : snapshot.crtcs) {
+
+        CRTConfig &controller = plan.controllers[i++];
+        const CrtcState &state = entry.second;
+
+        controller.crtc = entry.first;
+        controller.x = state.x;
+        controller.y = state.y;
+        controller.mode = state.mode;
+        controller.rotation = state.rotation;
+        controller.outputs.assign(state.outputs.begin(), state.outputs.end());
+
+        /* Only the lit ones had their scaling and panning read */
+        controller.hasTransform = state.mode != None;
+        controller.transform = state.transform;
+        controller.hasPanning = state.mode != None;
+        controller.panning = state.panning;
+
+    }
+
+    /* Step 2 */
+
+    snapshotCrtcs();
+
+    RROutput currentPrimary = primary != None ? randr->getPrimaryOutput() : None;
+
+    /* Step 3 */
+
+    CommitProgress progress;
+
+    bool restored = sendPlan(plan, left, currentPrimary, start + ROLLBACK_TIMEOUT_MS * 1000000ULL, &progress);
+
+    Trace::span(Trace::PHASE, "rollback", start, "crtcs", progress.changed, "restored", restored);
+
+    if (restored) {
+        Trace::log(LOG_WARNING, "Rolled back to the last known good layout: %d CRTCs restored\n", progress.changed);
+    } else {
+        Trace::log(LOG_ERR, "The last known good layout could only be partially restored\n");
+    }
+
+}
+
+bool CRTControllerManager::verifyCommit()
+{
+
+    /* A layout that was dark before has nothing better to go back to */
+
+    bool wasLit = false;
+
+    for (const auto &entry : snapshot.crtcs) {
+        if (entry.second.mode != None && !entry.second.outputs.empty()) {
+            wasLit = true;
+            break;
+        }
+    }
+
+    if (!wasLit) {
+        return true;
+    }
+
+    randr->getCrtcInfos(resources.crtcs, &crtcInfos);
+
+    for (const CrtcInfo &info : crtcInfos) {
+        if (info.crtc != None && info.mode != None && !info.outputs.empty()) {
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+bool CRTControllerManager::mustGoDark(const ApplyPlan &plan, const CRTConfig &controller)
+{
+
+    if (controller.mode == None) {
+        return true;
+    }
+
+    auto it = snapshot.crtcs.find(controller.crtc);
+
+    if (it == snapshot.crtcs.end() || it->second.mode == None) {
+        return false;
+    }
+
+    const CrtcState &current = it->second;
+
+    /* It would stick out of a shrinking screen */
+
+    const ModeInfo *mode = getModeInfo(current.mode);
+
+    if (mode) {
+
+        bool sideways = (current.rotation & (RR_Rotate_90 | RR_Rotate_270)) != 0;
+        int width, height;
+
+        /* A scaled CRTC covers its transformed size */
+        current.transform.bounds((int) (sideways ? mode->height : mode->width),
+                                 (int) (sideways ? mode->width : mode->height), &width, &height);
+
+        if (current.x + width > plan.width || current.y + height > plan.height) {
+            return true;
+        }
+
+        /* So does the area it pans over */
+        if (current.panning.width > 0 && (current.panning.left + current.panning.width > plan.width ||
+                                          current.panning.top + current.panning.height > plan.height)) {
+            return true;
+        }
+
+    }
+
+    /* An output can only be driven by one CRTC, let go of the ones that move */
+
+    for (RROutput output : current.outputs) {
+        if (std::find(controller.outputs.begin(), controller.outputs.end(), output) == controller.outputs.end()) {
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+bool CRTControllerManager::isCrtcLit(RRCrtc crtc)
+{
+
+    auto it = snapshot.crtcs.find(crtc);
+
+    return it != snapshot.crtcs.end() && it->second.mode != None;
+
+}
+
+bool CRTControllerManager::setCrtc(const CRTConfig &controller, bool disable)
+{
+
+    RRMode mode = disable ? None : controller.mode;
+    int x = disable ? 0 : controller.x;
+    int y = disable ? 0 : controller.y;
+    int noutputs = disable ? 0 : (int) controller.outputs.size(); // cast: stack smashing: size_t (ul) copy into noutputs: int (d)
+
+    Trace::log(LOG_INFO, "Applying config to %4lu: mode: %4lu, outputs: %4d, x: %4d, y: %4d\n",
+           controller.crtc, mode, noutputs, x, y);
+
+    bool transform = !disable && controller.hasTransform;
+
+    if (report) {
+        if (transform) {
+            reportRequest("XRRSetCrtcTransform(crtc=%lu, matrix=[%.4f %.4f %.4f; %.4f %.4f %.4f; %.4f %.4f %.4f], filter=\"%s\")",
+                          controller.crtc,
+                          XFixedToDouble(controller.transform.matrix.matrix[0][0]),
+                          XFixedToDouble(controller.transform.matrix.matrix[0][1]),
+                          XFixedToDouble(controller.transform.matrix.matrix[0][2]),
+                          XFixedToDouble(controller.transform.matrix.matrix[1][0]),
+                          XFixedToDouble(controller.transform.matrix.matrix[1][1]),
+                          XFixedToDouble(controller.transform.matrix.matrix[1][2]),
+                          XFixedToDouble(controller.transform.matrix.matrix[2][0]),
+                          XFixedToDouble(controller.transform.matrix.matrix[2][1]),
+                          XFixedToDouble(controller.transform.matrix.matrix[2][2]),
+                          controller.transform.filter.c_str());
+        }
+
+        const ModeInfo *info = getModeInfo(mode);
+        reportRequest("XRRSetCrtcConfig(crtc=%lu, x=%d, y=%d, mode=%lu \"%s\" %.2f Hz, rotation=%d, outputs=[%s])",
+                      controller.crtc, x, y, mode,
+                      info ? info->name.c_str() : "None",
+                      info ? refreshRate(info->dotClock / 1000, info->hTotal, info->vTotal) : 0.0,
+                      (int) controller.rotation, disable ? "" : describeOutputs(controller.outputs).c_str());
+    }
+
+    if (dryRun) {
+        return true;
+    }
+
+    uint64_t start = Stats::now();
+
+    /* Goes out with the mode set below, not as a mode set of its own */
+    if (transform) {
+        randr->setCrtcTransform(controller.crtc, controller.transform);
+    }
+
+    bool set = randr->setCrtcConfig(controller.crtc, x, y, mode, controller.rotation,
+                                    controller.outputs.data(), noutputs);
+
+    if (!set) {
+        Trace::log(LOG_ERR, "Failed to set config on CRTC %lu\n", controller.crtc);
+    }
+
+    Trace::span(Trace::X_REQUEST, "XRRSetCrtcConfig", start, "crtc", (int64_t) controller.crtc, "mode", (int64_t) mode);
+
+    return set;
+
+}
+
+bool CRTControllerManager::isPanningUnchanged(const CRTConfig &controller)
+{
+
+    if (!controller.hasPanning) {
+        return true;
+    }
+
+    auto it = snapshot.crtcs.find(controller.crtc);
+
+    /* The snapshot has a dark CRTC as not panning */
+    return it != snapshot.crtcs.end() && it->second.panning == controller.panning;
+
+}
+
+void CRTControllerManager::setPanning(const CRTConfig &controller)
+{
+
+    const Panning &panning = controller.panning;
+
+    Trace::log(LOG_INFO, "Setting panning on %4lu: %dx%d+%d+%d\n",
+               controller.crtc, panning.width, panning.height, panning.left, panning.top);
+
+    if (report) {
+        reportRequest("XRRSetPanning(crtc=%lu, area=%dx%d+%d+%d, tracking=%dx%d+%d+%d, border=%d/%d/%d/%d)",
+                      controller.crtc, panning.width, panning.height, panning.left, panning.top,
+                      panning.trackWidth, panning.trackHeight, panning.trackLeft, panning.trackTop,
+                      panning.borderLeft, panning.borderTop, panning.borderRight, panning.borderBottom);
+    }
+
+    if (dryRun) {
+        return;
+    }
+
+    uint64_t start = Stats::now();
+
+    if (!randr->setPanning(controller.crtc, panning)) {
+        Trace::log(LOG_ERR, "Failed to set panning on CRTC %lu\n", controller.crtc);
+    }
+
+    Trace::span(Trace::X_REQUEST, "XRRSetPanning", start, "crtc", (int64_t) controller.crtc);
+
+}
+
+void CRTControllerManager::setDryRun(bool dryRun)
+{
+    this->dryRun = dryRun;
+}
+
+void CRTControllerManager::reportPhase(const char *name, uint64_t start, unsigned long roundTrips)
+{
+
+    if (!report) {
+        return;
+    }
+
+    ApplyReport::Phase phase;
+
+    phase.name = name;
+    phase.roundTrips = randr->getRoundTrips() - roundTrips;
+    phase.ns = Stats::now() - start;
+
+    report->phases.push_back(phase);
+
+}
+
+void CRTControllerManager::reportRequest(const char *format, ...)
+{
+
+    char line[1024];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    report->requests.push_back(line);
+
+}
+
+std::string CRTControllerManager::describeOutputs(const vector<RROutput> &outputs)
+{
+
+    std::string names;
+
+    for (RROutput output : outputs) {
+
+        auto it = snapshot.outputs.find(output);
+
+        if (!names.empty()) {
+            names += ", ";
+        }
+
+        names += it != snapshot.outputs.end() ? it->second.name : std::to_string(output);
+
+    }
+
+    return names;
+
+}
+
+bool CRTControllerManager::writeConfigToDisk(CRTControllerManager::DockState state)
+{
+
+    Ini ini;
+
+    /*
+     * Step 1-3: Capture the current configuration
+     * Step 4: Write the config files
+     */
+
+    if (!captureConfig(ini)) {
+        return false;
+    }
+
+    /* Step 4 */
+
+    if (state != DOCKED && state != UNDOCKED) {
+        return false;
+    }
+
+    /* The directories of additional displays may not exist yet */
+    if (mkdir(configDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+        Trace::log(LOG_ERR, "Can't create %s: %s\n", configDirectory.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!writeProfile(ini, getConfigLocation(state))) {
+        return false;
+    }
+
+    /*
+     * Also store it under the fingerprint of the connected
+     * monitors, so the daemon can tell docks and desks apart
+     */
+
+    std::string directory = getProfileDirectory();
+
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        Trace::log(LOG_ERR, "Can't create %s: %s\n", directory.c_str(), strerror(errno));
+        return true;
+    }
+
+    std::string path = getProfilePath(state, fingerprintSnapshot(state));
+
+    if (!writeProfile(ini, path)) {
+        Trace::log(LOG_ERR, "Can't write %s\n", path.c_str());
+    }
+
+    return true;
+
+}
+
+std::string CRTControllerManager::getConfigLocation(CRTControllerManager::DockState state)
+{
+    return configDirectory + "/" + (state == DOCKED ? CONFIG_NAME_DOCKED : CONFIG_NAME_UNDOCKED);
+}
+
+std::string CRTControllerManager::getProfileDirectory()
+{
+    return configDirectory + "/" CONFIG_NAME_PROFILES;
+}
+
+std::string CRTControllerManager::getHistoryPath(const std::string &path, int version)
+{
+    return path + "." + std::to_string(version);
+}
+
+std::string CRTControllerManager::getProfilePath(CRTControllerManager::DockState state, uint64_t fingerprint)
+{
+
+    char name[64];
+
+    snprintf(name, sizeof(name), "/%s-%016llx.conf", state == DOCKED ? "docked" : "undocked",
+             (unsigned long long) fingerprint);
+
+    return getProfileDirectory() + name;
+
+}
+
+uint64_t CRTControllerManager::getFingerprint(CRTControllerManager::DockState state)
+{
+
+    if (!randr->getScreenResources(&resources)) {
+        Trace::log(LOG_ERR, "Failed to get resources!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    modeIndex.valid = false;
+
+    snapshotOutputs();
+
+    return fingerprintSnapshot(state);
+
+}
+
+uint64_t CRTControllerManager::fingerprintSnapshot(CRTControllerManager::DockState state)
+{
+
+    /*
+     * Hash the dock state and the name and EDID of every
+     * connected output, in name order so the result does
+     * not depend on the order the server lists them in
+     */
+
+    vector<const std::string*> &names = fingerprintNames;
+    vector<RROutput> &connected = fingerprintOutputs;
+
+    names.clear();
+    connected.clear();
+
+    /* The map owns the names, sort pointers instead of copies */
+    for (auto &entry : snapshot.outputsByName) {
+        if (snapshot.outputs[entry.second].connection == RR_Connected) {
+            names.push_back(&entry.first);
+        }
+    }
+
+    std::sort(names.begin(), names.end(), [](const std::string *a, const std::string *b) { return *a < *b; });
+
+    for (const std::string *name : names) {
+        connected.push_back(snapshot.outputsByName[*name]);
+    }
+
+    refreshEdids(connected);
+
+    uint64_t hash = FNV_OFFSET;
+    unsigned char dockState = (unsigned char) state;
 
-    }
+    hash = fnv1a(hash, &dockState, sizeof(dockState));
 
-    /* Apply the configs */
+    for (size_t i = 0; i < names.size(); i++) {
+        const std::string &edid = edidCache[connected[i]].edid;
+        uint32_t length = (uint32_t) edid.size();
 
-    if (!isControllerConfigValid) {
-        syslog(LOG_ERR, "Controller config is not valid, not committing changes to X\n");
-        return false;
+        hash = fnv1a(hash, names[i]->c_str(), names[i]->size() + 1);
+        hash = fnv1a(hash, &length, sizeof(length));
+        hash = fnv1a(hash, edid.data(), edid.size());
     }
 
-    XGrabServer(display);
+    return hash;
 
-    for (CRTConfig *controller : controllerConfigs) {
+}
 
-        syslog(LOG_INFO, "Applying config to %4lu: mode: %4lu, outputs: %4zu, x: %4d, y: %4d\n",
-               controller->crtc, controller->mode, controller->noutputs, controller->x, controller->y);
+void CRTControllerManager::refreshEdids(const vector<RROutput> &outputs)
+{
 
-#ifndef DRYRUN
+    vector<RROutput> stale;
 
-        XRRSetCrtcConfig(display,
-                         resources,
-                         controller->crtc,
-                         CurrentTime,
-                         controller->x,
-                         controller->y,
-                         controller->mode,
-                         controller->rotation,
-                         controller->outputs,
-                         (int) controller->noutputs); // cast: stack smashing: size_t (ul) copy into noutputs: int (d)
+    for (RROutput output : outputs) {
 
-#endif // DRYRUN
+        auto it = edidCache.find(output);
 
-        free(controller->outputs);
-        delete controller;
+        if (it == edidCache.end() ||
+            it->second.connection != snapshot.outputs[output].connection ||
+            it->second.configTimestamp != resources.configTimestamp) {
+            stale.push_back(output);
+        }
 
     }
 
-    XUngrabServer(display);
-    XSync(display, 0);
-    XGrabServer(display);
-
-    /* Step 4 */
+    if (stale.empty()) {
+        return;
+    }
 
-    IniSection *screenSection = config.getSection("Screen");
+    /* Reading EDIDs can make the driver probe DDC, fetch only what changed */
+    vector<std::string> edids;
+    randr->getOutputEdids(stale, &edids);
 
-    int width = screenSection->getInt("width");
-    int height = screenSection->getInt("height");
+    for (size_t i = 0; i < stale.size(); i++) {
 
-    int mm_height = screenSection->getInt("mm_height");
-    int mm_width = screenSection->getInt("mm_width");
+        EdidCacheEntry &entry = edidCache[stale[i]];
+        const OutputState &state = snapshot.outputs[stale[i]];
 
-    syslog(LOG_INFO, "Setting screen size: height: %d, width: %d\n", height, width);
+        entry.connection = state.connection;
+        entry.configTimestamp = resources.configTimestamp;
+        entry.edid = edids[i];
 
-#ifndef DRYRUN
+        if (entry.identity.parse(entry.edid)) {
+            Trace::log(LOG_INFO, "Output %s: %s %s (product %04x, serial %u)\n", state.name.c_str(),
+                   entry.identity.vendor.c_str(), entry.identity.name.c_str(),
+                   entry.identity.product, entry.identity.serial);
+        }
 
-    XRRSetScreenSize(display, window, width, height, mm_width, mm_height);
+    }
 
-#endif // DRYRUN
+}
 
-    XUngrabServer(display);
+bool CRTControllerManager::hasPendingOutputs()
+{
 
-    XSync(display, 0);
+    /* The driver is still probing these, they may turn out connected */
+    for (const auto &entry : snapshot.outputs) {
+        if (entry.second.connection == RR_UnknownConnection) {
+            return true;
+        }
+    }
 
-    return true;
+    return false;
 
 }
 
-bool CRTControllerManager::writeConfigToDisk(CRTControllerManager::DockState state)
+bool CRTControllerManager::waitForOutputChange(uint64_t deadline)
 {
+    return waitForRandREvent(deadline);
+}
 
-    Ini ini;
+bool CRTControllerManager::captureConfig(Ini &ini)
+{
 
     /*
      * Step 1: Reload the X11 resources
      * Step 2: Serialize the screen
      * Step 3: Serialize the XRRCrtcInfo and friends file structure
-     * Step 4: Write the config files
      */
 
     /* Step 1 */
 
-    XRRFreeScreenResources(resources);
-    resources = XRRGetScreenResources(display, window);
-
-    XSync(display, 0);
+    refreshResources();
 
     /* Step 2 */
 
-    int height = DisplayHeight(display, screen);
-    int width = DisplayWidth(display, screen);
-    int mm_width = DisplayWidthMM(display, screen);
-    int mm_height = DisplayHeightMM(display, screen);
+    ScreenSize size;
+    randr->getScreenSize(&size);
 
     IniSection *screen = new IniSection("Screen");
 
-    screen->setInt("height", height);
-    screen->setInt("width", width);
-    screen->setInt("mm_height", mm_height);
-    screen->setInt("mm_width", mm_width);
+    screen->setInt("height", size.height);
+    screen->setInt("width", size.width);
+    screen->setInt("mm_height", size.mm_height);
+    screen->setInt("mm_width", size.mm_width);
+
+    RROutput primary = randr->getPrimaryOutput();
+    auto primaryOutput = snapshot.outputs.find(primary);
+
+    if (primary != None && primaryOutput != snapshot.outputs.end()) {
+        screen->setString("primary", primaryOutput->second.name.c_str());
+    }
 
     ini.addSection(screen);
 
     /* Step 3 */
 
-    for (int i = 0; i < resources->ncrtc; i++) {
+    for (RRCrtc crtc : resources.crtcs) {
 
         IniSection *section = new IniSection("CRTC");
 
-        RRCrtc *crtc = (resources->crtcs + i);
-        XRRCrtcInfo *info = XRRGetCrtcInfo(display, resources, *crtc);
+        CrtcState *info = &snapshot.crtcs[crtc];
 
         /* Set basic info */
-        section->setInt("crtc", (int) *crtc);
+        section->setInt("crtc", (int) crtc);
         section->setInt("x", info->x);
         section->setInt("y", info->y);
         section->setInt("rotation", (int) info->rotation);
@@ -273,102 +1521,149 @@ bool CRTControllerManager::writeConfigToDisk(CRTControllerManager::DockState sta
             modeFound = true;
         }
 
-        // the mode is active, find name
+        // the mode is active, find name and timing
         if (!modeFound) {
-            for (int j = 0; j < resources->nmode; j++) {
-                XRRModeInfo *mode = (resources->modes + j);
-                if (info->mode == mode->id) {
-                    section->setString("mode", mode->name);
-                    modeFound = true;
-                }
+
+            const ModeInfo *mode = getModeInfo(info->mode);
+
+            if (mode) {
+                section->setString("mode", mode->name.c_str());
+                section->setInt("mode_width", (int) mode->width);
+                section->setInt("mode_height", (int) mode->height);
+                section->setInt("mode_clock", (int) (mode->dotClock / 1000));
+                section->setInt("mode_htotal", (int) mode->hTotal);
+                section->setInt("mode_vtotal", (int) mode->vTotal);
+                section->setInt("mode_flags", (int) mode->modeFlags);
+                modeFound = true;
             }
+
         }
 
         if (!modeFound) {
-            syslog(LOG_ERR, "Failed to find output mode name!\n");
+            Trace::log(LOG_ERR, "Failed to find output mode name!\n");
             return false;
         }
 
         /* Set the outputs */
 
-        vector<const char*> names;
+        vector<const char*> &names = captureNames;
+
+        names.clear();
 
-        for (int k = 0; k < info->noutput; k++) {
-            RROutput *output = (info->outputs + k);
-            XRROutputInfo *info = XRRGetOutputInfo(display, resources, *output);
+        for (RROutput output : info->outputs) {
 
-            /* XRROutputInfo goes out of scope here,
-             * we need to copy the string to the heap,
-             * add it to the ini and free it later
-             */
-            char *name_st = (char*) calloc(strlen(info->name) + 1, sizeof(char));
-            strcpy(name_st, info->name);
-            names.push_back(name_st);
+            auto it = snapshot.outputs.find(output);
+
+            if (it == snapshot.outputs.end()) {
+                Trace::log(LOG_ERR, "Output %lu missing from the snapshot!\n", output);
+                continue;
+            }
 
-            XRRFreeOutputInfo(info);
+            /* The snapshot owns the string, no need to copy it */
+            names.push_back(it->second.name.c_str());
         }
 
         section->setStringArray("outputs", &names);
 
-        for (const char *ptr : names) {
-            free((void*)ptr);
-        }
+        /* Scaling and panning, in the syntax xrandr takes */
 
-        ini.addSection(section);
+        if (info->mode != None) {
 
-        XRRFreeCrtcInfo(info);
+            char value[512];
+            const XTransform &matrix = info->transform.matrix;
 
-    }
+            snprintf(value, sizeof(value), "%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g",
+                     XFixedToDouble(matrix.matrix[0][0]), XFixedToDouble(matrix.matrix[0][1]),
+                     XFixedToDouble(matrix.matrix[0][2]), XFixedToDouble(matrix.matrix[1][0]),
+                     XFixedToDouble(matrix.matrix[1][1]), XFixedToDouble(matrix.matrix[1][2]),
+                     XFixedToDouble(matrix.matrix[2][0]), XFixedToDouble(matrix.matrix[2][1]),
+                     XFixedToDouble(matrix.matrix[2][2]));
+            section->setString("transform", value);
 
-    /* Step 4 */
+            if (!info->transform.filter.empty()) {
+                section->setString("filter", info->transform.filter.c_str());
+            }
+
+            if (!info->transform.params.empty()) {
+
+                std::string params;
+
+                for (XFixed param : info->transform.params) {
+                    snprintf(value, sizeof(value), "%s%.10g", params.empty() ? "" : ",", XFixedToDouble(param));
+                    params += value;
+                }
+
+                section->setString("filter_params", params.c_str());
+
+            }
+
+            const Panning &panning = info->panning;
+
+            snprintf(value, sizeof(value), "%dx%d+%d+%d/%dx%d+%d+%d/%d/%d/%d/%d",
+                     panning.width, panning.height, panning.left, panning.top,
+                     panning.trackWidth, panning.trackHeight, panning.trackLeft, panning.trackTop,
+                     panning.borderLeft, panning.borderTop, panning.borderRight, panning.borderBottom);
+            section->setString("panning", value);
+
+        }
+
+        ini.addSection(section);
 
-    switch (state) {
-    case DOCKED:
-        return ini.writeIni(CONFIG_LOCATION_DOCKED);
-    case UNDOCKED:
-        return ini.writeIni(CONFIG_LOCATION_UNDOCKED);
     }
 
-    return false;
+    return true;
 
 }
 
-CRTControllerManager::OutputConfigs CRTControllerManager::getOutputConfigs(vector<const char *> *configOutputNames,
-                                                                           IniSection *configSection) {
+CRTControllerManager::OutputConfigs CRTControllerManager::getOutputConfigs(const Profile::Controller &configSection,
+                                                                           bool wait) {
 
     OutputConfigs configs;
     configs.mode = None;
     configs.error = 0;
 
     /* The output is off */
-    if (strcmp(configSection->getString("mode"), "None") == 0) {
+    if (configSection.mode == "None") {
         configs.error = 0;
         configs.mode = None;
         return configs;
     }
 
-    for (const char *configOutput : *configOutputNames) {
+    /*
+     * The outputs usually come up some time after the
+     * dock event, so we share one deadline across all of
+     * them and wake up on RandR notifications instead of
+     * polling the server on a fixed interval
+     */
+
+    uint64_t deadline = Stats::now() + OUTPUT_READY_TIMEOUT_MS * 1000000ULL;
+
+    for (const std::string &outputName : configSection.outputs) {
+
+        const char *configOutput = outputName.c_str();
 
         RROutput output;
-        int attempts = 0;
 
         while ((output = getRROutputByName(configOutput)) == ((XID) -EAGAIN)) {
-            syslog(LOG_ERR, "Trying to find (%s) again: (%s)\n", configOutput, strerror(EAGAIN));
-            /* Wait for the hardware to sanitize */
-            usleep(250000);
-            if (resources) {
-                XRRFreeScreenResources(resources);
+            if (!wait) {
+                configs.error = -EAGAIN;
+                return configs;
             }
-            resources = XRRGetScreenResources(display, window);
-            if (attempts > 10) {
+            Trace::log(LOG_INFO, "Waiting for (%s) to connect\n", configOutput);
+            Trace::instant(Trace::RETRY, "output not connected", NULL, 0, NULL, 0, configOutput);
+            Stats::count(Stats::OUTPUT_RETRIES);
+            /* Sleep until RandR tells us something changed */
+            if (!waitForRandREvent(deadline)) {
                 output = None;
                 break;
             }
-            attempts++;
+            refreshResources();
         }
 
         if (output == None) {
-            syslog(LOG_ERR, "Error: output from config (%s) not found on this machine\n", configOutput);
+            if (wait) {
+                Trace::log(LOG_ERR, "Error: output from config (%s) not found on this machine\n", configOutput);
+            }
             configs.error = -ENODEV;
             return configs;
         }
@@ -376,33 +1671,32 @@ CRTControllerManager::OutputConfigs CRTControllerManager::getOutputConfigs(vecto
         configs.outputs.push_back(output);
 
         RRMode configMode;
-        attempts = 0;
-        const char *configOutputMode = configSection->getString("mode");
+        const char *configOutputMode = configSection.mode.c_str();
 
-        while ((configMode = getRRModeByNameSupported(configOutputMode, output)) == ((XID) -EAGAIN)) {
+        while ((configMode = resolveMode(configSection, output)) == ((XID) -EAGAIN)) {
 
-            syslog(LOG_ERR, "Trying to find (%s) again: (%s)\n", configOutputMode, strerror(EAGAIN));
-
-            if (attempts > 10) {
-                configMode = None;
-                break;
+            if (!wait) {
+                configs.error = -EAGAIN;
+                return configs;
             }
 
-            /* Wait for the hardware to sanitize */
-            usleep(250000);
+            Trace::log(LOG_INFO, "Waiting for mode (%s) on (%s)\n", configOutputMode, configOutput);
+            Trace::instant(Trace::RETRY, "mode not available", "output", (int64_t) output, NULL, 0, configOutputMode);
+            Stats::count(Stats::OUTPUT_RETRIES);
 
-            if (resources) {
-                XRRFreeScreenResources(resources);
+            if (!waitForRandREvent(deadline)) {
+                configMode = None;
+                break;
             }
 
-            resources = XRRGetScreenResources(display, window);
-
-            attempts++;
+            refreshResources();
 
         }
 
         if (configMode == None) {
-            syslog(LOG_ERR, "Output mode %s not found for output %s\n", configSection->getString("mode"), configOutput);
+            if (wait) {
+                Trace::log(LOG_ERR, "Output mode %s not found for output %s\n", configOutputMode, configOutput);
+            }
             configs.error = -ENODEV;
             return configs;
         }
@@ -410,7 +1704,9 @@ CRTControllerManager::OutputConfigs CRTControllerManager::getOutputConfigs(vecto
         if (configs.mode == None) {
             configs.mode = configMode;
         } else if (configMode != configs.mode) {
-            syslog(LOG_ERR, "Mode mismatch between monitors, did you change monitors? Re-run the config.\n");
+            if (wait) {
+                Trace::log(LOG_ERR, "Mode mismatch between monitors, did you change monitors? Re-run the config.\n");
+            }
             configs.error = -ENODEV;
             configs.mode = None;
             return configs;
@@ -420,107 +1716,342 @@ CRTControllerManager::OutputConfigs CRTControllerManager::getOutputConfigs(vecto
     }
 
     if (configs.mode == None && configs.outputs.size() > 0) {
-        syslog(LOG_ERR, "runtime error\n");
+        Trace::log(LOG_ERR, "runtime error\n");
     }
 
     return configs;
 
 }
 
-bool CRTControllerManager::isOutputModeSupported(RROutput output, RRMode mode) {
+bool CRTControllerManager::isCrtcUnchanged(const CRTConfig *config) {
 
-    XRROutputInfo *outputInfo = XRRGetOutputInfo(display, resources, output);
+    auto it = snapshot.crtcs.find(config->crtc);
 
-    for (int i = 0; i < outputInfo->nmode; i++) {
-        RRMode temp = *(outputInfo->modes + i);
-        if (mode == temp) {
-            XRRFreeOutputInfo(outputInfo);
-            return true;
+    if (it == snapshot.crtcs.end()) {
+        return false;
+    }
+
+    const CrtcState &current = it->second;
+
+    if (current.mode != config->mode) {
+        return false;
+    }
+
+    /* A disabled CRTC has no meaningful position */
+    if (config->mode == None) {
+        return current.outputs.empty();
+    }
+
+    if (current.x != config->x || current.y != config->y || current.rotation != config->rotation) {
+        return false;
+    }
+
+    /* A new transform needs a mode set, panning doesn't */
+    if (config->hasTransform && !(current.transform == config->transform)) {
+        return false;
+    }
+
+    if (current.outputs.size() != config->outputs.size()) {
+        return false;
+    }
+
+    for (RROutput output : config->outputs) {
+        if (std::find(current.outputs.begin(), current.outputs.end(), output) == current.outputs.end()) {
+            return false;
         }
     }
 
-    XRRFreeOutputInfo(outputInfo);
-    return false;
+    return true;
+
+}
+
+bool CRTControllerManager::isOutputModeSupported(RROutput output, RRMode mode) {
+
+    auto it = snapshot.outputs.find(output);
+
+    if (it == snapshot.outputs.end()) {
+        return false;
+    }
+
+    return it->second.modes.count(mode) > 0;
 
 }
 
 void CRTControllerManager::connectToX() {
 
-    display = XOpenDisplay(NULL);
+    if (!randr->connect()) {
+        exit(EXIT_FAILURE);
+    }
+
+    reconnect = false;
 
-    if (!display) {
-        syslog(LOG_ERR, "Error opening display!\n");
+    /* The snapshot is taken lazily, a cached plan may not need it */
+    if (!randr->getScreenResources(&resources)) {
+        Trace::log(LOG_ERR, "Failed to get resources!\n");
         exit(EXIT_FAILURE);
     }
 
-    screen = DefaultScreen(display);
-    window = RootWindow(display, screen);
+    modeIndex.valid = false;
+
+}
 
-    resources = XRRGetScreenResources(display, window);
+bool CRTControllerManager::refreshConnection() {
 
-    if (!resources) {
-        syslog(LOG_ERR, "Failed to get resources!\n");
-        exit(EXIT_FAILURE);
+    /* Lets Xlib see the screen changes since the last apply */
+    randr->waitForEvent(0);
+
+    if (!randr->getScreenResources(&resources)) {
+        Trace::log(LOG_WARNING, "The X connection stopped answering, reconnecting\n");
+        return false;
     }
 
+    modeIndex.valid = false;
+
+    return true;
 
 }
 
 void CRTControllerManager::disconnectFromX() {
 
-    if (display) {
-        XCloseDisplay(display);
+    randr->disconnect();
+
+}
+
+void CRTControllerManager::refreshResources() {
+
+    if (!randr->getScreenResources(&resources)) {
+        Trace::log(LOG_ERR, "Failed to get resources!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    modeIndex.valid = false;
+
+    takeSnapshot();
+
+}
+
+void CRTControllerManager::takeSnapshot() {
+
+    snapshotOutputs();
+    snapshotCrtcs();
+
+}
+
+void CRTControllerManager::snapshotOutputs() {
+
+    /*
+     * Update the entries in place instead of rebuilding the
+     * maps, nodes are only allocated for outputs never seen before
+     */
+
+    unsigned long epoch = ++snapshot.outputEpoch;
+
+    randr->getOutputInfos(resources.outputs, &outputInfos);
+
+    for (const OutputInfo &info : outputInfos) {
+
+        if (info.output == None) {
+            continue;
+        }
+
+        OutputState &state = snapshot.outputs[info.output];
+
+        if (state.name != info.name) {
+            snapshot.outputsByName.erase(state.name);
+            state.name = info.name;
+        }
+
+        state.connection = info.connection;
+        state.preferred = info.npreferred > 0 && !info.modes.empty() ? info.modes[0] : None;
+        state.seen = epoch;
+
+        /* Refilling the set reallocates its nodes, skip it when nothing changed */
+        if (state.modeList != info.modes) {
+            state.modeList = info.modes;
+            state.modes.clear();
+            state.modes.insert(info.modes.begin(), info.modes.end());
+        }
+
+        snapshot.outputsByName[state.name] = info.output;
+
     }
 
-    if (resources) {
-        XRRFreeScreenResources(resources);
+    for (auto it = snapshot.outputs.begin(); it != snapshot.outputs.end(); ) {
+        if (it->second.seen != epoch) {
+            snapshot.outputsByName.erase(it->second.name);
+            it = snapshot.outputs.erase(it);
+        } else {
+            ++it;
+        }
     }
 
 }
 
-RROutput CRTControllerManager::getRROutputByName(const char *outputName) {
+void CRTControllerManager::snapshotCrtcs() {
 
-    for (int i = 0; i < resources->noutput; i++) {
-        RROutput rrOutput = *(resources->outputs + i);
-        XRROutputInfo *outputInfo = XRRGetOutputInfo(display, resources, rrOutput);
+    unsigned long epoch = ++snapshot.crtcEpoch;
 
-        if (strcmp(outputInfo->name, outputName) == 0) {
+    randr->getCrtcInfos(resources.crtcs, &crtcInfos);
 
-            /* Output is there but not connected, try again */
-            if (outputInfo->connection != RR_Connected) {
-                XRRFreeOutputInfo(outputInfo);
+    for (const CrtcInfo &info : crtcInfos) {
 
-                /* Do an intentional overflow to 18446744073709551605 to signal EAGAIN */
-                return -EAGAIN;
-            }
+        if (info.crtc == None) {
+            continue;
+        }
+
+        CrtcState &state = snapshot.crtcs[info.crtc];
+
+        state.x = info.x;
+        state.y = info.y;
+        state.mode = info.mode;
+        state.rotation = info.rotation;
+        state.outputs.assign(info.outputs.begin(), info.outputs.end());
+        state.seen = epoch;
+
+        if (info.mode == None) {
+            state.transform.reset();
+            memset(&state.panning, 0, sizeof(state.panning));
+        }
+
+    }
+
+    /* A dark CRTC has nothing to scale or pan, only ask about the lit ones */
+
+    litCrtcs.clear();
+
+    for (const CrtcInfo &info : crtcInfos) {
+        if (info.crtc != None && info.mode != None) {
+            litCrtcs.push_back(info.crtc);
+        }
+    }
+
+    if (!litCrtcs.empty()) {
+
+        randr->getCrtcTransforms(litCrtcs, &transformInfos);
+        randr->getPannings(litCrtcs, &panningInfos);
+
+        for (size_t i = 0; i < litCrtcs.size(); i++) {
+            CrtcState &state = snapshot.crtcs[litCrtcs[i]];
+            state.transform = transformInfos[i];
+            state.panning = panningInfos[i];
+        }
+
+    }
 
-            XRRFreeOutputInfo(outputInfo);
-            return rrOutput;
+    for (auto it = snapshot.crtcs.begin(); it != snapshot.crtcs.end(); ) {
+        if (it->second.seen != epoch) {
+            it = snapshot.crtcs.erase(it);
+        } else {
+            ++it;
         }
+    }
+
+}
+
+bool CRTControllerManager::waitForRandREvent(uint64_t deadline) {
+
+    uint64_t now = Stats::now();
+
+    if (now >= deadline) {
+        return false;
+    }
+
+    long remaining = (long) ((deadline - now) / 1000000ULL);
+    bool reprobe = remaining > OUTPUT_REPROBE_INTERVAL_MS;
+
+    if (randr->waitForEvent(reprobe ? OUTPUT_REPROBE_INTERVAL_MS : (int) remaining)) {
+        return true;
+    }
+
+    /* Nothing arrived, re-query anyway in case the driver does not send hotplug events */
+    return reprobe;
+
+}
+
+RROutput CRTControllerManager::getRROutputByName(const char *outputName) {
 
-        XRRFreeOutputInfo(outputInfo);
+    auto it = snapshot.outputsByName.find(outputName);
 
+    if (it == snapshot.outputsByName.end()) {
+        return None;
     }
 
-    return None;
+    /* Output is there but not connected, try again */
+    if (snapshot.outputs[it->second].connection != RR_Connected) {
+
+        /* Do an intentional overflow to 18446744073709551605 to signal EAGAIN */
+        return -EAGAIN;
+    }
+
+    return it->second;
 
 }
 
-RRMode CRTControllerManager::getRRModeByNameSupported(const char *modeName, RROutput output)
+void CRTControllerManager::indexModes()
 {
-    for (int i = 0; i < resources->nmode; i++) {
 
-        XRRModeInfo *modeInfo = (resources->modes + i);
+    if (modeIndex.valid) {
+        return;
+    }
+
+    /* RandR modes never change once created, the same ids mean the same index */
+    bool same = modeIndex.ids.size() == resources.modes.size();
 
-        if (strcmp(modeName, modeInfo->name) == 0) {
-            if (isOutputModeSupported(output, modeInfo->id)) {
-                return modeInfo->id;
-            }
+    for (size_t i = 0; same && i < resources.modes.size(); i++) {
+        same = modeIndex.ids[i] == resources.modes[i].id;
+    }
 
-        }
+    if (same && !modeIndex.ids.empty()) {
+        modeIndex.valid = true;
+        return;
+    }
+
+    modeIndex.ids.clear();
+    modeIndex.byId.clear();
+    modeIndex.byTiming.clear();
+    modeIndex.bySize.clear();
+    modeIndex.byName.clear();
+
+    for (size_t i = 0; i < resources.modes.size(); i++) {
+
+        const ModeInfo &mode = resources.modes[i];
+
+        modeIndex.ids.push_back(mode.id);
+        modeIndex.byId[mode.id] = i;
+        modeIndex.byTiming[timingKey(mode.width, mode.height, mode.dotClock / 1000,
+                                     mode.hTotal, mode.vTotal, mode.modeFlags)].push_back(i);
+        modeIndex.bySize[sizeKey(mode.width, mode.height)].push_back(i);
+        modeIndex.byName[mode.name].push_back(i);
+
+    }
+
+    modeIndex.valid = true;
 
+}
+
+const ModeInfo *CRTControllerManager::getModeInfo(RRMode mode)
+{
+
+    indexModes();
+
+    auto it = modeIndex.byId.find(mode);
+
+    if (it == modeIndex.byId.end()) {
+        return NULL;
     }
 
+    return &resources.modes[it->second];
+
+}
+
+RRMode CRTControllerManager::resolveMode(const Profile::Controller &controller, RROutput output)
+{
+
+    indexModes();
+
+    const Profile::Timing &timing = controller.timing;
+    const OutputState &state = snapshot.outputs[output];
+
     /*
      * The output mode maybe is not there? Here, we
      * actually overflow the unsigned int to 18446744073709551605
@@ -528,6 +2059,108 @@ RRMode CRTControllerManager::getRRModeByNameSupported(const char *modeName, RROu
      * maybe find the resources we are looking for.
      */
 
-    return -EAGAIN;
+    /* Profiles from before timings were recorded can only go by name */
+    if (timing.dotClock == 0) {
+
+        auto named = modeIndex.byName.find(controller.mode);
+
+        if (named == modeIndex.byName.end()) {
+            return -EAGAIN;
+        }
+
+        RRMode found = None;
+
+        for (size_t i : named->second) {
+
+            RRMode id = resources.modes[i].id;
+
+            if (!state.modes.count(id)) {
+                continue;
+            }
+
+            if (id == state.preferred) {
+                return id;
+            }
+
+            if (found == None) {
+                found = id;
+            }
+
+        }
+
+        return found != None ? found : (RRMode) -EAGAIN;
+
+    }
+
+    /* Step 1: the exact timing we captured */
+
+    auto exact = modeIndex.byTiming.find(timingKey(timing.width, timing.height, timing.dotClock,
+                                                   timing.hTotal, timing.vTotal, timing.flags));
+
+    if (exact != modeIndex.byTiming.end()) {
+
+        for (size_t i : exact->second) {
+
+            const ModeInfo &mode = resources.modes[i];
+
+            bool matches = (int) mode.width == timing.width &&
+                           (int) mode.height == timing.height &&
+                           mode.dotClock / 1000 == timing.dotClock &&
+                           mode.hTotal == timing.hTotal &&
+                           mode.vTotal == timing.vTotal &&
+                           mode.modeFlags == timing.flags;
+
+            if (matches && state.modes.count(mode.id)) {
+                return mode.id;
+            }
+
+        }
+
+    }
+
+    /* Step 2: same size, the preferred mode or else the nearest refresh rate */
+
+    auto sized = modeIndex.bySize.find(sizeKey(timing.width, timing.height));
+
+    if (sized == modeIndex.bySize.end()) {
+        return -EAGAIN;
+    }
+
+    double wanted = refreshRate(timing.dotClock, timing.hTotal, timing.vTotal);
+
+    const ModeInfo *best = NULL;
+    double bestDelta = 0;
+
+    for (size_t i : sized->second) {
+
+        const ModeInfo &mode = resources.modes[i];
+
+        if (!state.modes.count(mode.id)) {
+            continue;
+        }
+
+        if (mode.id == state.preferred) {
+            best = &mode;
+            break;
+        }
+
+        double delta = fabs(refreshRate(mode.dotClock / 1000, mode.hTotal, mode.vTotal) - wanted);
+
+        if (!best || delta < bestDelta) {
+            best = &mode;
+            bestDelta = delta;
+        }
+
+    }
+
+    if (!best) {
+        return -EAGAIN;
+    }
+
+    Trace::log(LOG_WARNING, "Mode %s at %.2f Hz is gone from %s, using %s at %.2f Hz\n",
+           controller.mode.c_str(), wanted, state.name.c_str(), best->name.c_str(),
+           refreshRate(best->dotClock / 1000, best->hTotal, best->vTotal));
+
+    return best->id;
 
 }
@@ -4,12 +4,43 @@
 #include <X11/extensions/Xrandr.h>
 #include <libthinkpad.h>
 
+#include "displays.h"
+#include "edid.h"
+#include "profile.h"
+#include "randr.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
 using ThinkPad::Utilities::Ini::Ini;
 using ThinkPad::Utilities::Ini::IniKeypair;
 using ThinkPad::Utilities::Ini::IniSection;
 
-#define CONFIG_LOCATION_DOCKED "/etc/dockd/docked.conf"
-#define CONFIG_LOCATION_UNDOCKED "/etc/dockd/undocked.conf"
+/* The profiles of the default display, others have their own directory */
+#define CONFIG_DIRECTORY "/etc/dockd"
+#define CONFIG_NAME_DOCKED "docked.conf"
+#define CONFIG_NAME_UNDOCKED "undocked.conf"
+
+/* Profiles keyed by the EDIDs of the connected monitors */
+#define CONFIG_NAME_PROFILES "profiles"
+
+/* How long to wait for configured outputs to come up after a dock event */
+#define OUTPUT_READY_TIMEOUT_MS 3000
+
+/* With no fingerprinted profile matching, give the outputs this long to change before using the default */
+#define OUTPUT_SETTLE_MS 500
+
+/* Re-query RandR at least this often while waiting, for drivers without hotplug events */
+#define OUTPUT_REPROBE_INTERVAL_MS 1000
+
+/* Give up on the rest of a rollback after this long, the server is beyond help then */
+#define ROLLBACK_TIMEOUT_MS 2000
+
+/* Older versions of every profile kept next to it, docked.conf.1 is the newest */
+#define PROFILE_HISTORY 3
 
 typedef struct _crtc {
 
@@ -20,13 +51,35 @@ typedef struct _crtc {
 
 class CRTControllerManager {
 
+public:
+
+    enum DockState {
+
+        DOCKED, UNDOCKED, INVALID
+
+    };
+
+    /* The phases of an apply and the requests that changed, or would change, the display */
+    class ApplyReport {
+    public:
+        class Phase {
+        public:
+            const char *name;
+            unsigned long roundTrips;
+            uint64_t ns;
+        };
+
+        vector<Phase> phases;
+        vector<std::string> requests;
+    };
+
 private:
 
-    Display *display;
-    int screen;
-    Window window;
+    std::unique_ptr<RandR> ownedRandR;
+    RandR *randr;
+    std::string configDirectory = CONFIG_DIRECTORY;
 
-    XRRScreenResources *resources;
+    ScreenResources resources;
 
     class CRTConfig {
     public:
@@ -34,10 +87,133 @@ private:
         int x, y;
         RRMode mode;
         Rotation rotation;
-        RROutput *outputs;
-        size_t noutputs;
+        vector<RROutput> outputs;
+
+        /* Left as they are unless the profile has them */
+        bool hasTransform = false;
+        CrtcTransform transform;
+        bool hasPanning = false;
+        Panning panning;
+    };
+
+    /*
+     * Everything resolved from a profile against one
+     * RandR configuration, replayed as long as the
+     * config timestamp and the profile don't change
+     */
+    class ApplyPlan {
+    public:
+        Time configTimestamp;
+        unsigned long profileGeneration;
+        vector<CRTConfig> controllers;
+        int width, height;
+        int mm_width, mm_height;
+
+        /* None leaves the primary output alone */
+        RROutput primary;
+
+        /* What the CRTCs and screen look like once the plan is applied */
+        uint64_t fingerprint;
+    };
+
+    std::unordered_map<int, ApplyPlan> plans;
+
+    /* The layout before the last apply, rebuilt in place by a rollback */
+    ApplyPlan lastGood;
+    bool rolledBack = false;
+
+    /* What a commit or rollback sent so far */
+    class CommitProgress {
+    public:
+        int changed = 0;
+        int darkened = 0;
+        int skipped = 0;
+        bool screenChanged = false;
+        uint64_t blanked = 0;
+        uint64_t crtcNs = 0;
+    };
+
+    class OutputState {
+    public:
+        std::string name;
+        Connection connection;
+        vector<RRMode> modeList;
+        std::unordered_set<RRMode> modes;
+        RRMode preferred;
+        unsigned long seen;
+    };
+
+    class CrtcState {
+    public:
+        int x, y;
+        RRMode mode;
+        Rotation rotation;
+        vector<RROutput> outputs;
+        CrtcTransform transform;
+        Panning panning;
+        unsigned long seen;
+    };
+
+    /*
+     * Every output's and CRTC's info fetched once per
+     * resource refresh, so lookups don't need to hit the server
+     */
+    class ResourceSnapshot {
+    public:
+        std::unordered_map<RROutput, OutputState> outputs;
+        std::unordered_map<std::string, RROutput> outputsByName;
+        std::unordered_map<RRCrtc, CrtcState> crtcs;
+
+        /* Entries not seen in the latest query are dropped */
+        unsigned long outputEpoch = 0;
+        unsigned long crtcEpoch = 0;
+    };
+
+    ResourceSnapshot snapshot;
+
+    /*
+     * Scratch space reused by every snapshot and fingerprint,
+     * so a warm apply does not touch the heap
+     */
+    vector<OutputInfo> outputInfos;
+    vector<CrtcInfo> crtcInfos;
+    vector<RRCrtc> litCrtcs;
+    vector<CrtcTransform> transformInfos;
+    vector<Panning> panningInfos;
+    vector<const std::string*> fingerprintNames;
+    vector<RROutput> fingerprintOutputs;
+    vector<const char*> captureNames;
+
+    /*
+     * Positions in resources.modes by id, exact timing
+     * and size, rebuilt lazily after the resources change
+     */
+    class ModeIndex {
+    public:
+        bool valid = false;
+        vector<RRMode> ids;
+        std::unordered_map<RRMode, size_t> byId;
+        std::unordered_map<uint64_t, vector<size_t>> byTiming;
+        std::unordered_map<uint64_t, vector<size_t>> bySize;
+        std::unordered_map<std::string, vector<size_t>> byName;
+    };
+
+    ModeIndex modeIndex;
+
+    /*
+     * EDIDs are only read again when the output's
+     * connection state or the config timestamp changes
+     */
+    class EdidCacheEntry {
+    public:
+        Connection connection;
+        Time configTimestamp;
+        std::string edid;
+        MonitorIdentity identity;
     };
 
+    std::unordered_map<RROutput, EdidCacheEntry> edidCache;
+
     class OutputConfigs {
     public:
         vector<RROutput> outputs;
@@ -46,26 +222,79 @@ private:
     };
 
 
-    OutputConfigs getOutputConfigs(vector<const char *> *vector, IniSection *pSection);
+    OutputConfigs getOutputConfigs(const Profile::Controller &controller, bool wait);
+    ApplyPlan *findPlan(DockState state, const Profile &profile);
+    ApplyPlan *buildPlan(DockState state, const Profile &profile, bool wait);
+    bool commitPlan(const ApplyPlan &plan);
+    bool sendPlan(const ApplyPlan &plan, const ScreenSize &current, RROutput primary,
+                  uint64_t deadline, CommitProgress *progress);
+    void rollBack(const ScreenSize &size, RROutput primary, const ScreenSize &left);
+    bool verifyCommit();
+    bool applyPreviousVersion(DockState state, const Profile &profile, ApplyReport *report);
     bool isOutputModeSupported(RROutput pInfo, RRMode pOutputInfo);
+    bool isCrtcUnchanged(const CRTConfig *config);
+    bool mustGoDark(const ApplyPlan &plan, const CRTConfig &controller);
+    bool isCrtcLit(RRCrtc crtc);
+    bool setCrtc(const CRTConfig &controller, bool disable);
+    bool isPanningUnchanged(const CRTConfig &controller);
+    void setPanning(const CRTConfig &controller);
+    uint64_t fingerprintPlan(const ApplyPlan &plan);
+    uint64_t fingerprintCurrent(const ApplyPlan &plan, const ScreenSize &size);
     void connectToX();
+    bool refreshConnection();
     void disconnectFromX();
+    void refreshResources();
+    void takeSnapshot();
+    void snapshotOutputs();
+    void snapshotCrtcs();
+    bool waitForRandREvent(uint64_t deadline);
+    uint64_t fingerprintSnapshot(DockState state);
+    void refreshEdids(const vector<RROutput> &outputs);
     RROutput getRROutputByName(const char *outputName);
-    RRMode getRRModeByNameSupported(const char *getString, RROutput i);
+    void indexModes();
+    const ModeInfo *getModeInfo(RRMode mode);
+    RRMode resolveMode(const Profile::Controller &controller, RROutput output);
 
-public:
+    bool dryRun = false;
 
-    enum DockState {
+    /* The server refused a request, start the next apply on a fresh connection */
+    bool reconnect = false;
+    ApplyReport *report = NULL;
 
-        DOCKED, UNDOCKED, INVALID
+    void reportPhase(const char *name, uint64_t start, unsigned long roundTrips);
+    void reportRequest(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    std::string describeOutputs(const vector<RROutput> &outputs);
 
-    };
+public:
 
     CRTControllerManager();
+    CRTControllerManager(const DisplayConfig &display);
+    CRTControllerManager(RandR *randr);
+    /* A display's profiles on a server reached through another backend, which stays the caller's */
+    CRTControllerManager(const DisplayConfig &display, RandR *randr);
     ~CRTControllerManager();
 
-    bool applyConfiguration(DockState state);
+    /* Resolve and report everything, but send no request that changes the display */
+    void setDryRun(bool dryRun);
+
+    bool applyConfiguration(DockState state, ApplyReport *report = NULL);
+    bool applyProfile(DockState state, const Profile &profile, ApplyReport *report = NULL);
+    /* Like applyProfile, but falls back to older versions of the profile when it had to roll back */
+    bool applyProfileOrPrevious(DockState state, const Profile &profile, ApplyReport *report = NULL);
+    bool wasRolledBack();
+    bool preparePlan(DockState state, const Profile &profile);
+    bool isApplied(DockState state, const Profile &profile);
     bool writeConfigToDisk(DockState state);
+    bool captureConfig(Ini &ini);
+
+    uint64_t getFingerprint(DockState state);
+    bool waitForOutputChange(uint64_t deadline);
+    bool hasPendingOutputs();
+
+    std::string getConfigLocation(DockState state);
+    std::string getProfileDirectory();
+    std::string getProfilePath(DockState state, uint64_t fingerprint);
+    static std::string getHistoryPath(const std::string &path, int version);
 
 };
 
@@ -0,0 +1,145 @@
+#include "displays.h"
+#include "crtc.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <syslog.h>
+#include <unistd.h>
+
+static DisplayConfig defaultDisplay()
+{
+
+    DisplayConfig display;
+
+    display.screen = -1;
+    display.directory = CONFIG_DIRECTORY;
+
+    return display;
+
+}
+
+/* Splits ":1.2" into ":1" and 2, the screen is -1 when missing */
+static void parseDisplayName(const char *value, std::string *name, int *screen)
+{
+
+    *name = value;
+    *screen = -1;
+
+    size_t colon = name->rfind(':');
+    size_t dot = name->rfind('.');
+
+    if (colon == std::string::npos || dot == std::string::npos || dot < colon) {
+        return;
+    }
+
+    *screen = atoi(name->c_str() + dot + 1);
+    name->erase(dot);
+
+}
+
+std::string DisplayConfig::describe() const
+{
+
+    char buffer[32];
+
+    if (screen < 0) {
+        return name.empty() ? "default display" : name;
+    }
+
+    snprintf(buffer, sizeof(buffer), ".%d", screen);
+
+    return (name.empty() ? "default display" : name) + buffer;
+
+}
+
+vector<DisplayConfig> DisplayConfig::load()
+{
+
+    vector<DisplayConfig> displays;
+
+    /* Without a list, manage the display we were started on */
+    if (access(CONFIG_LOCATION_DISPLAYS, F_OK) != 0) {
+        displays.push_back(defaultDisplay());
+        return displays;
+    }
+
+    Ini config;
+
+    if (!config.readIni(CONFIG_LOCATION_DISPLAYS)) {
+        syslog(LOG_ERR, "Can't open %s, managing the default display only\n", CONFIG_LOCATION_DISPLAYS);
+        displays.push_back(defaultDisplay());
+        return displays;
+    }
+
+    for (IniSection *section : config.getSections("Display")) {
+
+        const char *name = section->getString("name");
+
+        if (!name) {
+            syslog(LOG_ERR, "%s has a Display without a name\n", CONFIG_LOCATION_DISPLAYS);
+            continue;
+        }
+
+        DisplayConfig display;
+
+        parseDisplayName(name, &display.name, &display.screen);
+
+        if (section->getString("screen")) {
+            display.screen = section->getInt("screen");
+        }
+
+        /* Every display needs its own profiles, default to /etc/dockd/<display>.<screen> */
+        const char *directory = section->getString("directory");
+
+        if (directory) {
+            display.directory = directory;
+        } else {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), ".%d", display.screen < 0 ? 0 : display.screen);
+            display.directory = std::string(CONFIG_DIRECTORY) + "/" + display.name + suffix;
+        }
+
+        displays.push_back(display);
+
+    }
+
+    if (displays.size() == 0) {
+        syslog(LOG_ERR, "%s lists no displays, managing the default display only\n", CONFIG_LOCATION_DISPLAYS);
+        displays.push_back(defaultDisplay());
+    }
+
+    return displays;
+
+}
+
+DisplayConfig DisplayConfig::current()
+{
+
+    const char *value = getenv("DISPLAY");
+
+    if (!value) {
+        return defaultDisplay();
+    }
+
+    std::string name;
+    int screen;
+
+    parseDisplayName(value, &name, &screen);
+
+    /* Use the profiles of the display we run on when it is listed */
+    for (const DisplayConfig &display : load()) {
+
+        if (display.name.empty()) {
+            continue;
+        }
+
+        if (display.name == name && (display.screen == screen || (display.screen <= 0 && screen <= 0))) {
+            return display;
+        }
+
+    }
+
+    return defaultDisplay();
+
+}
@@ -0,0 +1,30 @@
+#ifndef DISPLAYS_H
+#define DISPLAYS_H
+
+#include <libthinkpad.h>
+
+#include <string>
+
+/* Lists the X displays and screens one daemon manages */
+#define CONFIG_LOCATION_DISPLAYS "/etc/dockd/displays.conf"
+
+/*
+ * One X display and screen together with the
+ * directory that holds its profiles
+ */
+class DisplayConfig {
+
+public:
+
+    std::string name;       // empty for $DISPLAY
+    int screen;             // -1 for the default screen of the display
+    std::string directory;
+
+    std::string describe() const;
+
+    static vector<DisplayConfig> load();
+    static DisplayConfig current();
+
+};
+
+#endif // DISPLAYS_H
@@ -0,0 +1,61 @@
+#include "edid.h"
+
+#define EDID_BLOCK_SIZE 128
+#define EDID_DESCRIPTOR_OFFSET 54
+#define EDID_DESCRIPTOR_SIZE 18
+#define EDID_DESCRIPTOR_NAME 0xfc
+
+static const unsigned char edidHeader[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+bool MonitorIdentity::parse(const std::string &edid)
+{
+
+    vendor.clear();
+    name.clear();
+    product = 0;
+    serial = 0;
+
+    if (edid.size() < EDID_BLOCK_SIZE) {
+        return false;
+    }
+
+    const unsigned char *data = (const unsigned char *) edid.data();
+
+    for (int i = 0; i < 8; i++) {
+        if (data[i] != edidHeader[i]) {
+            return false;
+        }
+    }
+
+    /* Three 5-bit letters, big endian */
+    unsigned int id = (data[8] << 8) | data[9];
+
+    vendor += (char) ('A' + ((id >> 10) & 0x1f) - 1);
+    vendor += (char) ('A' + ((id >> 5) & 0x1f) - 1);
+    vendor += (char) ('A' + (id & 0x1f) - 1);
+
+    product = data[10] | (data[11] << 8);
+    serial = data[12] | (data[13] << 8) | (data[14] << 16) | ((uint32_t) data[15] << 24);
+
+    /* The monitor name lives in one of the four display descriptors */
+    for (int i = 0; i < 4; i++) {
+
+        const unsigned char *descriptor = data + EDID_DESCRIPTOR_OFFSET + i * EDID_DESCRIPTOR_SIZE;
+
+        if (descriptor[0] != 0 || descriptor[1] != 0 || descriptor[3] != EDID_DESCRIPTOR_NAME) {
+            continue;
+        }
+
+        for (int j = 5; j < EDID_DESCRIPTOR_SIZE && descriptor[j] != '\n'; j++) {
+            name += (char) descriptor[j];
+        }
+
+        while (!name.empty() && name[name.size() - 1] == ' ') {
+            name.erase(name.size() - 1);
+        }
+
+    }
+
+    return true;
+
+}
@@ -0,0 +1,21 @@
+#ifndef EDID_H
+#define EDID_H
+
+#include <cstdint>
+#include <string>
+
+/*
+ * The parts of an EDID base block that
+ * tell one monitor apart from another
+ */
+class MonitorIdentity {
+public:
+    std::string vendor;
+    unsigned int product;
+    uint32_t serial;
+    std::string name;
+
+    bool parse(const std::string &edid);
+};
+
+#endif // EDID_H
@@ -1,24 +1,198 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "hooks.h"
 
-void Hooks::executeDockHook()
+extern char **environ;
+
+struct HookBatch {
+	HookResultHandler *handler;
+	std::vector<std::string> paths;
+};
+
+static long elapsedMs(const struct timespec *start)
 {
-	int ret = system("/etc/dockd/dock.hook");
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	if (ret == -1)
-		syslog(LOG_ERR, "Failed to execute dock hook");
-	if (ret != 0)
-		syslog(LOG_ERR, "Dock hook exited with non-zero (%d)", ret);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+static pid_t spawnHook(const std::string &path)
+{
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid;
+
+	posix_spawnattr_init(&attr);
+
+	/* Own process group, so a timeout kills everything the hook started */
+	posix_spawnattr_setpgroup(&attr, 0);
+
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+
+	char *argv[] = { (char *) path.c_str(), NULL };
+	int ret = posix_spawn(&pid, path.c_str(), NULL, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+
+	if (ret != 0) {
+		syslog(LOG_ERR, "Failed to execute hook %s: %s", path.c_str(), strerror(ret));
+		return -1;
+	}
+
+	return pid;
+}
+
+Hooks::Hooks() : handler(NULL)
+{
+}
+
+void Hooks::setResultHandler(HookResultHandler *handler)
+{
+	this->handler = handler;
+}
+
+void Hooks::executeDockHook()
+{
+	execute(HOOK_DOCK, HOOK_DOCK_DIR);
 }
 
 void Hooks::executeUndockHook()
 {
-	int ret = system("/etc/dockd/undock.hook");
+	execute(HOOK_UNDOCK, HOOK_UNDOCK_DIR);
+}
+
+void Hooks::execute(const char *hook, const char *directory)
+{
+	HookBatch *batch = new HookBatch;
+	batch->handler = handler;
+
+	if (access(hook, X_OK) == 0)
+		batch->paths.push_back(hook);
+
+	DIR *dir = opendir(directory);
+
+	if (dir) {
+		std::vector<std::string> scripts;
+		struct dirent *entry;
+
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.')
+				continue;
+
+			std::string path = std::string(directory) + "/" + entry->d_name;
+			struct stat st;
+
+			if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0)
+				scripts.push_back(path);
+		}
+
+		closedir(dir);
+
+		std::sort(scripts.begin(), scripts.end());
+		batch->paths.insert(batch->paths.end(), scripts.begin(), scripts.end());
+	}
+
+	if (batch->paths.empty()) {
+		delete batch;
+		return;
+	}
+
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, &Hooks::run, batch) != 0) {
+		syslog(LOG_ERR, "Failed to start the hook runner");
+		delete batch;
+		return;
+	}
+
+	pthread_detach(thread);
+}
+
+void *Hooks::run(void *data)
+{
+	HookBatch *batch = (HookBatch *) data;
+	size_t count = batch->paths.size();
+
+	std::vector<pid_t> pids(count);
+	std::vector<HookResult> results(count);
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++) {
+		results[i].path = batch->paths[i];
+		results[i].status = -1;
+		results[i].timedOut = false;
+		results[i].durationMs = 0;
+		pids[i] = spawnHook(batch->paths[i]);
+	}
+
+	size_t running = 0;
+
+	for (size_t i = 0; i < count; i++)
+		if (pids[i] > 0)
+			running++;
+
+	/* Reap the hooks as they finish, kill whatever outlives the timeout */
+	while (running > 0) {
+		bool expired = elapsedMs(&start) >= HOOK_TIMEOUT_MS;
+
+		for (size_t i = 0; i < count; i++) {
+			if (pids[i] <= 0)
+				continue;
+
+			if (expired && !results[i].timedOut) {
+				kill(-pids[i], SIGKILL);
+				results[i].timedOut = true;
+			}
+
+			int status;
+			pid_t ret = waitpid(pids[i], &status, WNOHANG);
+
+			if (ret == 0 || (ret < 0 && errno == EINTR))
+				continue;
+
+			if (ret > 0 && WIFEXITED(status) && !results[i].timedOut)
+				results[i].status = WEXITSTATUS(status);
+
+			results[i].durationMs = elapsedMs(&start);
+			pids[i] = -1;
+			running--;
+		}
+
+		if (running > 0) {
+			struct timespec tick = { 0, 10 * 1000000L };
+			nanosleep(&tick, NULL);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		HookResult &result = results[i];
+
+		if (result.timedOut)
+			syslog(LOG_ERR, "Hook %s killed after %ld ms", result.path.c_str(), result.durationMs);
+		else if (result.status != 0)
+			syslog(LOG_ERR, "Hook %s exited with non-zero value (%d)", result.path.c_str(), result.status);
+
+		if (batch->handler)
+			batch->handler->handleHookResult(result);
+	}
 
-	if (ret == -1)
-		syslog(LOG_ERR, "Failed to execute undock hook");
-	if (ret != 0)
-		syslog(LOG_ERR, "Undock hook exited with non-zero value (%d)", ret);
+	delete batch;
+	return NULL;
 }
@@ -1,10 +1,46 @@
 #ifndef __HOOK_H__
 #define __HOOK_H__
 
+#include <string>
+#include <vector>
+
+#define HOOK_DOCK "/etc/dockd/dock.hook"
+#define HOOK_UNDOCK "/etc/dockd/undock.hook"
+#define HOOK_DOCK_DIR "/etc/dockd/dock.d"
+#define HOOK_UNDOCK_DIR "/etc/dockd/undock.d"
+
+/* Hooks still running after this long are killed */
+#define HOOK_TIMEOUT_MS 30000
+
+struct HookResult {
+	std::string path;
+	int status;		/* exit status, or -1 if killed or not started */
+	bool timedOut;
+	long durationMs;
+};
+
+class HookResultHandler {
+public:
+	virtual void handleHookResult(const HookResult &result) = 0;
+};
+
+/*
+ * Hooks are started with posix_spawn on a background
+ * thread, the hook script and every executable in the
+ * matching .d directory run in parallel
+ */
 class Hooks {
 public:
+	Hooks();
+	void setResultHandler(HookResultHandler *handler);
 	void executeUndockHook();
 	void executeDockHook();
+
+private:
+	HookResultHandler *handler;
+
+	void execute(const char *hook, const char *directory);
+	static void *run(void *batch);
 };
 
 #endif
@@ -1,10 +1,30 @@
 #include <stdio.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
 
+#include "control.h"
 #include "crtc.h"
 #include "hooks.h"
+#include "profilestore.h"
+#include "recordrandr.h"
+#include "replayrandr.h"
+#include "session.h"
+#include "stats.h"
+#include "trace.h"
+#include "uevent.h"
+#include "x11randr.h"
 #include "libthinkpad.h"
 
 #define VERSION "1.3.1"
@@ -15,59 +35,910 @@ using ThinkPad::PowerManagement::ACPIEventHandler;
 using ThinkPad::Utilities::Versioning;
 using ThinkPad::Hardware::Dock;
 
-class ACPIHandler : public ACPIEventHandler {
+/* Default time to wait for a dock state to settle before applying it */
+#define DEBOUNCE_MS 150
+
+/*
+ * The mailbox holds the latest desired dock state,
+ * with the MAIL_HOOK bit set if a hook should run and
+ * MAIL_VERIFY set if only a resume asked for it, so the
+ * current layout is checked before applying anything
+ */
+#define MAIL_EMPTY  (-1)
+#define MAIL_HOOK   0x100
+#define MAIL_VERIFY 0x200
+#define MAIL_STATE  0x0ff
+
+static CRTControllerManager::DockState parseDockState(const char *state) {
+
+    if (strcmp(state, "docked") == 0) {
+        return CRTControllerManager::DockState::DOCKED;
+    }
+
+    if (strcmp(state, "undocked") == 0) {
+        return CRTControllerManager::DockState::UNDOCKED;
+    }
+
+    return CRTControllerManager::DockState::INVALID;
+
+}
+
+/* What the worker made of a burst of dock events, for --replay */
+class DockResult {
+public:
+    CRTControllerManager::DockState state;
+    bool applied;
+    bool verify;
+    unsigned long transitions;
+    uint64_t postedAt;
+    uint64_t finishedAt;
+};
+
+class DockResultHandler {
+public:
+    virtual void handleDockResult(const DockResult &result) = 0;
+};
+
+/*
+ * An X display or screen the daemon manages, with its own
+ * connection and profiles so displays can apply in parallel
+ */
+class ManagedDisplay {
 
 private:
+    std::shared_ptr<const Profile> selectProfile(CRTControllerManager::DockState state);
+
+public:
+    DisplayConfig config;
+    std::unique_ptr<RandR> randr;
     CRTControllerManager manager;
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    ProfileStore profiles;
+
+    /* The worker and control commands share the X connection */
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    CRTControllerManager::DockState lastState = CRTControllerManager::DockState::INVALID;
+    bool lastApplied = false;
+
+    /* One display's part of an apply, owned by the caller so concurrent applies share nothing */
+    class ApplyJob {
+    public:
+        ManagedDisplay *display;
+        CRTControllerManager::DockState state;
+        bool verify;
+        bool applied;
+        pthread_t thread;
+    };
+
+    /* Takes ownership of the backend */
+    ManagedDisplay(const DisplayConfig &config, RandR *randr);
+
+    bool apply(CRTControllerManager::DockState state, bool verify);
+    void prewarm(CRTControllerManager::DockState state);
+    CRTControllerManager::DockState matchFingerprint();
+    std::string checkCapture(CRTControllerManager::DockState state);
+    std::string capture(CRTControllerManager::DockState state);
+    std::string status();
+
+    static void *applyInThread(void *job);
+};
+
+class ACPIHandler : public ACPIEventHandler, public UEventHandler, public HookResultHandler,
+                    public ControlHandler {
+
+private:
+    vector<std::unique_ptr<ManagedDisplay>> displays;
     Dock dock;
     Hooks hooks;
+    ControlServer control;
+    UEventMonitor uevents;
+
+    /* Written by the ACPI and uevent threads, consumed by the worker */
+    std::atomic<int> mailbox;
+    std::atomic<unsigned long> posted;
+    std::atomic<uint64_t> postedAt;
+    std::atomic<int> hookedState;
+    std::atomic<int> currentState;
+    std::atomic<bool> busy;
+    std::atomic<bool> stopping;
+    int wakeFd = -1;
+
+    int debounceMs;
+    unsigned long dropped = 0;
+    pthread_t worker;
+
+    /* Replays run no hooks and report every result */
+    bool replaying = false;
+    DockResultHandler *results = NULL;
+
+    bool startWorker();
+    void post(CRTControllerManager::DockState state, bool hook, bool verify);
+    bool apply(CRTControllerManager::DockState state, bool hook, bool verify);
+    void prewarm(CRTControllerManager::DockState state);
+    std::string capture(CRTControllerManager::DockState state);
+    std::string status();
+    static void *work(void *handler);
+
+public:
+    ACPIHandler(int debounceMs);
+    bool init();
+    bool initReplay(const vector<ManagedDisplay*> &displays, DockResultHandler *results);
+    void stop();
+    bool isIdle();
+    void handleEvent(ACPIEvent event);
+    void handleUEvent(const UEvent &event);
+    void dispatch(ACPIEvent event, bool sane, bool docked);
+    void dispatchHotplug(const std::string &devpath, bool docked, bool decided);
+    void handleHookResult(const HookResult &result);
+    std::string handleCommand(const std::string &command);
+};
+
+ACPIHandler::ACPIHandler(int debounceMs) : mailbox(MAIL_EMPTY), posted(0), postedAt(0),
+                                             hookedState(CRTControllerManager::DockState::INVALID),
+                                             currentState(CRTControllerManager::DockState::INVALID),
+                                             busy(false), stopping(false), debounceMs(debounceMs) {
+
+}
+
+bool ACPIHandler::init() {
+
+    for (const DisplayConfig &config : DisplayConfig::load()) {
+
+        int index = (int) displays.size();
+        RandR *randr = new X11RandR(config.name, config.screen);
+
+        if (Session::isRecording()) {
+            Session::display(index, config);
+            randr = new RecordingRandR(randr, index);
+        }
+
+        ManagedDisplay *display = new ManagedDisplay(config, randr);
+        displays.push_back(std::unique_ptr<ManagedDisplay>(display));
+
+        syslog(LOG_INFO, "Managing %s with the profiles in %s\n",
+               config.describe().c_str(), config.directory.c_str());
+
+        /* Parse the profiles once, dock events only read the cached copies */
+        if (!display->profiles.load()) {
+            syslog(LOG_ERR, "Not all profiles could be loaded for %s, run dockd --config first\n",
+                   config.describe().c_str());
+        }
+
+        if (!display->profiles.startWatching()) {
+            syslog(LOG_ERR, "Profile changes will not be picked up until restart\n");
+        }
+
+    }
+
+    hooks.setResultHandler(this);
+
+    if (!startWorker()) {
+        return false;
+    }
+
+    if (!control.start(this)) {
+        syslog(LOG_ERR, "Control socket unavailable, dockd --stats will not work and --set and --config will run standalone\n");
+    }
+
+    if (!uevents.start(this)) {
+        syslog(LOG_ERR, "Connector hotplugs unavailable, only ACPI dock events will be handled\n");
+    }
+
+    return true;
+
+}
+
+bool ACPIHandler::initReplay(const vector<ManagedDisplay*> &displays, DockResultHandler *results) {
+
+    replaying = true;
+    this->results = results;
+
+    for (ManagedDisplay *display : displays) {
+
+        this->displays.push_back(std::unique_ptr<ManagedDisplay>(display));
+
+        if (!display->profiles.load()) {
+            Trace::log(LOG_WARNING, "Not all recorded profiles could be loaded for %s\n",
+                       display->config.describe().c_str());
+        }
+
+    }
+
+    return startWorker();
+
+}
+
+bool ACPIHandler::startWorker() {
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+
+    if (wakeFd < 0) {
+        syslog(LOG_ERR, "Failed to create the event mailbox: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (pthread_create(&worker, NULL, &ACPIHandler::work, this) != 0) {
+        syslog(LOG_ERR, "Failed to start the dock worker\n");
+        return false;
+    }
+
+    return true;
+
+}
+
+void ACPIHandler::stop() {
+
+    stopping = true;
+
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        return;
+    }
+
+    pthread_join(worker, NULL);
+
+}
+
+bool ACPIHandler::isIdle() {
+
+    /* A post fills the mailbox before the worker wakes, so there's no gap in between */
+    return mailbox.load() == MAIL_EMPTY && !busy.load();
+
+}
+
+void ACPIHandler::post(CRTControllerManager::DockState state, bool hook, bool verify) {
+
+    int mail = state | (hook ? MAIL_HOOK : 0) | (verify ? MAIL_VERIFY : 0);
+    int old = mailbox.load();
+    int merged;
+
+    /* A superseded transition to the same state still wants its hook */
+    do {
+        merged = mail;
+        if (old != MAIL_EMPTY && (old & MAIL_STATE) == state) {
+            merged |= old & MAIL_HOOK;
+            /* A dock event already waiting for this state must not be skipped */
+            if (!(old & MAIL_VERIFY)) {
+                merged &= ~MAIL_VERIFY;
+            }
+        }
+    } while (!mailbox.compare_exchange_weak(old, merged));
+
+    currentState = state;
+
+    if (hook) {
+        hookedState = state;
+    }
+
+    /* Delivery latency is measured from the first event of a burst */
+    uint64_t none = 0;
+    postedAt.compare_exchange_strong(none, Stats::now());
+
+    posted++;
+    Stats::count(Stats::EVENTS);
+    Trace::instant(Trace::EVENT, "post", "state", state, "mail", mail);
+
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        Trace::log(LOG_ERR, "Failed to wake the dock worker: %s\n", strerror(errno));
+    }
+
+}
+
+void *ACPIHandler::work(void *handler) {
+
+    ACPIHandler *self = (ACPIHandler *) handler;
+
+    for (;;) {
+
+        uint64_t count;
+
+        if (read(self->wakeFd, &count, sizeof(count)) != sizeof(count)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Trace::log(LOG_ERR, "Dock worker stopped: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        if (self->stopping) {
+            return NULL;
+        }
+
+        self->busy = true;
+
+        /* Let flapping contacts settle, every new post restarts the window */
+
+        struct pollfd pfd;
+        pfd.fd = self->wakeFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        while (self->debounceMs > 0 && poll(&pfd, 1, self->debounceMs) > 0) {
+            if (read(self->wakeFd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+
+        int mail = self->mailbox.exchange(MAIL_EMPTY);
+        unsigned long transitions = self->posted.exchange(0);
+        uint64_t postedAt = self->postedAt.exchange(0);
+
+        if (mail == MAIL_EMPTY) {
+            self->busy = false;
+            continue;
+        }
+
+        if (postedAt != 0) {
+            Stats::observeSince(Stats::ACPI_DELIVERY, postedAt);
+        }
+
+        if (transitions > 1) {
+            self->dropped += transitions - 1;
+            Stats::count(Stats::DROPPED_EVENTS, transitions - 1);
+            Trace::log(LOG_INFO, "Dropped %lu superseded dock transitions (%lu total)\n",
+                       transitions - 1, self->dropped);
+        }
+
+        CRTControllerManager::DockState state = (CRTControllerManager::DockState) (mail & MAIL_STATE);
+
+        uint64_t start = Stats::now();
+        bool applied = self->apply(state, (mail & MAIL_HOOK) != 0, (mail & MAIL_VERIFY) != 0);
+        Trace::span(Trace::PHASE, "dock event", start, "state", state, "applied", applied);
+
+        if (self->results) {
+            DockResult result;
+            result.state = state;
+            result.applied = applied;
+            result.verify = (mail & MAIL_VERIFY) != 0;
+            result.transitions = transitions;
+            result.postedAt = postedAt != 0 ? postedAt : start;
+            result.finishedAt = Stats::now();
+            self->results->handleDockResult(result);
+        }
+
+        /* Nothing new came in, prepare for the way back */
+        if (self->mailbox.load() == MAIL_EMPTY) {
+            self->prewarm(state == CRTControllerManager::DockState::DOCKED ?
+                          CRTControllerManager::DockState::UNDOCKED : CRTControllerManager::DockState::DOCKED);
+        }
+
+        self->busy = false;
+
+    }
+
+}
+
+ManagedDisplay::ManagedDisplay(const DisplayConfig &config, RandR *randr) : config(config), randr(randr),
+                                                                          manager(config, randr),
+                                                                          profiles(config.directory) {
+
+}
+
+bool ManagedDisplay::apply(CRTControllerManager::DockState state, bool verify) {
+
+    bool applied = false;
+
+    pthread_mutex_lock(&lock);
+
+    uint64_t start = Stats::now();
+    std::shared_ptr<const Profile> profile = selectProfile(state);
+    Stats::observeSince(Stats::PROFILE_LOOKUP, start);
+    Trace::span(Trace::PHASE, "profile lookup", start);
+
+    if (!profile) {
+        Trace::log(LOG_ERR, "No valid profile for this dock state on %s, not applying\n", config.describe().c_str());
+    } else if (verify && manager.isApplied(state, *profile)) {
+        /* Most resumes come back with the layout intact, a modeset would only blank the screens */
+        Trace::log(LOG_INFO, "Layout on %s already matches the profile, not applying\n", config.describe().c_str());
+        Stats::count(Stats::RESUME_SKIPS);
+        applied = true;
+    } else {
+        start = Stats::now();
+        applied = manager.applyProfileOrPrevious(state, *profile);
+        Trace::span(Trace::PHASE, "apply", start, "state", state, "applied", applied);
+    }
+
+    lastState = state;
+    lastApplied = applied;
+
+    pthread_mutex_unlock(&lock);
+
+    return applied;
+
+}
+
+void *ManagedDisplay::applyInThread(void *job) {
+
+    ApplyJob *self = (ApplyJob *) job;
+
+    self->applied = self->display->apply(self->state, self->verify);
+
+    return NULL;
+
+}
+
+std::shared_ptr<const Profile> ManagedDisplay::selectProfile(CRTControllerManager::DockState state) {
+
+    if (!profiles.hasFingerprinted(state)) {
+        return profiles.get(state);
+    }
+
+    /*
+     * The monitors on the dock come up some time after the
+     * event, so wait for the connected set to match a profile.
+     * An unknown set of monitors is only waited on while it
+     * keeps changing or an output is still being probed.
+     */
+
+    uint64_t deadline = Stats::now() + OUTPUT_READY_TIMEOUT_MS * 1000000ULL;
+
+    for (;;) {
+
+        uint64_t fingerprint = manager.getFingerprint(state);
+        std::shared_ptr<const Profile> profile = profiles.find(fingerprint);
+
+        if (profile) {
+            Trace::log(LOG_INFO, "Selected the profile for monitors %016llx\n", (unsigned long long) fingerprint);
+            return profile;
+        }
+
+        uint64_t settled = Stats::now() + OUTPUT_SETTLE_MS * 1000000ULL;
+
+        if (manager.hasPendingOutputs() || settled > deadline) {
+            settled = deadline;
+        }
+
+        if (!manager.waitForOutputChange(settled)) {
+            break;
+        }
+
+    }
+
+    Trace::log(LOG_INFO, "No profile for the connected monitors, using the default one\n");
+
+    return profiles.get(state);
+
+}
+
+CRTControllerManager::DockState ManagedDisplay::matchFingerprint() {
+
+    /* Only a profile captured with exactly these monitors says which state they belong to */
+
+    CRTControllerManager::DockState matched = CRTControllerManager::DockState::INVALID;
+
+    pthread_mutex_lock(&lock);
+
+    for (CRTControllerManager::DockState state : {CRTControllerManager::DockState::DOCKED,
+                                                  CRTControllerManager::DockState::UNDOCKED}) {
+
+        if (profiles.hasFingerprinted(state) && profiles.find(manager.getFingerprint(state))) {
+            matched = state;
+            break;
+        }
+
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return matched;
+
+}
+
+void ManagedDisplay::prewarm(CRTControllerManager::DockState state) {
+
+    /*
+     * Resolve the plan for the opposite state while nothing
+     * is happening, so the next event can replay it directly
+     */
+
+    std::shared_ptr<const Profile> profile = profiles.get(state);
+
+    if (profile) {
+        pthread_mutex_lock(&lock);
+        manager.preparePlan(state, *profile);
+        pthread_mutex_unlock(&lock);
+    }
+
+}
+
+std::string ManagedDisplay::checkCapture(CRTControllerManager::DockState state) {
+
+    /*
+     * The daemon usually runs as the desktop user and the config
+     * directory belongs to root, let the client write it instead
+     */
+
+    std::string location = manager.getConfigLocation(state);
+    std::string profileDirectory = manager.getProfileDirectory();
+
+    if (access(config.directory.c_str(), F_OK) == 0 && access(config.directory.c_str(), W_OK) != 0) {
+        return "unavailable: the daemon can't write " + config.directory + "\n";
+    }
+
+    if (access(location.c_str(), F_OK) == 0 && access(location.c_str(), W_OK) != 0) {
+        return "unavailable: the daemon can't write " + location + "\n";
+    }
+
+    if (access(profileDirectory.c_str(), F_OK) == 0 && access(profileDirectory.c_str(), W_OK) != 0) {
+        return "unavailable: the daemon can't write " + profileDirectory + "\n";
+    }
+
+    return "";
+
+}
+
+std::string ManagedDisplay::capture(CRTControllerManager::DockState state) {
+
+    pthread_mutex_lock(&lock);
+    bool written = manager.writeConfigToDisk(state);
+    pthread_mutex_unlock(&lock);
+
+    std::string location = manager.getConfigLocation(state);
+
+    if (!written) {
+        return "error: failed to write " + location + "\n";
+    }
+
+    /* The profile store picks the new file up through inotify */
+    return "config file written to " + location + "\n";
+
+}
+
+std::string ManagedDisplay::status() {
+
+    char line[512];
+
+    pthread_mutex_lock(&lock);
+    CRTControllerManager::DockState state = lastState;
+    bool applied = lastApplied;
+    pthread_mutex_unlock(&lock);
+
+    const char *last = "none";
+
+    if (state != CRTControllerManager::DockState::INVALID) {
+        last = state == CRTControllerManager::DockState::DOCKED ?
+               (applied ? "docked (ok)" : "docked (failed)") :
+               (applied ? "undocked (ok)" : "undocked (failed)");
+    }
+
+    snprintf(line, sizeof(line), "%s: last apply %s, profiles in %s: docked %s, undocked %s, %zu fingerprinted\n",
+             config.describe().c_str(), last, config.directory.c_str(),
+             profiles.get(CRTControllerManager::DockState::DOCKED) ? "loaded" : "missing",
+             profiles.get(CRTControllerManager::DockState::UNDOCKED) ? "loaded" : "missing",
+             profiles.countFingerprinted());
+
+    return line;
+
+}
+
+bool ACPIHandler::apply(CRTControllerManager::DockState state, bool hook, bool verify) {
+
+    bool applied = true;
+
+    currentState = state;
+
+    if (displays.size() == 1) {
+        applied = displays[0]->apply(state, verify);
+    } else {
+
+        /*
+         * Every display has its own connection, so a dock takes as
+         * long as the slowest one. The worker and a control --set
+         * can get here at the same time, each with its own jobs.
+         */
+
+        vector<ManagedDisplay::ApplyJob> jobs(displays.size());
+        vector<bool> started;
+
+        for (size_t i = 0; i < displays.size(); i++) {
+            jobs[i].display = displays[i].get();
+            jobs[i].state = state;
+            jobs[i].verify = verify;
+            jobs[i].applied = false;
+            started.push_back(pthread_create(&jobs[i].thread, NULL, &ManagedDisplay::applyInThread, &jobs[i]) == 0);
+        }
+
+        for (size_t i = 0; i < jobs.size(); i++) {
+
+            if (started[i]) {
+                pthread_join(jobs[i].thread, NULL);
+            } else {
+                jobs[i].applied = jobs[i].display->apply(state, verify);
+            }
+
+            applied = applied && jobs[i].applied;
+
+        }
+
+    }
+
+    /* A replay must not run the hooks of the machine it runs on */
+    if (!hook || replaying) {
+        return applied;
+    }
+
+    if (state == CRTControllerManager::DockState::DOCKED) {
+        hooks.executeDockHook();
+    } else {
+        hooks.executeUndockHook();
+    }
+
+    return applied;
+
+}
+
+void ACPIHandler::prewarm(CRTControllerManager::DockState state) {
+
+    for (auto &display : displays) {
+        display->prewarm(state);
+    }
+
+}
+
+std::string ACPIHandler::capture(CRTControllerManager::DockState state) {
+
+    for (auto &display : displays) {
+
+        std::string unavailable = display->checkCapture(state);
+
+        if (!unavailable.empty()) {
+            return unavailable;
+        }
+
+    }
+
+    std::string reply;
+
+    for (auto &display : displays) {
+        reply += display->capture(state);
+    }
+
+    return reply;
+
+}
+
+std::string ACPIHandler::status() {
+
+    std::string reply = "dockd " VERSION "\n";
+
+    Dock probe;
+
+    if (!probe.probe()) {
+        reply += "dock: unknown\n";
+    } else {
+        reply += probe.isDocked() ? "dock: docked\n" : "dock: undocked\n";
+    }
+
+    reply += "external monitors: " + std::to_string(uevents.countExternalConnected()) + "\n";
+
+    for (auto &display : displays) {
+        reply += display->status();
+    }
+
+    return reply;
+
+}
+
+void ACPIHandler::handleEvent(ACPIEvent event) {
+
+    /* Only a resume looks at the dock, a recording keeps what it saw */
+
+    bool sane = true;
+    bool docked = false;
+
+    if (event == ACPIEvent::POWER_S3S4_EXIT) {
+        sane = dock.probe();
+        docked = sane && dock.isDocked();
+    }
+
+    Session::acpiEvent((int) event, sane, docked);
+
+    dispatch(event, sane, docked);
+
+}
+
+void ACPIHandler::dispatch(ACPIEvent event, bool sane, bool docked) {
+
+    Trace::instant(Trace::EVENT, "acpi", "event", (int64_t) event);
+
+    switch(event) {
+        case ACPIEvent::DOCKED:
+            post(CRTControllerManager::DockState::DOCKED, true, false);
+            break;
+        case ACPIEvent::UNDOCKED:
+            post(CRTControllerManager::DockState::UNDOCKED, true, false);
+            break;
+        case ACPIEvent::POWER_S3S4_EXIT:
+
+            if (!sane) {
+                Trace::log(LOG_INFO, "Dock is not sane, not running dynamic sleep handler\n");
+                return;
+            }
+
+            if (docked) {
+                post(CRTControllerManager::DockState::DOCKED, false, true);
+            } else {
+                post(CRTControllerManager::DockState::UNDOCKED, false, true);
+            }
+    }
+
+}
+
+void ACPIHandler::handleUEvent(const UEvent &event) {
+
+    /*
+     * The uevent doesn't say what changed, and a projector or a
+     * monitor waking up is no dock. Only a profile captured with
+     * the connected monitors or the ACPI dock can change the
+     * state, otherwise the current one is checked again.
+     */
+
+    CRTControllerManager::DockState state = CRTControllerManager::DockState::INVALID;
+
+    for (auto &display : displays) {
+
+        state = display->matchFingerprint();
+
+        if (state != CRTControllerManager::DockState::INVALID) {
+            break;
+        }
+
+    }
+
+    Dock dock;
+
+    if (state == CRTControllerManager::DockState::INVALID && dock.probe()) {
+        state = dock.isDocked() ? CRTControllerManager::DockState::DOCKED : CRTControllerManager::DockState::UNDOCKED;
+    }
+
+    bool decided = state != CRTControllerManager::DockState::INVALID;
+
+    if (!decided) {
+        state = (CRTControllerManager::DockState) currentState.load();
+    }
+
+    /* Nothing was applied yet and nothing says docked */
+    if (state == CRTControllerManager::DockState::INVALID) {
+        state = CRTControllerManager::DockState::UNDOCKED;
+    }
+
+    bool docked = state == CRTControllerManager::DockState::DOCKED;
+
+    Session::hotplug(event.devpath, docked);
+
+    dispatchHotplug(event.devpath, docked, decided);
+
+}
+
+void ACPIHandler::dispatchHotplug(const std::string &devpath, bool docked, bool decided) {
+
+    Stats::count(Stats::HOTPLUGS);
+    Trace::instant(Trace::EVENT, "drm hotplug", NULL, 0, NULL, 0, devpath.c_str());
+
+    CRTControllerManager::DockState state = docked ?
+            CRTControllerManager::DockState::DOCKED : CRTControllerManager::DockState::UNDOCKED;
+
+    /*
+     * A hook only runs when the state really changed. The ACPI
+     * event of a dock usually came first and ran it already, and
+     * the first hotplug only tells us where we are.
+     */
+
+    int hooked = hookedState.load();
+
+    if (hooked == CRTControllerManager::DockState::INVALID) {
+        hookedState.compare_exchange_strong(hooked, state);
+    }
+
+    post(state, decided && hooked != CRTControllerManager::DockState::INVALID && hooked != state, true);
+
+}
+
+void ACPIHandler::handleHookResult(const HookResult &result) {
+
+    Trace::log(LOG_INFO, "Hook %s finished in %ld ms with status %d%s\n", result.path.c_str(),
+           result.durationMs, result.status, result.timedOut ? " (timed out)" : "");
+
+    Stats::observe(Stats::HOOK, (uint64_t) result.durationMs * 1000000ULL);
+    Trace::span(Trace::HOOK, "hook", Stats::now() - (uint64_t) result.durationMs * 1000000ULL,
+                "status", result.status, "timed_out", result.timedOut, result.path.c_str());
+
+    if (result.timedOut) {
+        Stats::count(Stats::HOOK_TIMEOUTS);
+    } else if (result.status != 0) {
+        Stats::count(Stats::HOOK_FAILURES);
+    }
+
+}
+
+std::string ACPIHandler::handleCommand(const std::string &command) {
+
+    size_t space = command.find(' ');
+    std::string verb = command.substr(0, space);
+    std::string argument = space == std::string::npos ? "" : command.substr(space + 1);
+
+    if (verb == "stats") {
+        return Stats::format();
+    }
+
+    if (verb == "status") {
+        return status();
+    }
+
+    if (verb == "trace") {
+        return Trace::format();
+    }
+
+    if (verb == "reload") {
+
+        bool loaded = true;
+
+        for (auto &display : displays) {
+            loaded = display->profiles.load() && loaded;
+        }
+
+        if (!loaded) {
+            return "error: not all profiles could be loaded\n";
+        }
+
+        return "profiles reloaded\n";
+
+    }
 
-public:
-    void handleEvent(ACPIEvent event);
-};
+    if (verb == "set" || verb == "capture") {
 
-void ACPIHandler::handleEvent(ACPIEvent event) {
+        CRTControllerManager::DockState state = parseDockState(argument.c_str());
 
-    switch(event) {
-        case ACPIEvent::DOCKED:
-            pthread_mutex_lock(&mutex);
-            manager.applyConfiguration(CRTControllerManager::DockState::DOCKED);
-            hooks.executeDockHook();
-            pthread_mutex_unlock(&mutex);
-            break;
-        case ACPIEvent::UNDOCKED:
-            pthread_mutex_lock(&mutex);
-            manager.applyConfiguration(CRTControllerManager::DockState::UNDOCKED);
-            hooks.executeUndockHook();
-            pthread_mutex_unlock(&mutex);
-            break;
-        case ACPIEvent::POWER_S3S4_EXIT:
+        if (state == CRTControllerManager::DockState::INVALID) {
+            return "error: invalid dock state " + argument + "\n";
+        }
 
-            if (!dock.probe()) {
-                syslog(LOG_INFO, "Dock is not sane, not running dynamic sleep handler\n");
-                return;
-            }
+        if (verb == "capture") {
+            return capture(state);
+        }
 
-            pthread_mutex_lock(&mutex);
+        if (!apply(state, false, false)) {
+            return "error: failed to apply the " + argument + " profile, see the system log\n";
+        }
 
-            if (dock.isDocked()) {
-                manager.applyConfiguration(CRTControllerManager::DockState::DOCKED);
-            } else {
-                manager.applyConfiguration(CRTControllerManager::DockState::UNDOCKED);
-            }
+        return argument + " profile applied by the running daemon\n";
 
-            pthread_mutex_unlock(&mutex);
     }
 
+    return "error: unknown command " + command + "\n";
+
 }
 
-int startDaemon() {
+int startDaemon(int debounceMs, const char *recordPath) {
 
     openlog("dockd", LOG_NDELAY | LOG_PID, LOG_DAEMON);
 
+    /* Displays apply in parallel threads, Xlib only locks its shared state after this */
+    if (!XInitThreads()) {
+        syslog(LOG_ERR, "Xlib has no thread support, not starting\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
+
+    /* Keep syslog off the dock path, a slow journal would stall the apply */
+    if (!Trace::start()) {
+        syslog(LOG_ERR, "Logging synchronously, dock events will wait for syslog\n");
+    }
+
+    if (recordPath != NULL && !Session::start(recordPath, debounceMs)) {
+        syslog(LOG_ERR, "Failed to start recording to %s\n", recordPath);
+        closelog();
+        return EXIT_FAILURE;
+    }
+
     ACPI acpi;
-    ACPIHandler handler;
+    ACPIHandler handler(debounceMs);
+
+    if (!handler.init()) {
+        syslog(LOG_ERR, "Failed to start the daemon\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
 
     acpi.addEventHandler(&handler);
 
@@ -78,37 +949,339 @@ int startDaemon() {
     return EXIT_SUCCESS;
 }
 
+/* Collects what the worker did during a replay */
+class ReplayReport : public DockResultHandler {
+
+private:
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    ReplayClock *clock;
+
+public:
+
+    class Entry {
+    public:
+        uint64_t time;
+        DockResult result;
+    };
+
+    vector<Entry> entries;
+
+    ReplayReport(ReplayClock *clock) : clock(clock) {}
+
+    void handleDockResult(const DockResult &result) {
+
+        Entry entry;
+
+        entry.time = clock->now();
+        entry.result = result;
+
+        pthread_mutex_lock(&lock);
+        entries.push_back(entry);
+        pthread_mutex_unlock(&lock);
+
+    }
+
+};
+
+static int removeReplayFile(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Writes the recorded profile files of every display below the directory */
+static bool extractProfiles(const vector<SessionRecord> &records, const std::string &directory,
+                            vector<DisplayConfig> *displays) {
+
+    for (const SessionRecord &record : records) {
+
+        if (record.type != SessionRecord::DISPLAY && record.type != SessionRecord::PROFILE_FILE) {
+            continue;
+        }
+
+        SessionDecoder decoder(record.payload);
+        std::string displayDirectory = directory + "/" + std::to_string(record.display);
+
+        if (record.type == SessionRecord::DISPLAY) {
+
+            DisplayConfig config;
+
+            config.name = decoder.getString();
+            config.screen = decoder.getI32();
+
+            /* The recorded directory only matters on the recording machine */
+            decoder.getString();
+            config.directory = displayDirectory;
+
+            if (!decoder.ok() || record.display != displays->size()) {
+                fprintf(stderr, "The recording has a broken display record\n");
+                return false;
+            }
+
+            displays->push_back(config);
+
+            if (mkdir(displayDirectory.c_str(), 0700) != 0 ||
+                mkdir((displayDirectory + "/" CONFIG_NAME_PROFILES).c_str(), 0700) != 0) {
+                fprintf(stderr, "Can't create %s: %s\n", displayDirectory.c_str(), strerror(errno));
+                return false;
+            }
+
+            continue;
+
+        }
+
+        std::string name = decoder.getString();
+        std::string contents = decoder.getString();
+
+        if (!decoder.ok() || name.find("..") != std::string::npos || record.display >= displays->size()) {
+            fprintf(stderr, "The recording has a broken profile record\n");
+            return false;
+        }
+
+        std::string path = displayDirectory + "/" + name;
+        int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+        if (file < 0) {
+            fprintf(stderr, "Can't write %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        bool written = write(file, contents.data(), contents.size()) == (ssize_t) contents.size();
+        close(file);
+
+        if (!written) {
+            fprintf(stderr, "Can't write %s\n", path.c_str());
+            return false;
+        }
+
+    }
+
+    return true;
+
+}
+
+int replaySession(const char *path, double speed) {
+
+    /* Show why an apply fails right on the terminal */
+    openlog("dockd", LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    int debounceMs;
+    vector<SessionRecord> records;
+
+    if (!Session::load(path, &debounceMs, &records)) {
+        fprintf(stderr, "Can't read the recording %s\n", path);
+        closelog();
+        return EXIT_FAILURE;
+    }
+
+    char directory[] = "/tmp/dockd-replay-XXXXXX";
+
+    if (mkdtemp(directory) == NULL) {
+        fprintf(stderr, "Can't create a directory for the profiles: %s\n", strerror(errno));
+        closelog();
+        return EXIT_FAILURE;
+    }
+
+    vector<DisplayConfig> configs;
+
+    if (!extractProfiles(records, directory, &configs) || configs.size() == 0) {
+
+        if (configs.size() == 0) {
+            fprintf(stderr, "The recording has no displays\n");
+        }
+
+        nftw(directory, &removeReplayFile, 16, FTW_DEPTH | FTW_PHYS);
+        closelog();
+        return EXIT_FAILURE;
+
+    }
+
+    ReplayClock clock(speed);
+    ReplayReport report(&clock);
+    ACPIHandler handler((int) (debounceMs / speed));
+
+    vector<ReplayRandR*> servers;
+    vector<ManagedDisplay*> displays;
+
+    for (size_t i = 0; i < configs.size(); i++) {
+        servers.push_back(new ReplayRandR(records, (int) i, &clock));
+        displays.push_back(new ManagedDisplay(configs[i], servers[i]));
+    }
+
+    if (!handler.initReplay(displays, &report)) {
+        nftw(directory, &removeReplayFile, 16, FTW_DEPTH | FTW_PHYS);
+        closelog();
+        return EXIT_FAILURE;
+    }
+
+    unsigned long events = 0;
+
+    for (const SessionRecord &record : records) {
+
+        if (record.type != SessionRecord::ACPI_EVENT && record.type != SessionRecord::HOTPLUG) {
+            continue;
+        }
+
+        /* Nothing to watch while the daemon sleeps, jump to the next event */
+        if (handler.isIdle()) {
+            clock.skipTo(record.time);
+        }
+
+        clock.sleepUntil(record.time);
+
+        SessionDecoder decoder(record.payload);
+
+        if (record.type == SessionRecord::ACPI_EVENT) {
+
+            ACPIEvent event = (ACPIEvent) decoder.getU32();
+            bool sane = decoder.getU8() != 0;
+            bool docked = decoder.getU8() != 0;
+
+            if (decoder.ok()) {
+                handler.dispatch(event, sane, docked);
+                events++;
+            }
+
+        } else {
+
+            std::string devpath = decoder.getString();
+            bool docked = decoder.getU8() != 0;
+
+            if (decoder.ok()) {
+                /* Hooks don't run in a replay, so what decided the state doesn't matter */
+                handler.dispatchHotplug(devpath, docked, false);
+                events++;
+            }
+
+        }
+
+    }
+
+    while (!handler.isIdle()) {
+        usleep(1000);
+    }
+
+    handler.stop();
+
+    printf("Replayed %lu events from %s at %gx speed:\n\n", events, path, speed);
+    printf("  %10s %-10s %-8s %10s %12s\n", "at s", "state", "applied", "ms", "transitions");
+
+    bool failed = false;
+
+    for (const ReplayReport::Entry &entry : report.entries) {
+
+        const DockResult &result = entry.result;
+
+        printf("  %10.3f %-10s %-8s %10.3f %12lu\n", entry.time / 1e9,
+               result.state == CRTControllerManager::DockState::DOCKED ? "docked" : "undocked",
+               result.applied ? "yes" : "no", (result.finishedAt - result.postedAt) * speed / 1e6,
+               result.transitions);
+
+        failed |= !result.applied;
+
+    }
+
+    for (size_t i = 0; i < servers.size(); i++) {
+
+        std::string state = servers[i]->describeState();
+        std::string recorded = servers[i]->describeRecordedState();
+        bool matches = state == recorded;
+
+        printf("\n%s %s the recording:\n%s", configs[i].describe().c_str(),
+               matches ? "matches" : "differs from", state.c_str());
+
+        if (!matches) {
+            printf("\nThe recording ended with:\n%s", recorded.c_str());
+        }
+
+        failed |= !matches;
+
+    }
+
+    nftw(directory, &removeReplayFile, 16, FTW_DEPTH | FTW_PHYS);
+    closelog();
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
+
 int showHelp() {
     printf("Usage: dockd [OPERAND] [?ARGUMENT]\n"
            "\n"
            "    dockd --help                        - show this help dialog\n"
            "    dockd --config [docked|undocked]    - write config files\n"
            "    dockd --set [docked|undocked]       - set the saved config\n"
-           "    dockd --daemon                      - start the dock daemon\n");
+           "    dockd --plan [docked|undocked]      - show what --set would do, without doing it\n"
+           "    dockd --daemon [?debounce_ms]       - start the dock daemon\n"
+           "    dockd --record [file] [?debounce_ms]\n"
+           "                                        - start the dock daemon and record its dock sessions\n"
+           "    dockd --replay [file] [?speed]      - replay a recording offline and report the apply latency\n"
+           "    dockd --stats                       - print the running daemon's latency stats\n"
+           "    dockd --status                      - print the running daemon's state\n"
+           "    dockd --reload                      - make the running daemon re-read the profiles\n"
+           "    dockd --trace                       - print the running daemon's recent trace as Chrome trace JSON\n"
+           "\n"
+           "--config and --set go through the running daemon when there is one.\n");
     return EXIT_SUCCESS;
 }
 
-int writeConfig(const char *state) {
+/*
+ * Sends a command to the running daemon and prints its
+ * reply, returns -1 if the caller has to do it standalone
+ */
+static int requestDaemon(const std::string &command) {
 
-    CRTControllerManager::DockState dockState = CRTControllerManager::DockState::INVALID;
+    std::string reply;
 
-    if (strcmp(state, "docked") == 0) {
-        dockState = CRTControllerManager::DockState::DOCKED;
+    if (!ControlServer::request(command, &reply)) {
+        return -1;
     }
 
-    if (strcmp(state, "undocked") == 0) {
-        dockState = CRTControllerManager::DockState::UNDOCKED;
+    if (reply.compare(0, 12, "unavailable:") == 0) {
+        return -1;
+    }
+
+    if (reply.compare(0, 6, "error:") == 0) {
+        fputs(reply.c_str(), stderr);
+        return EXIT_FAILURE;
+    }
+
+    fputs(reply.c_str(), stdout);
+
+    return EXIT_SUCCESS;
+
+}
+
+int showDaemonReply(const char *command) {
+
+    int result = requestDaemon(command);
+
+    if (result < 0) {
+        fprintf(stderr, "Can't reach the dock daemon on %s. Is dockd --daemon running?\n",
+                ControlServer::socketPath().c_str());
+        return EXIT_FAILURE;
     }
 
+    return result;
+}
+
+int writeConfig(const char *state) {
+
+    CRTControllerManager::DockState dockState = parseDockState(state);
+
     if (dockState == CRTControllerManager::DockState::INVALID) {
         fprintf(stderr, "Invalid --config option: %s. See --help\n", state);
         return EXIT_FAILURE;
     }
 
-    CRTControllerManager manager;
+    int result = requestDaemon(std::string("capture ") + state);
+
+    if (result >= 0) {
+        return result;
+    }
+
+    CRTControllerManager manager(DisplayConfig::current());
     if (manager.writeConfigToDisk(dockState)) {
-        printf("config file written to %s\n",
-               dockState == CRTControllerManager::DockState::DOCKED ? CONFIG_LOCATION_DOCKED : CONFIG_LOCATION_UNDOCKED);
+        printf("config file written to %s\n", manager.getConfigLocation(dockState).c_str());
 
     }
     return EXIT_SUCCESS;
@@ -116,28 +1289,76 @@ int writeConfig(const char *state) {
 
 int applyConfig(const char *state) {
 
-    CRTControllerManager::DockState dockState = CRTControllerManager::DockState::INVALID;
+    CRTControllerManager::DockState dockState = parseDockState(state);
 
-    if (strcmp(state, "docked") == 0) {
-        dockState = CRTControllerManager::DockState::DOCKED;
+    if (dockState == CRTControllerManager::DockState::INVALID) {
+        fprintf(stderr, "Invalid --set option: %s. See --help\n", state);
+        return EXIT_FAILURE;
     }
 
-    if (strcmp(state, "undocked") == 0) {
-        dockState = CRTControllerManager::DockState::UNDOCKED;
+    int result = requestDaemon(std::string("set ") + state);
+
+    if (result >= 0) {
+        return result;
+    }
+
+    CRTControllerManager manager(DisplayConfig::current());
+    if (manager.applyConfiguration(dockState)) {
+        printf("config applied from %s\n", manager.getConfigLocation(dockState).c_str());
+
     }
+    return EXIT_SUCCESS;
+
+}
+
+int planConfig(const char *state) {
+
+    CRTControllerManager::DockState dockState = parseDockState(state);
 
     if (dockState == CRTControllerManager::DockState::INVALID) {
-        fprintf(stderr, "Invalid --set option: %s. See --help\n", state);
+        fprintf(stderr, "Invalid --plan option: %s. See --help\n", state);
         return EXIT_FAILURE;
     }
 
-    CRTControllerManager manager;
-    if (manager.applyConfiguration(dockState)) {
-        printf("config applied from %s\n",
-               dockState == CRTControllerManager::DockState::DOCKED ? CONFIG_LOCATION_DOCKED : CONFIG_LOCATION_UNDOCKED);
+    /* Show why a plan fails right on the terminal */
+    openlog("dockd", LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
 
+    CRTControllerManager manager(DisplayConfig::current());
+    CRTControllerManager::ApplyReport report;
+
+    manager.setDryRun(true);
+
+    bool planned = manager.applyConfiguration(dockState, &report);
+
+    printf("Plan for %s:\n\n", manager.getConfigLocation(dockState).c_str());
+
+    if (!planned) {
+        printf("  the profile can't be applied to this display\n");
+    } else if (report.requests.size() == 0) {
+        printf("  nothing to do, the display already matches\n");
     }
-    return EXIT_SUCCESS;
+
+    for (const std::string &request : report.requests) {
+        printf("  %s\n", request.c_str());
+    }
+
+    unsigned long roundTrips = 0;
+    uint64_t ns = 0;
+
+    printf("\n  %-12s %12s %10s\n", "phase", "round trips", "ms");
+
+    for (const CRTControllerManager::ApplyReport::Phase &phase : report.phases) {
+        printf("  %-12s %12lu %10.3f\n", phase.name, phase.roundTrips, phase.ns / 1e6);
+        roundTrips += phase.roundTrips;
+        ns += phase.ns;
+    }
+
+    printf("  %-12s %12lu %10.3f\n", "total", roundTrips, ns / 1e6);
+
+    closelog();
+
+    return planned ? EXIT_SUCCESS : EXIT_FAILURE;
 
 }
 
@@ -157,7 +1378,77 @@ int main(int argc, char *argv[])
     }
 
     if (strcmp(argv[1], "--daemon") == 0) {
-        return startDaemon();
+
+        int debounceMs = DEBOUNCE_MS;
+
+        if (argc >= 3) {
+            debounceMs = atoi(argv[2]);
+        }
+
+        if (debounceMs < 0) {
+            fprintf(stderr, "Invalid --daemon debounce: %s. See --help\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+
+        return startDaemon(debounceMs, NULL);
+    }
+
+    if (strcmp(argv[1], "--record") == 0) {
+
+        if (argc < 3) {
+            fprintf(stderr, "--record requires a file. See --help.\n");
+            return EXIT_FAILURE;
+        }
+
+        int debounceMs = DEBOUNCE_MS;
+
+        if (argc >= 4) {
+            debounceMs = atoi(argv[3]);
+        }
+
+        if (debounceMs < 0) {
+            fprintf(stderr, "Invalid --record debounce: %s. See --help\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+
+        return startDaemon(debounceMs, argv[2]);
+    }
+
+    if (strcmp(argv[1], "--replay") == 0) {
+
+        if (argc < 3) {
+            fprintf(stderr, "--replay requires a file. See --help.\n");
+            return EXIT_FAILURE;
+        }
+
+        double speed = 1;
+
+        if (argc >= 4) {
+            speed = atof(argv[3]);
+        }
+
+        if (speed <= 0) {
+            fprintf(stderr, "Invalid --replay speed: %s. See --help\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+
+        return replaySession(argv[2], speed);
+    }
+
+    if (strcmp(argv[1], "--stats") == 0) {
+        return showDaemonReply("stats");
+    }
+
+    if (strcmp(argv[1], "--status") == 0) {
+        return showDaemonReply("status");
+    }
+
+    if (strcmp(argv[1], "--reload") == 0) {
+        return showDaemonReply("reload");
+    }
+
+    if (strcmp(argv[1], "--trace") == 0) {
+        return showDaemonReply("trace");
     }
 
     if (strcmp(argv[1], "--help") == 0) {
@@ -175,6 +1466,17 @@ int main(int argc, char *argv[])
 
     }
 
+    if (strcmp(argv[1], "--plan") == 0) {
+
+        if (argc < 3) {
+            fprintf(stderr, "--plan requires an option. See --help.\n");
+            return EXIT_FAILURE;
+        }
+
+        return planConfig(argv[2]);
+
+    }
+
     if (strcmp(argv[1], "--set") == 0) {
 
         if (argc < 3) {
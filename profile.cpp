@@ -0,0 +1,564 @@
+#include "profile.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+using ThinkPad::Utilities::Ini::Ini;
+using ThinkPad::Utilities::Ini::IniSection;
+
+static std::atomic<unsigned long> generations(0);
+
+#define PROFILE_BINARY_MAGIC "DKDP"
+
+/*
+ * The binary profile, in native byte order:
+ *
+ *   BinaryHeader
+ *   BinaryController[controllers]
+ *   uint32_t output name offsets[outputs]
+ *   int32_t filter parameters[params]
+ *   NUL terminated strings
+ *
+ * The checksum covers everything after the checksum field. The
+ * INI's mtime and size tell whether the INI was edited since.
+ */
+struct BinaryHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t checksum;
+    int64_t iniMtime;
+    uint64_t iniSize;
+    int32_t width, height;
+    int32_t mmWidth, mmHeight;
+    uint32_t controllers;
+    uint32_t outputs;
+    uint32_t stringsSize;
+    uint32_t params;
+    uint32_t primary;
+    uint32_t reserved;
+};
+
+struct BinaryController {
+    uint64_t crtc;
+    int32_t x, y;
+    uint32_t rotation;
+    uint32_t mode;
+    uint32_t firstOutput;
+    uint32_t outputs;
+    int32_t modeWidth, modeHeight;
+    uint32_t modeClock;
+    uint32_t modeHTotal, modeVTotal;
+    uint32_t modeFlags;
+    uint32_t flags;
+    int32_t transform[9];
+    uint32_t filter;
+    uint32_t firstParam;
+    uint32_t params;
+    int32_t panning[12];
+};
+
+#define BINARY_HAS_TRANSFORM 0x1
+#define BINARY_HAS_PANNING   0x2
+
+#define BINARY_CHECKSUM_START (offsetof(BinaryHeader, checksum) + sizeof(uint32_t))
+
+static uint32_t checksum(const unsigned char *data, size_t len)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+/* Panning in xrandr's syntax, WxH+X+Y/WxH+X+Y/L/T/R/B, everything after the first area optional */
+static bool parsePanning(const char *text, Panning *panning)
+{
+    memset(panning, 0, sizeof(*panning));
+
+    int fields = sscanf(text, "%dx%d+%d+%d/%dx%d+%d+%d/%d/%d/%d/%d",
+                        &panning->width, &panning->height, &panning->left, &panning->top,
+                        &panning->trackWidth, &panning->trackHeight, &panning->trackLeft, &panning->trackTop,
+                        &panning->borderLeft, &panning->borderTop, &panning->borderRight, &panning->borderBottom);
+
+    return fields == 2 || fields >= 4;
+}
+
+/* Comma separated decimals, stored in 16.16 fixed point like the server does */
+static bool parseFixedList(const char *text, vector<XFixed> *values)
+{
+    values->clear();
+
+    while (*text) {
+
+        char *end;
+        double value = strtod(text, &end);
+
+        if (end == text) {
+            return false;
+        }
+
+        values->push_back((XFixed) lround(value * 65536));
+
+        text = end;
+
+        if (*text == ',') {
+            text++;
+        } else if (*text) {
+            return false;
+        }
+
+    }
+
+    return true;
+}
+
+static void panningToArray(const Panning &panning, int32_t *values)
+{
+    int32_t fields[12] = {
+        panning.left, panning.top, panning.width, panning.height,
+        panning.trackLeft, panning.trackTop, panning.trackWidth, panning.trackHeight,
+        panning.borderLeft, panning.borderTop, panning.borderRight, panning.borderBottom
+    };
+
+    memcpy(values, fields, sizeof(fields));
+}
+
+static void panningFromArray(const int32_t *values, Panning *panning)
+{
+    panning->left = values[0];
+    panning->top = values[1];
+    panning->width = values[2];
+    panning->height = values[3];
+    panning->trackLeft = values[4];
+    panning->trackTop = values[5];
+    panning->trackWidth = values[6];
+    panning->trackHeight = values[7];
+    panning->borderLeft = values[8];
+    panning->borderTop = values[9];
+    panning->borderRight = values[10];
+    panning->borderBottom = values[11];
+}
+
+static bool statIni(const char *path, int64_t *mtime, uint64_t *size)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    *mtime = (int64_t) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    *size = (uint64_t) st.st_size;
+
+    return true;
+}
+
+bool Profile::load(const char *path)
+{
+
+    if (!loadBinary(path) && !loadIni(path)) {
+        return false;
+    }
+
+    generation = ++generations;
+    this->path = path;
+
+    return true;
+
+}
+
+bool Profile::loadBinary(const char *path)
+{
+
+    std::string binary = std::string(path) + PROFILE_BINARY_SUFFIX;
+
+    int64_t iniMtime;
+    uint64_t iniSize;
+
+    if (!statIni(path, &iniMtime, &iniSize)) {
+        return false;
+    }
+
+    int fd = open(binary.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(BinaryHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t) st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Can't map %s: %s\n", binary.c_str(), strerror(errno));
+        return false;
+    }
+
+    const unsigned char *data = (const unsigned char *) map;
+    const BinaryHeader *header = (const BinaryHeader *) data;
+
+    /* Step 1: Make sure it is ours, whole, and newer than the INI */
+
+    bool valid = memcmp(header->magic, PROFILE_BINARY_MAGIC, 4) == 0 &&
+                 header->version == PROFILE_BINARY_VERSION &&
+                 header->size == size &&
+                 header->checksum == checksum(data + BINARY_CHECKSUM_START, size - BINARY_CHECKSUM_START);
+
+    if (valid) {
+        valid = sizeof(BinaryHeader) +
+                (size_t) header->controllers * sizeof(BinaryController) +
+                (size_t) header->outputs * sizeof(uint32_t) +
+                (size_t) header->params * sizeof(int32_t) +
+                header->stringsSize == size &&
+                header->stringsSize > 0 && data[size - 1] == '\0' &&
+                header->primary < header->stringsSize &&
+                header->controllers > 0 && header->width > 0 && header->height > 0;
+    }
+
+    if (valid && (header->iniMtime != iniMtime || header->iniSize != iniSize)) {
+        syslog(LOG_INFO, "%s is older than %s, parsing the INI\n", binary.c_str(), path);
+        valid = false;
+    }
+
+    if (!valid) {
+        munmap(map, size);
+        return false;
+    }
+
+    /* Step 2: Copy the records out, no key lookups or text parsing */
+
+    const BinaryController *records = (const BinaryController *) (data + sizeof(BinaryHeader));
+    const uint32_t *outputNames = (const uint32_t *) (records + header->controllers);
+    const int32_t *params = (const int32_t *) (outputNames + header->outputs);
+    const char *strings = (const char *) (params + header->params);
+
+    width = header->width;
+    height = header->height;
+    mm_width = header->mmWidth;
+    mm_height = header->mmHeight;
+    primary = strings + header->primary;
+
+    controllers.clear();
+
+    for (uint32_t i = 0; valid && i < header->controllers; i++) {
+
+        const BinaryController &record = records[i];
+
+        if (record.mode >= header->stringsSize || record.filter >= header->stringsSize ||
+            (uint64_t) record.firstOutput + record.outputs > header->outputs ||
+            (uint64_t) record.firstParam + record.params > header->params) {
+            valid = false;
+            break;
+        }
+
+        Controller controller;
+
+        controller.crtc = (RRCrtc) record.crtc;
+        controller.x = record.x;
+        controller.y = record.y;
+        controller.mode = strings + record.mode;
+        controller.rotation = (Rotation) record.rotation;
+
+        controller.timing.width = record.modeWidth;
+        controller.timing.height = record.modeHeight;
+        controller.timing.dotClock = record.modeClock;
+        controller.timing.hTotal = record.modeHTotal;
+        controller.timing.vTotal = record.modeVTotal;
+        controller.timing.flags = record.modeFlags;
+
+        controller.hasTransform = (record.flags & BINARY_HAS_TRANSFORM) != 0;
+        controller.transform.reset();
+
+        if (controller.hasTransform) {
+            memcpy(&controller.transform.matrix, record.transform, sizeof(record.transform));
+            controller.transform.filter = strings + record.filter;
+            controller.transform.params.assign(params + record.firstParam, params + record.firstParam + record.params);
+        }
+
+        controller.hasPanning = (record.flags & BINARY_HAS_PANNING) != 0;
+        panningFromArray(record.panning, &controller.panning);
+
+        for (uint32_t j = record.firstOutput; j < record.firstOutput + record.outputs; j++) {
+
+            if (outputNames[j] >= header->stringsSize) {
+                valid = false;
+                break;
+            }
+
+            controller.outputs.push_back(strings + outputNames[j]);
+
+        }
+
+        controllers.push_back(controller);
+
+    }
+
+    munmap(map, size);
+
+    if (!valid) {
+        syslog(LOG_ERR, "%s is corrupt, parsing the INI\n", binary.c_str());
+        return false;
+    }
+
+    return true;
+
+}
+
+bool Profile::writeBinary(const char *path) const
+{
+
+    std::string binary = std::string(path) + PROFILE_BINARY_SUFFIX;
+    std::string temporary = binary + ".tmp";
+
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+
+    if (!statIni(path, &header.iniMtime, &header.iniSize)) {
+        return false;
+    }
+
+    vector<BinaryController> records;
+    vector<uint32_t> outputNames;
+    vector<int32_t> params;
+    std::string strings;
+
+    header.primary = (uint32_t) strings.size();
+    strings.append(primary.c_str(), primary.size() + 1);
+
+    for (const Controller &controller : controllers) {
+
+        BinaryController record;
+        memset(&record, 0, sizeof(record));
+
+        record.crtc = controller.crtc;
+        record.x = controller.x;
+        record.y = controller.y;
+        record.rotation = controller.rotation;
+        record.mode = (uint32_t) strings.size();
+        record.firstOutput = (uint32_t) outputNames.size();
+        record.outputs = (uint32_t) controller.outputs.size();
+        record.modeWidth = controller.timing.width;
+        record.modeHeight = controller.timing.height;
+        record.modeClock = (uint32_t) controller.timing.dotClock;
+        record.modeHTotal = controller.timing.hTotal;
+        record.modeVTotal = controller.timing.vTotal;
+        record.modeFlags = (uint32_t) controller.timing.flags;
+        record.flags = (controller.hasTransform ? BINARY_HAS_TRANSFORM : 0) |
+                       (controller.hasPanning ? BINARY_HAS_PANNING : 0);
+
+        strings.append(controller.mode.c_str(), controller.mode.size() + 1);
+
+        if (controller.hasTransform) {
+            memcpy(record.transform, &controller.transform.matrix, sizeof(record.transform));
+            record.filter = (uint32_t) strings.size();
+            strings.append(controller.transform.filter.c_str(), controller.transform.filter.size() + 1);
+            record.firstParam = (uint32_t) params.size();
+            record.params = (uint32_t) controller.transform.params.size();
+            params.insert(params.end(), controller.transform.params.begin(), controller.transform.params.end());
+        }
+
+        if (controller.hasPanning) {
+            panningToArray(controller.panning, record.panning);
+        }
+
+        for (const std::string &output : controller.outputs) {
+            outputNames.push_back((uint32_t) strings.size());
+            strings.append(output.c_str(), output.size() + 1);
+        }
+
+        records.push_back(record);
+
+    }
+
+    memcpy(header.magic, PROFILE_BINARY_MAGIC, 4);
+    header.version = PROFILE_BINARY_VERSION;
+    header.width = width;
+    header.height = height;
+    header.mmWidth = mm_width;
+    header.mmHeight = mm_height;
+    header.controllers = (uint32_t) records.size();
+    header.outputs = (uint32_t) outputNames.size();
+    header.params = (uint32_t) params.size();
+    header.stringsSize = (uint32_t) strings.size();
+
+    std::string data((const char *) &header, sizeof(header));
+
+    data.append((const char *) records.data(), records.size() * sizeof(BinaryController));
+    data.append((const char *) outputNames.data(), outputNames.size() * sizeof(uint32_t));
+    data.append((const char *) params.data(), params.size() * sizeof(int32_t));
+    data.append(strings);
+
+    BinaryHeader *written = (BinaryHeader *) &data[0];
+
+    written->size = (uint32_t) data.size();
+    written->checksum = checksum((const unsigned char *) data.data() + BINARY_CHECKSUM_START,
+                                 data.size() - BINARY_CHECKSUM_START);
+
+    /* Readers must never map a half written file */
+    FILE *file = fopen(temporary.c_str(), "wbe");
+
+    if (!file) {
+        syslog(LOG_ERR, "Can't write %s: %s\n", temporary.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool complete = fwrite(data.data(), 1, data.size(), file) == data.size();
+
+    if (fclose(file) != 0 || !complete || rename(temporary.c_str(), binary.c_str()) != 0) {
+        syslog(LOG_ERR, "Can't write %s: %s\n", binary.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    return true;
+
+}
+
+bool Profile::loadIni(const char *path)
+{
+
+    Ini config;
+
+    if (!config.readIni(path)) {
+        syslog(LOG_ERR, "Can't open config file %s\n", path);
+        return false;
+    }
+
+    /* Screen */
+
+    IniSection *screen = config.getSection("Screen");
+
+    if (!screen) {
+        syslog(LOG_ERR, "Config file %s has no Screen section\n", path);
+        return false;
+    }
+
+    width = screen->getInt("width");
+    height = screen->getInt("height");
+    mm_width = screen->getInt("mm_width");
+    mm_height = screen->getInt("mm_height");
+
+    if (width <= 0 || height <= 0) {
+        syslog(LOG_ERR, "Config file %s has an invalid screen size\n", path);
+        return false;
+    }
+
+    const char *primaryOutput = screen->getString("primary");
+    primary = primaryOutput ? primaryOutput : "";
+
+    /* CRTCs */
+
+    vector<IniSection*> sections = config.getSections("CRTC");
+
+    if (sections.size() == 0) {
+        syslog(LOG_ERR, "Config file %s has no CRTC sections\n", path);
+        return false;
+    }
+
+    controllers.clear();
+
+    for (IniSection *section : sections) {
+
+        const char *mode = section->getString("mode");
+
+        if (!mode) {
+            syslog(LOG_ERR, "Config file %s has a CRTC without a mode\n", path);
+            return false;
+        }
+
+        Controller controller;
+
+        controller.crtc = (RRCrtc) section->getInt("crtc");
+        controller.x = section->getInt("x");
+        controller.y = section->getInt("y");
+        controller.mode = mode;
+        controller.rotation = (Rotation) section->getInt("rotation");
+
+        /* Older profiles only have the mode name */
+        Timing &timing = controller.timing;
+
+        timing.width = timing.height = 0;
+        timing.dotClock = 0;
+        timing.hTotal = timing.vTotal = 0;
+        timing.flags = 0;
+
+        if (section->getString("mode_clock")) {
+            timing.width = section->getInt("mode_width");
+            timing.height = section->getInt("mode_height");
+            timing.dotClock = (unsigned long) section->getInt("mode_clock");
+            timing.hTotal = (unsigned int) section->getInt("mode_htotal");
+            timing.vTotal = (unsigned int) section->getInt("mode_vtotal");
+            timing.flags = (unsigned long) section->getInt("mode_flags");
+        }
+
+        for (const char *output : section->getStringArray("outputs")) {
+            controller.outputs.push_back(output);
+        }
+
+        /* Scaling and panning, as xrandr --transform and --panning take them */
+
+        const char *transform = section->getString("transform");
+        const char *filter = section->getString("filter");
+        const char *filterParams = section->getString("filter_params");
+        const char *panning = section->getString("panning");
+
+        controller.hasTransform = transform != NULL;
+        controller.transform.reset();
+
+        if (transform) {
+
+            vector<XFixed> matrix;
+
+            if (!parseFixedList(transform, &matrix) || matrix.size() != 9) {
+                syslog(LOG_ERR, "Config file %s has an invalid transform: %s\n", path, transform);
+                return false;
+            }
+
+            memcpy(&controller.transform.matrix, matrix.data(), sizeof(controller.transform.matrix));
+            controller.transform.filter = filter ? filter : "";
+
+            if (filterParams && !parseFixedList(filterParams, &controller.transform.params)) {
+                syslog(LOG_ERR, "Config file %s has invalid filter parameters: %s\n", path, filterParams);
+                return false;
+            }
+
+        }
+
+        controller.hasPanning = panning != NULL;
+        memset(&controller.panning, 0, sizeof(controller.panning));
+
+        if (panning && !parsePanning(panning, &controller.panning)) {
+            syslog(LOG_ERR, "Config file %s has an invalid panning: %s\n", path, panning);
+            return false;
+        }
+
+        controllers.push_back(controller);
+
+    }
+
+    return true;
+
+}
@@ -0,0 +1,76 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "randr.h"
+
+#include <cstdint>
+#include <string>
+
+/* The binary copy lives next to the INI, e.g. docked.conf.bin */
+#define PROFILE_BINARY_SUFFIX ".bin"
+#define PROFILE_BINARY_VERSION 2
+
+/*
+ * An output mode profile as stored in the
+ * config files, parsed and validated once
+ */
+class Profile {
+
+public:
+
+    /*
+     * The timing of the mode at capture time, several
+     * modes can share a name at different refresh rates
+     */
+    class Timing {
+    public:
+        int width, height;
+        unsigned long dotClock; // kHz, 0 if the profile predates timings
+        unsigned int hTotal, vTotal;
+        unsigned long flags;
+    };
+
+    class Controller {
+    public:
+        RRCrtc crtc;
+        int x, y;
+        std::string mode;
+        Timing timing;
+        Rotation rotation;
+        vector<std::string> outputs;
+
+        /* Profiles written before these were captured leave them alone */
+        bool hasTransform = false;
+        CrtcTransform transform;
+        bool hasPanning = false;
+        Panning panning;
+    };
+
+    int width, height;
+    int mm_width, mm_height;
+
+    /* Empty to leave the primary output alone */
+    std::string primary;
+
+    vector<Controller> controllers;
+
+    /* Unique per successful load, lets caches tell profiles apart */
+    unsigned long generation;
+
+    /* The INI it was loaded from, its older versions are kept next to it */
+    std::string path;
+
+    /* Uses the binary copy when it matches the INI, otherwise parses the INI */
+    bool load(const char *path);
+
+    /* Writes the binary copy of the INI this profile was loaded from */
+    bool writeBinary(const char *path) const;
+
+private:
+
+    bool loadIni(const char *path);
+    bool loadBinary(const char *path);
+
+};
+
+#endif // PROFILE_H
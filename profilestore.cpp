@@ -0,0 +1,299 @@
+#include "profilestore.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* Parses the docked-<fingerprint>.conf names written by --config */
+static bool parseProfileName(const char *name, CRTControllerManager::DockState *state, uint64_t *fingerprint)
+{
+
+    char prefix[16];
+    unsigned long long value;
+    int consumed = 0;
+
+    if (sscanf(name, "%15[a-z]-%16llx.conf%n", prefix, &value, &consumed) != 2 ||
+        consumed != (int) strlen(name)) {
+        return false;
+    }
+
+    if (strcmp(prefix, "docked") == 0) {
+        *state = CRTControllerManager::DockState::DOCKED;
+    } else if (strcmp(prefix, "undocked") == 0) {
+        *state = CRTControllerManager::DockState::UNDOCKED;
+    } else {
+        return false;
+    }
+
+    *fingerprint = (uint64_t) value;
+
+    return true;
+
+}
+
+ProfileStore::ProfileStore(const std::string &directory) :
+    directory(directory), profileDirectory(directory + "/" CONFIG_NAME_PROFILES)
+{
+
+}
+
+bool ProfileStore::load()
+{
+    bool dockedLoaded = reload(CRTControllerManager::DockState::DOCKED);
+    bool undockedLoaded = reload(CRTControllerManager::DockState::UNDOCKED);
+
+    loadFingerprinted();
+
+    return dockedLoaded && undockedLoaded;
+}
+
+bool ProfileStore::reload(CRTControllerManager::DockState state)
+{
+
+    std::string location = directory + "/" + (state == CRTControllerManager::DockState::DOCKED ?
+                                              CONFIG_NAME_DOCKED : CONFIG_NAME_UNDOCKED);
+    const char *path = location.c_str();
+
+    std::shared_ptr<Profile> profile(new Profile);
+
+    /* A bad edit must not replace the last good profile */
+    if (!profile->load(path)) {
+        syslog(LOG_ERR, "Keeping the previous profile for %s\n", path);
+        return false;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if (state == CRTControllerManager::DockState::DOCKED) {
+        docked = profile;
+    } else {
+        undocked = profile;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    syslog(LOG_INFO, "Loaded profile %s\n", path);
+
+    return true;
+
+}
+
+void ProfileStore::loadFingerprinted()
+{
+
+    DIR *dir = opendir(profileDirectory.c_str());
+
+    if (!dir) {
+        return;
+    }
+
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        reloadFingerprinted(entry->d_name);
+    }
+
+    closedir(dir);
+
+}
+
+bool ProfileStore::reloadFingerprinted(const char *name)
+{
+
+    CRTControllerManager::DockState state;
+    uint64_t fingerprint;
+
+    if (!parseProfileName(name, &state, &fingerprint)) {
+        return false;
+    }
+
+    std::string path = profileDirectory + "/" + name;
+
+    /* The file is gone, so is the profile */
+    if (access(path.c_str(), F_OK) != 0) {
+        pthread_mutex_lock(&mutex);
+        fingerprinted.erase(fingerprint);
+        pthread_mutex_unlock(&mutex);
+        syslog(LOG_INFO, "Dropped profile %s\n", path.c_str());
+        return true;
+    }
+
+    std::shared_ptr<Profile> profile(new Profile);
+
+    if (!profile->load(path.c_str())) {
+        syslog(LOG_ERR, "Keeping the previous profile for %s\n", path.c_str());
+        return false;
+    }
+
+    FingerprintedProfile entry;
+    entry.state = state;
+    entry.profile = profile;
+
+    pthread_mutex_lock(&mutex);
+    fingerprinted[fingerprint] = entry;
+    pthread_mutex_unlock(&mutex);
+
+    syslog(LOG_INFO, "Loaded profile %s\n", path.c_str());
+
+    return true;
+
+}
+
+std::shared_ptr<const Profile> ProfileStore::get(CRTControllerManager::DockState state)
+{
+
+    std::shared_ptr<const Profile> profile;
+
+    pthread_mutex_lock(&mutex);
+    profile = state == CRTControllerManager::DockState::DOCKED ? docked : undocked;
+    pthread_mutex_unlock(&mutex);
+
+    return profile;
+
+}
+
+std::shared_ptr<const Profile> ProfileStore::find(uint64_t fingerprint)
+{
+
+    std::shared_ptr<const Profile> profile;
+
+    pthread_mutex_lock(&mutex);
+
+    auto it = fingerprinted.find(fingerprint);
+
+    if (it != fingerprinted.end()) {
+        profile = it->second.profile;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return profile;
+
+}
+
+bool ProfileStore::hasFingerprinted(CRTControllerManager::DockState state)
+{
+
+    bool found = false;
+
+    pthread_mutex_lock(&mutex);
+
+    for (auto &entry : fingerprinted) {
+        if (entry.second.state == state) {
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return found;
+
+}
+
+size_t ProfileStore::countFingerprinted()
+{
+
+    pthread_mutex_lock(&mutex);
+    size_t count = fingerprinted.size();
+    pthread_mutex_unlock(&mutex);
+
+    return count;
+
+}
+
+bool ProfileStore::startWatching()
+{
+
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+
+    if (inotifyFd < 0) {
+        syslog(LOG_ERR, "Failed to initialize inotify: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* Editors often replace the file instead of writing it in place */
+    configWatch = inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+
+    if (configWatch < 0) {
+        syslog(LOG_ERR, "Failed to watch %s: %s\n", directory.c_str(), strerror(errno));
+        close(inotifyFd);
+        inotifyFd = -1;
+        return false;
+    }
+
+    watchProfileDirectory();
+
+    if (pthread_create(&watcher, NULL, &ProfileStore::watch, this) != 0) {
+        syslog(LOG_ERR, "Failed to start the profile watcher\n");
+        close(inotifyFd);
+        inotifyFd = -1;
+        return false;
+    }
+
+    pthread_detach(watcher);
+
+    return true;
+
+}
+
+void ProfileStore::watchProfileDirectory()
+{
+
+    if (profileWatch >= 0) {
+        return;
+    }
+
+    /* The directory only exists after the first --config */
+    profileWatch = inotify_add_watch(inotifyFd, profileDirectory.c_str(),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+
+}
+
+void *ProfileStore::watch(void *store)
+{
+
+    ProfileStore *self = (ProfileStore *) store;
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+
+        ssize_t len = read(self->inotifyFd, buffer, sizeof(buffer));
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Profile watcher stopped: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + len; ) {
+
+            struct inotify_event *event = (struct inotify_event *) ptr;
+
+            if (event->len > 0 && event->wd == self->configWatch) {
+                if (strcmp(event->name, CONFIG_NAME_DOCKED) == 0) {
+                    self->reload(CRTControllerManager::DockState::DOCKED);
+                } else if (strcmp(event->name, CONFIG_NAME_UNDOCKED) == 0) {
+                    self->reload(CRTControllerManager::DockState::UNDOCKED);
+                } else if (strcmp(event->name, CONFIG_NAME_PROFILES) == 0 && (event->mask & IN_ISDIR)) {
+                    self->watchProfileDirectory();
+                    self->loadFingerprinted();
+                }
+            } else if (event->len > 0 && event->wd == self->profileWatch) {
+                self->reloadFingerprinted(event->name);
+            }
+
+            ptr += sizeof(struct inotify_event) + event->len;
+
+        }
+
+    }
+
+}
@@ -0,0 +1,66 @@
+#ifndef PROFILESTORE_H
+#define PROFILESTORE_H
+
+#include <cstdint>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+
+#include "crtc.h"
+#include "profile.h"
+
+/*
+ * Keeps every profile parsed in memory and re-parses
+ * a profile only when inotify reports that its file in
+ * the display's config directory or its profiles
+ * subdirectory changed.
+ *
+ * Profiles written by --config are also indexed by the
+ * fingerprint of the monitors they were captured with.
+ */
+class ProfileStore {
+
+private:
+
+    class FingerprintedProfile {
+    public:
+        CRTControllerManager::DockState state;
+        std::shared_ptr<const Profile> profile;
+    };
+
+    std::string directory;
+    std::string profileDirectory;
+
+    std::shared_ptr<const Profile> docked;
+    std::shared_ptr<const Profile> undocked;
+
+    std::unordered_map<uint64_t, FingerprintedProfile> fingerprinted;
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t watcher;
+    int inotifyFd = -1;
+    int configWatch = -1;
+    int profileWatch = -1;
+
+    bool reload(CRTControllerManager::DockState state);
+    bool reloadFingerprinted(const char *name);
+    void loadFingerprinted();
+    void watchProfileDirectory();
+    static void *watch(void *store);
+
+public:
+
+    ProfileStore(const std::string &directory = CONFIG_DIRECTORY);
+
+    bool load();
+    bool startWatching();
+
+    std::shared_ptr<const Profile> get(CRTControllerManager::DockState state);
+    std::shared_ptr<const Profile> find(uint64_t fingerprint);
+    bool hasFingerprinted(CRTControllerManager::DockState state);
+    size_t countFingerprinted();
+
+};
+
+#endif // PROFILESTORE_H
@@ -0,0 +1,186 @@
+#ifndef RANDR_H
+#define RANDR_H
+
+#include <X11/extensions/Xrandr.h>
+#include <libthinkpad.h>
+
+#include <cmath>
+#include <string>
+
+/*
+ * Plain copies of the RandR objects the manager works
+ * with, so backends don't have to hand out Xlib structs
+ */
+
+class ModeInfo {
+public:
+    RRMode id;
+    std::string name;
+    unsigned int width, height;
+    unsigned long dotClock;
+    unsigned int hSyncStart, hSyncEnd, hTotal, hSkew;
+    unsigned int vSyncStart, vSyncEnd, vTotal;
+    XRRModeFlags modeFlags;
+};
+
+class ScreenResources {
+public:
+    Time configTimestamp;
+    vector<RRCrtc> crtcs;
+    vector<RROutput> outputs;
+    vector<ModeInfo> modes;
+};
+
+class OutputInfo {
+public:
+    RROutput output;
+    std::string name;
+    Connection connection;
+    RRCrtc crtc;
+    vector<RRMode> modes;
+    int npreferred;
+};
+
+class CrtcInfo {
+public:
+    RRCrtc crtc;
+    int x, y;
+    RRMode mode;
+    Rotation rotation;
+    vector<RROutput> outputs;
+};
+
+class ScreenSize {
+public:
+    int width, height;
+    int mm_width, mm_height;
+};
+
+/*
+ * The matrix from CRTC to screen pixels, e.g. from xrandr
+ * --scale, with the filter used to resample the picture
+ */
+class CrtcTransform {
+public:
+    XTransform matrix;
+    std::string filter;
+    vector<XFixed> params;
+
+    void reset() {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                matrix.matrix[i][j] = i == j ? XDoubleToFixed(1) : 0;
+            }
+        }
+        filter.clear();
+        params.clear();
+    }
+
+    bool operator==(const CrtcTransform &other) const {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                if (matrix.matrix[i][j] != other.matrix.matrix[i][j]) {
+                    return false;
+                }
+            }
+        }
+        return filter == other.filter && params == other.params;
+    }
+
+    /* The size a width x height picture covers on the screen */
+    void bounds(int width, int height, int *boundsWidth, int *boundsHeight) const {
+        double minX = 0, minY = 0, maxX = 0, maxY = 0;
+        for (int corner = 0; corner < 4; corner++) {
+            double v[3] = { (corner & 1) ? (double) width : 0.0, (corner & 2) ? (double) height : 0.0, 1.0 };
+            double out[3];
+            for (int i = 0; i < 3; i++) {
+                out[i] = XFixedToDouble(matrix.matrix[i][0]) * v[0] +
+                         XFixedToDouble(matrix.matrix[i][1]) * v[1] +
+                         XFixedToDouble(matrix.matrix[i][2]) * v[2];
+            }
+            double x = out[2] != 0 ? out[0] / out[2] : out[0];
+            double y = out[2] != 0 ? out[1] / out[2] : out[1];
+            minX = corner == 0 || x < minX ? x : minX;
+            minY = corner == 0 || y < minY ? y : minY;
+            maxX = corner == 0 || x > maxX ? x : maxX;
+            maxY = corner == 0 || y > maxY ? y : maxY;
+        }
+        *boundsWidth = (int) std::ceil(maxX - minX);
+        *boundsHeight = (int) std::ceil(maxY - minY);
+    }
+};
+
+/* The area a CRTC pans over, all zero when panning is off */
+class Panning {
+public:
+    int left, top, width, height;
+    int trackLeft, trackTop, trackWidth, trackHeight;
+    int borderLeft, borderTop, borderRight, borderBottom;
+
+    bool operator==(const Panning &other) const {
+        return left == other.left && top == other.top && width == other.width && height == other.height &&
+               trackLeft == other.trackLeft && trackTop == other.trackTop &&
+               trackWidth == other.trackWidth && trackHeight == other.trackHeight &&
+               borderLeft == other.borderLeft && borderTop == other.borderTop &&
+               borderRight == other.borderRight && borderBottom == other.borderBottom;
+    }
+};
+
+/*
+ * Everything CRTControllerManager needs from the server.
+ * Implementations count every request that waits for a
+ * reply, batched queries may share a single round trip.
+ */
+class RandR {
+
+protected:
+
+    unsigned long roundTrips = 0;
+
+public:
+
+    virtual ~RandR() {}
+
+    virtual bool connect() = 0;
+    virtual void disconnect() = 0;
+
+    /*
+     * These fill the vectors in place, reusing what they already
+     * hold so repeated queries don't allocate. Info vectors get one
+     * entry per id, with a None id where the query failed.
+     */
+    virtual bool getScreenResources(ScreenResources *resources) = 0;
+    virtual void getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos) = 0;
+    virtual void getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos) = 0;
+    virtual void getScreenSize(ScreenSize *size) = 0;
+
+    /* Raw EDID blobs, empty for outputs without one */
+    virtual void getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids) = 0;
+
+    /* Filled in place like the infos, identity and no panning where the query failed */
+    virtual void getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms) = 0;
+    virtual void getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings) = 0;
+    virtual RROutput getPrimaryOutput() = 0;
+
+    /* Returns true if a RandR notification arrived within the timeout */
+    virtual bool waitForEvent(int timeoutMs) = 0;
+
+    virtual void grab() = 0;
+    virtual void ungrab() = 0;
+    virtual void sync() = 0;
+
+    virtual bool setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                               const RROutput *outputs, int noutputs) = 0;
+    virtual void setScreenSize(int width, int height, int mm_width, int mm_height) = 0;
+
+    /* Pending until the next setCrtcConfig on the CRTC, so both take one mode set */
+    virtual void setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform) = 0;
+    virtual bool setPanning(RRCrtc crtc, const Panning &panning) = 0;
+    virtual void setPrimaryOutput(RROutput output) = 0;
+
+    unsigned long getRoundTrips() const { return roundTrips; }
+    void resetRoundTrips() { roundTrips = 0; }
+
+};
+
+#endif // RANDR_H
@@ -0,0 +1,292 @@
+#include "recordrandr.h"
+#include "session.h"
+
+RecordingRandR::RecordingRandR(RandR *randr, int display) : randr(randr), display(display)
+{
+
+}
+
+void RecordingRandR::countRoundTrips(unsigned long before)
+{
+    roundTrips += randr->getRoundTrips() - before;
+}
+
+bool RecordingRandR::connect()
+{
+
+    unsigned long before = randr->getRoundTrips();
+    bool connected = randr->connect();
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putU8(connected);
+    Session::write(SessionRecord::CONNECT, display, payload);
+
+    return connected;
+
+}
+
+void RecordingRandR::disconnect()
+{
+    randr->disconnect();
+}
+
+bool RecordingRandR::getScreenResources(ScreenResources *resources)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    bool received = randr->getScreenResources(resources);
+    countRoundTrips(before);
+
+    /* A failed query is just not recorded, the replay keeps the last reply */
+    if (received) {
+        SessionEncoder payload;
+        payload.putResources(*resources);
+        Session::write(SessionRecord::RESOURCES, display, payload);
+    }
+
+    return received;
+
+}
+
+void RecordingRandR::getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->getOutputInfos(outputs, infos);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putU32((uint32_t) infos->size());
+
+    for (const OutputInfo &info : *infos) {
+        payload.putOutputInfo(info);
+    }
+
+    Session::write(SessionRecord::OUTPUT_INFOS, display, payload);
+
+}
+
+void RecordingRandR::getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->getCrtcInfos(crtcs, infos);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putU32((uint32_t) infos->size());
+
+    for (const CrtcInfo &info : *infos) {
+        payload.putCrtcInfo(info);
+    }
+
+    Session::write(SessionRecord::CRTC_INFOS, display, payload);
+
+}
+
+void RecordingRandR::getScreenSize(ScreenSize *size)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->getScreenSize(size);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putScreenSize(*size);
+    Session::write(SessionRecord::SCREEN_SIZE, display, payload);
+
+}
+
+void RecordingRandR::getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->getOutputEdids(outputs, edids);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putIds(outputs);
+
+    for (const std::string &edid : *edids) {
+        payload.putString(edid);
+    }
+
+    Session::write(SessionRecord::EDIDS, display, payload);
+
+}
+
+void RecordingRandR::getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->getCrtcTransforms(crtcs, transforms);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putIds(crtcs);
+
+    for (const CrtcTransform &transform : *transforms) {
+        payload.putTransform(transform);
+    }
+
+    Session::write(SessionRecord::TRANSFORMS, display, payload);
+
+}
+
+void RecordingRandR::getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->getPannings(crtcs, pannings);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putIds(crtcs);
+
+    for (const Panning &panning : *pannings) {
+        payload.putPanning(panning);
+    }
+
+    Session::write(SessionRecord::PANNINGS, display, payload);
+
+}
+
+RROutput RecordingRandR::getPrimaryOutput()
+{
+
+    unsigned long before = randr->getRoundTrips();
+    RROutput primary = randr->getPrimaryOutput();
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putU32((uint32_t) primary);
+    Session::write(SessionRecord::PRIMARY, display, payload);
+
+    return primary;
+
+}
+
+bool RecordingRandR::waitForEvent(int timeoutMs)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    bool changed = randr->waitForEvent(timeoutMs);
+    countRoundTrips(before);
+
+    /* Stamped when the wait ended, which is when a notification arrived */
+    SessionEncoder payload;
+    payload.putI32(timeoutMs);
+    payload.putU8(changed);
+    Session::write(SessionRecord::WAIT_EVENT, display, payload);
+
+    return changed;
+
+}
+
+void RecordingRandR::grab()
+{
+    randr->grab();
+    Session::write(SessionRecord::GRAB, display, SessionEncoder());
+}
+
+void RecordingRandR::ungrab()
+{
+    randr->ungrab();
+    Session::write(SessionRecord::UNGRAB, display, SessionEncoder());
+}
+
+void RecordingRandR::sync()
+{
+
+    unsigned long before = randr->getRoundTrips();
+    randr->sync();
+    countRoundTrips(before);
+
+    Session::write(SessionRecord::SYNC, display, SessionEncoder());
+
+}
+
+bool RecordingRandR::setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                                   const RROutput *outputs, int noutputs)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    bool set = randr->setCrtcConfig(crtc, x, y, mode, rotation, outputs, noutputs);
+    countRoundTrips(before);
+
+    CrtcInfo info;
+
+    info.crtc = crtc;
+    info.x = x;
+    info.y = y;
+    info.mode = mode;
+    info.rotation = rotation;
+    info.outputs.assign(outputs, outputs + noutputs);
+
+    SessionEncoder payload;
+    payload.putCrtcInfo(info);
+    payload.putU8(set);
+    Session::write(SessionRecord::SET_CRTC, display, payload);
+
+    return set;
+
+}
+
+void RecordingRandR::setScreenSize(int width, int height, int mm_width, int mm_height)
+{
+
+    randr->setScreenSize(width, height, mm_width, mm_height);
+
+    ScreenSize size;
+
+    size.width = width;
+    size.height = height;
+    size.mm_width = mm_width;
+    size.mm_height = mm_height;
+
+    SessionEncoder payload;
+    payload.putScreenSize(size);
+    Session::write(SessionRecord::SET_SCREEN_SIZE, display, payload);
+
+}
+
+void RecordingRandR::setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform)
+{
+
+    randr->setCrtcTransform(crtc, transform);
+
+    SessionEncoder payload;
+    payload.putU32((uint32_t) crtc);
+    payload.putTransform(transform);
+    Session::write(SessionRecord::SET_TRANSFORM, display, payload);
+
+}
+
+bool RecordingRandR::setPanning(RRCrtc crtc, const Panning &panning)
+{
+
+    unsigned long before = randr->getRoundTrips();
+    bool set = randr->setPanning(crtc, panning);
+    countRoundTrips(before);
+
+    SessionEncoder payload;
+    payload.putU32((uint32_t) crtc);
+    payload.putPanning(panning);
+    payload.putU8(set);
+    Session::write(SessionRecord::SET_PANNING, display, payload);
+
+    return set;
+
+}
+
+void RecordingRandR::setPrimaryOutput(RROutput output)
+{
+
+    randr->setPrimaryOutput(output);
+
+    SessionEncoder payload;
+    payload.putU32((uint32_t) output);
+    Session::write(SessionRecord::SET_PRIMARY, display, payload);
+
+}
@@ -0,0 +1,55 @@
+#ifndef RECORDRANDR_H
+#define RECORDRANDR_H
+
+#include "randr.h"
+
+#include <memory>
+
+/*
+ * Passes every call on to another backend and writes
+ * the query, its reply and every request that changes
+ * the display into the session recording
+ */
+class RecordingRandR : public RandR {
+
+private:
+
+    std::unique_ptr<RandR> randr;
+    int display;
+
+    /* Adds what the backend spent since before, so resetRoundTrips() works on this one */
+    void countRoundTrips(unsigned long before);
+
+public:
+
+    /* Takes ownership of the backend */
+    RecordingRandR(RandR *randr, int display);
+
+    bool connect();
+    void disconnect();
+
+    bool getScreenResources(ScreenResources *resources);
+    void getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos);
+    void getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos);
+    void getScreenSize(ScreenSize *size);
+    void getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids);
+    void getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms);
+    void getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings);
+    RROutput getPrimaryOutput();
+
+    bool waitForEvent(int timeoutMs);
+
+    void grab();
+    void ungrab();
+    void sync();
+
+    bool setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                       const RROutput *outputs, int noutputs);
+    void setScreenSize(int width, int height, int mm_width, int mm_height);
+    void setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform);
+    bool setPanning(RRCrtc crtc, const Panning &panning);
+    void setPrimaryOutput(RROutput output);
+
+};
+
+#endif // RECORDRANDR_H
@@ -0,0 +1,707 @@
+#include "replayrandr.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+static bool sameCrtc(const CrtcInfo &a, const CrtcInfo &b)
+{
+    return a.x == b.x && a.y == b.y && a.mode == b.mode && a.rotation == b.rotation && a.outputs == b.outputs;
+}
+
+static bool sameSize(const ScreenSize &a, const ScreenSize &b)
+{
+    return a.width == b.width && a.height == b.height && a.mm_width == b.mm_width && a.mm_height == b.mm_height;
+}
+
+ReplayClock::ReplayClock(double speed) : speed(speed), origin(Stats::now())
+{
+
+}
+
+uint64_t ReplayClock::now() const
+{
+    return (uint64_t) ((Stats::now() - origin.load()) * speed);
+}
+
+void ReplayClock::sleepUntil(uint64_t time) const
+{
+
+    uint64_t current = now();
+
+    if (time <= current) {
+        return;
+    }
+
+    uint64_t ns = (uint64_t) ((time - current) / speed);
+
+    struct timespec ts;
+    ts.tv_sec = (time_t) (ns / 1000000000ULL);
+    ts.tv_nsec = (long) (ns % 1000000000ULL);
+
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+
+}
+
+void ReplayClock::skipTo(uint64_t time)
+{
+
+    if (time <= now()) {
+        return;
+    }
+
+    origin = Stats::now() - (uint64_t) (time / speed);
+
+}
+
+template <typename T>
+void ReplayRandR::Timeline<T>::add(uint64_t time, const T &value)
+{
+    entries.push_back(std::make_pair(time, value));
+}
+
+template <typename T>
+const T *ReplayRandR::Timeline<T>::at(uint64_t time) const
+{
+
+    if (entries.empty()) {
+        return NULL;
+    }
+
+    /* The latest reply by then, or the first one if the replay asks earlier */
+    auto it = std::upper_bound(entries.begin(), entries.end(), time,
+                               [](uint64_t t, const std::pair<uint64_t, T> &entry) { return t < entry.first; });
+
+    return it == entries.begin() ? &entries.front().second : &(it - 1)->second;
+
+}
+
+ReplayRandR::ReplayRandR(const vector<SessionRecord> &records, int display, ReplayClock *clock) : clock(clock)
+{
+    memset(&state.size, 0, sizeof(state.size));
+    memset(&recorded.size, 0, sizeof(recorded.size));
+
+    load(records, display);
+}
+
+void ReplayRandR::load(const vector<SessionRecord> &records, int display)
+{
+
+    bool sizeSeen = false;
+    bool primarySeen = false;
+
+    for (const SessionRecord &record : records) {
+
+        if (record.display != display) {
+            continue;
+        }
+
+        SessionDecoder decoder(record.payload);
+        Change change;
+
+        change.time = record.time;
+
+        switch (record.type) {
+
+            case SessionRecord::RESOURCES: {
+                ScreenResources reply;
+                decoder.getResources(&reply);
+                if (decoder.ok()) {
+                    resources.add(record.time, reply);
+                }
+                break;
+            }
+
+            case SessionRecord::OUTPUT_INFOS: {
+                uint32_t count = decoder.getU32();
+                for (uint32_t i = 0; i < count && decoder.ok(); i++) {
+                    OutputInfo info;
+                    decoder.getOutputInfo(&info);
+                    if (decoder.ok() && info.output != None) {
+                        outputs[info.output].add(record.time, info);
+                    }
+                }
+                break;
+            }
+
+            case SessionRecord::EDIDS: {
+                vector<XID> ids;
+                decoder.getIds(&ids);
+                for (XID id : ids) {
+                    std::string edid = decoder.getString();
+                    if (decoder.ok()) {
+                        edids[id].add(record.time, edid);
+                    }
+                }
+                break;
+            }
+
+            case SessionRecord::CRTC_INFOS: {
+                uint32_t count = decoder.getU32();
+                change.kind = Change::CRTC;
+                for (uint32_t i = 0; i < count && decoder.ok(); i++) {
+                    decoder.getCrtcInfo(&change.crtc);
+                    if (decoder.ok() && change.crtc.crtc != None) {
+                        observe(record.time, change, state.crtcs.count(change.crtc.crtc) == 0);
+                    }
+                }
+                break;
+            }
+
+            case SessionRecord::TRANSFORMS: {
+                vector<XID> ids;
+                decoder.getIds(&ids);
+                change.kind = Change::TRANSFORM;
+                for (XID id : ids) {
+                    change.crtc.crtc = id;
+                    decoder.getTransform(&change.transform);
+                    if (decoder.ok()) {
+                        observe(record.time, change, state.transforms.count(id) == 0);
+                    }
+                }
+                break;
+            }
+
+            case SessionRecord::PANNINGS: {
+                vector<XID> ids;
+                decoder.getIds(&ids);
+                change.kind = Change::PANNING;
+                for (XID id : ids) {
+                    change.crtc.crtc = id;
+                    decoder.getPanning(&change.panning);
+                    if (decoder.ok()) {
+                        observe(record.time, change, state.pannings.count(id) == 0);
+                    }
+                }
+                break;
+            }
+
+            case SessionRecord::SCREEN_SIZE:
+                change.kind = Change::SCREEN_SIZE;
+                decoder.getScreenSize(&change.size);
+                if (decoder.ok()) {
+                    observe(record.time, change, !sizeSeen);
+                    sizeSeen = true;
+                }
+                break;
+
+            case SessionRecord::PRIMARY:
+                change.kind = Change::PRIMARY;
+                change.primary = (RROutput) decoder.getU32();
+                if (decoder.ok()) {
+                    observe(record.time, change, !primarySeen);
+                    primarySeen = true;
+                }
+                break;
+
+            case SessionRecord::WAIT_EVENT:
+                decoder.getI32();
+                if (decoder.getU8() && decoder.ok()) {
+                    notifications.push_back(record.time);
+                }
+                break;
+
+            /* The recorded daemon's own requests, its later replies are expected to show them */
+
+            case SessionRecord::SET_CRTC: {
+                CrtcInfo info;
+                decoder.getCrtcInfo(&info);
+                if (decoder.getU8() && decoder.ok()) {
+                    recorded.crtcs[info.crtc] = info;
+                    auto pending = recorded.pendingTransforms.find(info.crtc);
+                    if (pending != recorded.pendingTransforms.end()) {
+                        recorded.transforms[info.crtc] = pending->second;
+                        recorded.pendingTransforms.erase(pending);
+                    }
+                }
+                break;
+            }
+
+            case SessionRecord::SET_SCREEN_SIZE:
+                decoder.getScreenSize(&recorded.size);
+                break;
+
+            case SessionRecord::SET_TRANSFORM: {
+                RRCrtc crtc = (RRCrtc) decoder.getU32();
+                decoder.getTransform(&recorded.pendingTransforms[crtc]);
+                break;
+            }
+
+            case SessionRecord::SET_PANNING: {
+                RRCrtc crtc = (RRCrtc) decoder.getU32();
+                Panning panning;
+                decoder.getPanning(&panning);
+                if (decoder.getU8() && decoder.ok()) {
+                    recorded.pannings[crtc] = panning;
+                }
+                break;
+            }
+
+            case SessionRecord::SET_PRIMARY:
+                recorded.primary = (RROutput) decoder.getU32();
+                break;
+
+            default:
+                break;
+
+        }
+
+    }
+
+}
+
+void ReplayRandR::observe(uint64_t time, const ReplayRandR::Change &change, bool first)
+{
+
+    /* The replay starts from what the recording saw first */
+    if (first) {
+        apply(&state, change);
+        apply(&recorded, change);
+        return;
+    }
+
+    bool same = false;
+
+    switch (change.kind) {
+        case Change::CRTC:
+            same = recorded.crtcs.count(change.crtc.crtc) > 0 &&
+                   sameCrtc(recorded.crtcs[change.crtc.crtc], change.crtc);
+            break;
+        case Change::TRANSFORM:
+            same = recorded.transforms.count(change.crtc.crtc) > 0 &&
+                   recorded.transforms[change.crtc.crtc] == change.transform;
+            break;
+        case Change::PANNING:
+            same = recorded.pannings.count(change.crtc.crtc) > 0 &&
+                   recorded.pannings[change.crtc.crtc] == change.panning;
+            break;
+        case Change::SCREEN_SIZE:
+            same = sameSize(recorded.size, change.size);
+            break;
+        case Change::PRIMARY:
+            same = recorded.primary == change.primary;
+            break;
+    }
+
+    if (same) {
+        return;
+    }
+
+    apply(&recorded, change);
+
+    changes.push_back(change);
+    changes.back().time = time;
+
+}
+
+void ReplayRandR::apply(ReplayRandR::State *state, const ReplayRandR::Change &change)
+{
+
+    switch (change.kind) {
+        case Change::CRTC:
+            state->crtcs[change.crtc.crtc] = change.crtc;
+            break;
+        case Change::TRANSFORM:
+            state->transforms[change.crtc.crtc] = change.transform;
+            break;
+        case Change::PANNING:
+            state->pannings[change.crtc.crtc] = change.panning;
+            break;
+        case Change::SCREEN_SIZE:
+            state->size = change.size;
+            break;
+        case Change::PRIMARY:
+            state->primary = change.primary;
+            break;
+    }
+
+}
+
+void ReplayRandR::catchUp()
+{
+
+    uint64_t now = clock->now();
+
+    while (nextChange < changes.size() && changes[nextChange].time <= now) {
+        apply(&state, changes[nextChange++]);
+    }
+
+}
+
+std::string ReplayRandR::describe(const ReplayRandR::State &state)
+{
+
+    char line[512];
+    std::string text;
+
+    const ScreenResources *latest = resources.entries.empty() ? NULL : &resources.entries.back().second;
+
+    auto outputName = [this](RROutput output) -> std::string {
+        auto it = outputs.find(output);
+        if (it == outputs.end() || it->second.entries.empty()) {
+            return std::to_string(output);
+        }
+        return it->second.entries.back().second.name;
+    };
+
+    snprintf(line, sizeof(line), "screen %dx%d (%dx%d mm), primary %s\n",
+             state.size.width, state.size.height, state.size.mm_width, state.size.mm_height,
+             state.primary != None ? outputName(state.primary).c_str() : "none");
+    text += line;
+
+    for (const auto &entry : state.crtcs) {
+
+        const CrtcInfo &crtc = entry.second;
+
+        if (crtc.mode == None) {
+            snprintf(line, sizeof(line), "CRTC %lu: off\n", crtc.crtc);
+            text += line;
+            continue;
+        }
+
+        std::string mode = std::to_string(crtc.mode);
+
+        if (latest) {
+            for (const ModeInfo &info : latest->modes) {
+                if (info.id == crtc.mode) {
+                    mode = info.name;
+                }
+            }
+        }
+
+        std::string names;
+
+        for (RROutput output : crtc.outputs) {
+            names += (names.empty() ? "" : ",") + outputName(output);
+        }
+
+        snprintf(line, sizeof(line), "CRTC %lu: %s+%d+%d rotation %d on %s", crtc.crtc, mode.c_str(),
+                 crtc.x, crtc.y, (int) crtc.rotation, names.c_str());
+        text += line;
+
+        auto transform = state.transforms.find(crtc.crtc);
+
+        if (transform != state.transforms.end()) {
+
+            CrtcTransform identity;
+            identity.reset();
+
+            if (!(transform->second == identity)) {
+                const XTransform &matrix = transform->second.matrix;
+                snprintf(line, sizeof(line), ", transform %g,%g,%g,%g,%g,%g,%g,%g,%g",
+                         XFixedToDouble(matrix.matrix[0][0]), XFixedToDouble(matrix.matrix[0][1]),
+                         XFixedToDouble(matrix.matrix[0][2]), XFixedToDouble(matrix.matrix[1][0]),
+                         XFixedToDouble(matrix.matrix[1][1]), XFixedToDouble(matrix.matrix[1][2]),
+                         XFixedToDouble(matrix.matrix[2][0]), XFixedToDouble(matrix.matrix[2][1]),
+                         XFixedToDouble(matrix.matrix[2][2]));
+                text += line;
+            }
+
+        }
+
+        auto panning = state.pannings.find(crtc.crtc);
+
+        if (panning != state.pannings.end() && panning->second.width > 0) {
+            snprintf(line, sizeof(line), ", panning %dx%d+%d+%d", panning->second.width, panning->second.height,
+                     panning->second.left, panning->second.top);
+            text += line;
+        }
+
+        text += "\n";
+
+    }
+
+    return text;
+
+}
+
+std::string ReplayRandR::describeState()
+{
+
+    /* The replay is over, whatever else the recording saw has happened by now */
+    while (nextChange < changes.size()) {
+        apply(&state, changes[nextChange++]);
+    }
+
+    return describe(state);
+
+}
+
+std::string ReplayRandR::describeRecordedState()
+{
+    return describe(recorded);
+}
+
+bool ReplayRandR::connect()
+{
+    roundTrips++;
+    return true;
+}
+
+void ReplayRandR::disconnect()
+{
+}
+
+bool ReplayRandR::getScreenResources(ScreenResources *resources)
+{
+
+    roundTrips++;
+
+    const ScreenResources *reply = this->resources.at(clock->now());
+
+    if (!reply) {
+        return false;
+    }
+
+    *resources = *reply;
+
+    return true;
+
+}
+
+void ReplayRandR::getOutputInfos(const vector<RROutput> &ids, vector<OutputInfo> *infos)
+{
+
+    roundTrips++;
+    catchUp();
+
+    uint64_t now = clock->now();
+
+    infos->resize(ids.size());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        OutputInfo &info = (*infos)[i];
+        auto it = outputs.find(ids[i]);
+        const OutputInfo *reply = it != outputs.end() ? it->second.at(now) : NULL;
+
+        if (!reply) {
+            info.output = None;
+            continue;
+        }
+
+        info = *reply;
+
+        /* Which CRTC drives it is up to the replay's own requests */
+        info.crtc = None;
+
+        for (const auto &crtc : state.crtcs) {
+            if (std::find(crtc.second.outputs.begin(), crtc.second.outputs.end(), ids[i]) != crtc.second.outputs.end()) {
+                info.crtc = crtc.first;
+            }
+        }
+
+    }
+
+}
+
+void ReplayRandR::getCrtcInfos(const vector<RRCrtc> &ids, vector<CrtcInfo> *infos)
+{
+
+    roundTrips++;
+    catchUp();
+
+    infos->resize(ids.size());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        auto it = state.crtcs.find(ids[i]);
+
+        if (it == state.crtcs.end()) {
+            (*infos)[i].crtc = None;
+            continue;
+        }
+
+        (*infos)[i] = it->second;
+
+    }
+
+}
+
+void ReplayRandR::getScreenSize(ScreenSize *size)
+{
+    catchUp();
+    *size = state.size;
+}
+
+void ReplayRandR::getOutputEdids(const vector<RROutput> &ids, vector<std::string> *edids)
+{
+
+    roundTrips++;
+
+    uint64_t now = clock->now();
+
+    edids->assign(ids.size(), std::string());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        auto it = this->edids.find(ids[i]);
+        const std::string *reply = it != this->edids.end() ? it->second.at(now) : NULL;
+
+        if (reply) {
+            (*edids)[i] = *reply;
+        }
+
+    }
+
+}
+
+void ReplayRandR::getCrtcTransforms(const vector<RRCrtc> &ids, vector<CrtcTransform> *transforms)
+{
+
+    roundTrips++;
+    catchUp();
+
+    transforms->resize(ids.size());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        auto it = state.transforms.find(ids[i]);
+
+        if (it == state.transforms.end()) {
+            (*transforms)[i].reset();
+        } else {
+            (*transforms)[i] = it->second;
+        }
+
+    }
+
+}
+
+void ReplayRandR::getPannings(const vector<RRCrtc> &ids, vector<Panning> *pannings)
+{
+
+    roundTrips++;
+    catchUp();
+
+    pannings->resize(ids.size());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        auto it = state.pannings.find(ids[i]);
+
+        if (it == state.pannings.end()) {
+            memset(&(*pannings)[i], 0, sizeof(Panning));
+        } else {
+            (*pannings)[i] = it->second;
+        }
+
+    }
+
+}
+
+RROutput ReplayRandR::getPrimaryOutput()
+{
+    roundTrips++;
+    catchUp();
+
+    return state.primary;
+}
+
+bool ReplayRandR::waitForEvent(int timeoutMs)
+{
+
+    uint64_t now = clock->now();
+    bool arrived = false;
+
+    /* Everything that arrived in the meantime is one wake up */
+    while (nextNotification < notifications.size() && notifications[nextNotification] <= now) {
+        nextNotification++;
+        arrived = true;
+    }
+
+    if (arrived || timeoutMs <= 0) {
+        return arrived;
+    }
+
+    /* The caller's timeout is wall time, so it covers more of the recording when sped up */
+    uint64_t deadline = now + (uint64_t) (timeoutMs * 1000000.0 * clock->getSpeed());
+
+    if (nextNotification < notifications.size() && notifications[nextNotification] <= deadline) {
+        clock->sleepUntil(notifications[nextNotification++]);
+        return true;
+    }
+
+    clock->sleepUntil(deadline);
+
+    return false;
+
+}
+
+void ReplayRandR::grab()
+{
+}
+
+void ReplayRandR::ungrab()
+{
+}
+
+void ReplayRandR::sync()
+{
+    roundTrips++;
+}
+
+bool ReplayRandR::setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                                const RROutput *outputs, int noutputs)
+{
+
+    roundTrips++;
+    catchUp();
+
+    auto it = state.crtcs.find(crtc);
+
+    if (it == state.crtcs.end()) {
+        return false;
+    }
+
+    it->second.x = x;
+    it->second.y = y;
+    it->second.mode = mode;
+    it->second.rotation = rotation;
+    it->second.outputs.assign(outputs, outputs + noutputs);
+
+    auto pending = state.pendingTransforms.find(crtc);
+
+    if (pending != state.pendingTransforms.end()) {
+        state.transforms[crtc] = pending->second;
+        state.pendingTransforms.erase(pending);
+    }
+
+    return true;
+
+}
+
+void ReplayRandR::setScreenSize(int width, int height, int mm_width, int mm_height)
+{
+    catchUp();
+
+    state.size.width = width;
+    state.size.height = height;
+    state.size.mm_width = mm_width;
+    state.size.mm_height = mm_height;
+}
+
+void ReplayRandR::setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform)
+{
+    state.pendingTransforms[crtc] = transform;
+}
+
+bool ReplayRandR::setPanning(RRCrtc crtc, const Panning &panning)
+{
+    roundTrips++;
+    catchUp();
+
+    state.pannings[crtc] = panning;
+
+    return true;
+}
+
+void ReplayRandR::setPrimaryOutput(RROutput output)
+{
+    catchUp();
+
+    state.primary = output;
+}
@@ -0,0 +1,140 @@
+#ifndef REPLAYRANDR_H
+#define REPLAYRANDR_H
+
+#include "randr.h"
+#include "session.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+
+/*
+ * The time of a replay, in nanoseconds of the recording.
+ * It runs speed times faster than the wall clock and
+ * can jump ahead over the time nothing happened.
+ */
+class ReplayClock {
+
+private:
+
+    double speed;
+    std::atomic<uint64_t> origin;
+
+public:
+
+    ReplayClock(double speed);
+
+    uint64_t now() const;
+    double getSpeed() const { return speed; }
+
+    void sleepUntil(uint64_t time) const;
+    void skipTo(uint64_t time);
+
+};
+
+/*
+ * A RandR server rebuilt from a recorded session. Replies
+ * are served as the recording saw them at the same point
+ * of the replay clock: outputs connect, EDIDs show up and
+ * notifications arrive when they did. The CRTCs, screen,
+ * transforms, panning and primary output follow the
+ * requests of the replay instead, plus the changes the
+ * recording saw that its own requests don't explain,
+ * which were made by other X clients.
+ */
+class ReplayRandR : public RandR {
+
+private:
+
+    /* What one recorded reply said, from when it was received */
+    template <typename T>
+    class Timeline {
+    public:
+        vector<std::pair<uint64_t, T>> entries;
+
+        void add(uint64_t time, const T &value);
+        const T *at(uint64_t time) const;
+    };
+
+    /* The part of the server state requests change */
+    class State {
+    public:
+        std::map<RRCrtc, CrtcInfo> crtcs;
+        std::map<RRCrtc, CrtcTransform> transforms;
+        std::map<RRCrtc, CrtcTransform> pendingTransforms;
+        std::map<RRCrtc, Panning> pannings;
+        ScreenSize size;
+        RROutput primary = None;
+    };
+
+    /* A change of the state made by another client */
+    class Change {
+    public:
+        enum Kind { CRTC, TRANSFORM, PANNING, SCREEN_SIZE, PRIMARY };
+
+        uint64_t time;
+        Kind kind;
+        CrtcInfo crtc;
+        CrtcTransform transform;
+        Panning panning;
+        ScreenSize size;
+        RROutput primary;
+    };
+
+    ReplayClock *clock;
+
+    Timeline<ScreenResources> resources;
+    std::unordered_map<RROutput, Timeline<OutputInfo>> outputs;
+    std::unordered_map<RROutput, Timeline<std::string>> edids;
+    vector<uint64_t> notifications;
+    size_t nextNotification = 0;
+
+    State state;
+    State recorded;
+    vector<Change> changes;
+    size_t nextChange = 0;
+
+    void load(const vector<SessionRecord> &records, int display);
+    void observe(uint64_t time, const Change &change, bool first);
+    void apply(State *state, const Change &change);
+    void catchUp();
+
+    std::string describe(const State &state);
+
+public:
+
+    ReplayRandR(const vector<SessionRecord> &records, int display, ReplayClock *clock);
+
+    /* The CRTCs and screen after the replay, and as the recording left them */
+    std::string describeState();
+    std::string describeRecordedState();
+
+    bool connect();
+    void disconnect();
+
+    bool getScreenResources(ScreenResources *resources);
+    void getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos);
+    void getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos);
+    void getScreenSize(ScreenSize *size);
+    void getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids);
+    void getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms);
+    void getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings);
+    RROutput getPrimaryOutput();
+
+    bool waitForEvent(int timeoutMs);
+
+    void grab();
+    void ungrab();
+    void sync();
+
+    bool setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                       const RROutput *outputs, int noutputs);
+    void setScreenSize(int width, int height, int mm_width, int mm_height);
+    void setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform);
+    bool setPanning(RRCrtc crtc, const Panning &panning);
+    void setPrimaryOutput(RROutput output);
+
+};
+
+#endif // REPLAYRANDR_H
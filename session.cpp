@@ -0,0 +1,564 @@
+#include "session.h"
+#include "crtc.h"
+#include "stats.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* A record header: payload size, type, display, two reserved bytes and the time */
+#define SESSION_HEADER_SIZE 16
+
+/* Profiles are small INI files, anything bigger is not one */
+#define SESSION_MAX_PROFILE_SIZE (1024 * 1024)
+
+int Session::fd = -1;
+uint64_t Session::started = 0;
+pthread_mutex_t Session::lock = PTHREAD_MUTEX_INITIALIZER;
+
+void SessionEncoder::putU8(uint8_t value)
+{
+    data.push_back((char) value);
+}
+
+void SessionEncoder::putU32(uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        data.push_back((char) (value >> (8 * i)));
+    }
+}
+
+void SessionEncoder::putI32(int32_t value)
+{
+    putU32((uint32_t) value);
+}
+
+void SessionEncoder::putU64(uint64_t value)
+{
+    putU32((uint32_t) value);
+    putU32((uint32_t) (value >> 32));
+}
+
+void SessionEncoder::putString(const std::string &value)
+{
+    putU32((uint32_t) value.size());
+    data.append(value);
+}
+
+void SessionEncoder::putIds(const vector<XID> &ids)
+{
+    putU32((uint32_t) ids.size());
+
+    /* X resource ids are 29 bits */
+    for (XID id : ids) {
+        putU32((uint32_t) id);
+    }
+}
+
+void SessionEncoder::putResources(const ScreenResources &resources)
+{
+    putU32((uint32_t) resources.configTimestamp);
+    putIds(resources.crtcs);
+    putIds(resources.outputs);
+    putU32((uint32_t) resources.modes.size());
+
+    for (const ModeInfo &mode : resources.modes) {
+        putU32((uint32_t) mode.id);
+        putString(mode.name);
+        putU32(mode.width);
+        putU32(mode.height);
+        putU64(mode.dotClock);
+        putU32(mode.hSyncStart);
+        putU32(mode.hSyncEnd);
+        putU32(mode.hTotal);
+        putU32(mode.hSkew);
+        putU32(mode.vSyncStart);
+        putU32(mode.vSyncEnd);
+        putU32(mode.vTotal);
+        putU32((uint32_t) mode.modeFlags);
+    }
+}
+
+void SessionEncoder::putOutputInfo(const OutputInfo &info)
+{
+    putU32((uint32_t) info.output);
+    putString(info.name);
+    putU32((uint32_t) info.connection);
+    putU32((uint32_t) info.crtc);
+    putIds(info.modes);
+    putI32(info.npreferred);
+}
+
+void SessionEncoder::putCrtcInfo(const CrtcInfo &info)
+{
+    putU32((uint32_t) info.crtc);
+    putI32(info.x);
+    putI32(info.y);
+    putU32((uint32_t) info.mode);
+    putU32((uint32_t) info.rotation);
+    putIds(info.outputs);
+}
+
+void SessionEncoder::putScreenSize(const ScreenSize &size)
+{
+    putI32(size.width);
+    putI32(size.height);
+    putI32(size.mm_width);
+    putI32(size.mm_height);
+}
+
+void SessionEncoder::putTransform(const CrtcTransform &transform)
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            putI32(transform.matrix.matrix[i][j]);
+        }
+    }
+
+    putString(transform.filter);
+    putU32((uint32_t) transform.params.size());
+
+    for (XFixed param : transform.params) {
+        putI32(param);
+    }
+}
+
+void SessionEncoder::putPanning(const Panning &panning)
+{
+    int32_t fields[12] = {
+        panning.left, panning.top, panning.width, panning.height,
+        panning.trackLeft, panning.trackTop, panning.trackWidth, panning.trackHeight,
+        panning.borderLeft, panning.borderTop, panning.borderRight, panning.borderBottom
+    };
+
+    for (int32_t field : fields) {
+        putI32(field);
+    }
+}
+
+SessionDecoder::SessionDecoder(const std::string &data) : data(data)
+{
+
+}
+
+bool SessionDecoder::take(size_t size)
+{
+    if (failed || data.size() - offset < size) {
+        failed = true;
+        return false;
+    }
+
+    offset += size;
+
+    return true;
+}
+
+uint8_t SessionDecoder::getU8()
+{
+    if (!take(1)) {
+        return 0;
+    }
+
+    return (uint8_t) data[offset - 1];
+}
+
+uint32_t SessionDecoder::getU32()
+{
+    if (!take(4)) {
+        return 0;
+    }
+
+    uint32_t value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t) (uint8_t) data[offset - 4 + i] << (8 * i);
+    }
+
+    return value;
+}
+
+int32_t SessionDecoder::getI32()
+{
+    return (int32_t) getU32();
+}
+
+uint64_t SessionDecoder::getU64()
+{
+    uint64_t low = getU32();
+    uint64_t high = getU32();
+
+    return low | (high << 32);
+}
+
+std::string SessionDecoder::getString()
+{
+    uint32_t size = getU32();
+
+    if (!take(size)) {
+        return std::string();
+    }
+
+    return data.substr(offset - size, size);
+}
+
+void SessionDecoder::getIds(vector<XID> *ids)
+{
+    uint32_t count = getU32();
+
+    ids->clear();
+
+    /* Every id takes four bytes, don't trust the count further than that */
+    for (uint32_t i = 0; i < count && ok(); i++) {
+        ids->push_back((XID) getU32());
+    }
+}
+
+void SessionDecoder::getResources(ScreenResources *resources)
+{
+    resources->configTimestamp = (Time) getU32();
+    getIds(&resources->crtcs);
+    getIds(&resources->outputs);
+
+    uint32_t count = getU32();
+
+    resources->modes.clear();
+
+    for (uint32_t i = 0; i < count && ok(); i++) {
+
+        ModeInfo mode;
+
+        mode.id = (RRMode) getU32();
+        mode.name = getString();
+        mode.width = getU32();
+        mode.height = getU32();
+        mode.dotClock = (unsigned long) getU64();
+        mode.hSyncStart = getU32();
+        mode.hSyncEnd = getU32();
+        mode.hTotal = getU32();
+        mode.hSkew = getU32();
+        mode.vSyncStart = getU32();
+        mode.vSyncEnd = getU32();
+        mode.vTotal = getU32();
+        mode.modeFlags = (XRRModeFlags) getU32();
+
+        resources->modes.push_back(mode);
+
+    }
+}
+
+void SessionDecoder::getOutputInfo(OutputInfo *info)
+{
+    info->output = (RROutput) getU32();
+    info->name = getString();
+    info->connection = (Connection) getU32();
+    info->crtc = (RRCrtc) getU32();
+    getIds(&info->modes);
+    info->npreferred = getI32();
+}
+
+void SessionDecoder::getCrtcInfo(CrtcInfo *info)
+{
+    info->crtc = (RRCrtc) getU32();
+    info->x = getI32();
+    info->y = getI32();
+    info->mode = (RRMode) getU32();
+    info->rotation = (Rotation) getU32();
+    getIds(&info->outputs);
+}
+
+void SessionDecoder::getScreenSize(ScreenSize *size)
+{
+    size->width = getI32();
+    size->height = getI32();
+    size->mm_width = getI32();
+    size->mm_height = getI32();
+}
+
+void SessionDecoder::getTransform(CrtcTransform *transform)
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            transform->matrix.matrix[i][j] = getI32();
+        }
+    }
+
+    transform->filter = getString();
+
+    uint32_t count = getU32();
+
+    transform->params.clear();
+
+    for (uint32_t i = 0; i < count && ok(); i++) {
+        transform->params.push_back(getI32());
+    }
+}
+
+void SessionDecoder::getPanning(Panning *panning)
+{
+    int32_t fields[12];
+
+    for (int32_t &field : fields) {
+        field = getI32();
+    }
+
+    panning->left = fields[0];
+    panning->top = fields[1];
+    panning->width = fields[2];
+    panning->height = fields[3];
+    panning->trackLeft = fields[4];
+    panning->trackTop = fields[5];
+    panning->trackWidth = fields[6];
+    panning->trackHeight = fields[7];
+    panning->borderLeft = fields[8];
+    panning->borderTop = fields[9];
+    panning->borderRight = fields[10];
+    panning->borderBottom = fields[11];
+}
+
+bool Session::start(const char *path, int debounceMs)
+{
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "Can't record to %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    SessionEncoder header;
+
+    header.data.append(SESSION_MAGIC);
+    header.putU32(SESSION_VERSION);
+    header.putU32((uint32_t) debounceMs);
+
+    if (::write(fd, header.data.data(), header.data.size()) != (ssize_t) header.data.size()) {
+        syslog(LOG_ERR, "Can't record to %s: %s\n", path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    started = Stats::now();
+
+    syslog(LOG_INFO, "Recording the dock sessions to %s\n", path);
+
+    return true;
+
+}
+
+bool Session::isRecording()
+{
+    return fd >= 0;
+}
+
+void Session::write(SessionRecord::Type type, int display, const SessionEncoder &payload)
+{
+
+    if (fd < 0) {
+        return;
+    }
+
+    SessionEncoder record;
+
+    record.putU32((uint32_t) payload.data.size());
+    record.putU8((uint8_t) type);
+    record.putU8((uint8_t) display);
+    record.putU8(0);
+    record.putU8(0);
+    record.putU64(Stats::now() - started);
+    record.data.append(payload.data);
+
+    /* O_APPEND and one write per record keep records from different threads whole */
+    pthread_mutex_lock(&lock);
+
+    if (::write(fd, record.data.data(), record.data.size()) != (ssize_t) record.data.size()) {
+        syslog(LOG_ERR, "Recording stopped: %s\n", strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+}
+
+void Session::display(int index, const DisplayConfig &config)
+{
+
+    SessionEncoder payload;
+
+    payload.putString(config.name);
+    payload.putI32(config.screen);
+    payload.putString(config.directory);
+
+    write(SessionRecord::DISPLAY, index, payload);
+
+    profileFile(index, config.directory, CONFIG_NAME_DOCKED);
+    profileFile(index, config.directory, CONFIG_NAME_UNDOCKED);
+
+    std::string profiles = config.directory + "/" CONFIG_NAME_PROFILES;
+    DIR *directory = opendir(profiles.c_str());
+
+    if (directory == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+
+    while ((entry = readdir(directory)) != NULL) {
+
+        size_t length = strlen(entry->d_name);
+
+        /* Only the INIs, the binary copies are rebuilt from them */
+        if (length > 5 && strcmp(entry->d_name + length - 5, ".conf") == 0) {
+            profileFile(index, config.directory, std::string(CONFIG_NAME_PROFILES "/") + entry->d_name);
+        }
+
+    }
+
+    closedir(directory);
+
+}
+
+void Session::profileFile(int index, const std::string &directory, const std::string &name)
+{
+
+    std::string path = directory + "/" + name;
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (file < 0) {
+        return;
+    }
+
+    std::string contents;
+    char buffer[4096];
+    ssize_t length;
+
+    while ((length = read(file, buffer, sizeof(buffer))) > 0 && contents.size() < SESSION_MAX_PROFILE_SIZE) {
+        contents.append(buffer, (size_t) length);
+    }
+
+    close(file);
+
+    SessionEncoder payload;
+
+    payload.putString(name);
+    payload.putString(contents);
+
+    write(SessionRecord::PROFILE_FILE, index, payload);
+
+}
+
+void Session::acpiEvent(int event, bool sane, bool docked)
+{
+
+    if (fd < 0) {
+        return;
+    }
+
+    SessionEncoder payload;
+
+    payload.putU32((uint32_t) event);
+    payload.putU8(sane);
+    payload.putU8(docked);
+
+    write(SessionRecord::ACPI_EVENT, SESSION_NO_DISPLAY, payload);
+
+}
+
+void Session::hotplug(const std::string &devpath, bool docked)
+{
+
+    if (fd < 0) {
+        return;
+    }
+
+    SessionEncoder payload;
+
+    payload.putString(devpath);
+    payload.putU8(docked);
+
+    write(SessionRecord::HOTPLUG, SESSION_NO_DISPLAY, payload);
+
+}
+
+bool Session::load(const char *path, int *debounceMs, vector<SessionRecord> *records)
+{
+
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (file < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    std::string data;
+    char buffer[65536];
+    ssize_t length;
+
+    while ((length = read(file, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, (size_t) length);
+    }
+
+    close(file);
+
+    size_t magic = strlen(SESSION_MAGIC);
+
+    if (data.size() < magic + 8 || data.compare(0, magic, SESSION_MAGIC) != 0) {
+        fprintf(stderr, "%s is not a dockd recording\n", path);
+        return false;
+    }
+
+    std::string header = data.substr(magic, 8);
+    SessionDecoder decoder(header);
+
+    uint32_t version = decoder.getU32();
+    *debounceMs = (int) decoder.getU32();
+
+    if (version != SESSION_VERSION) {
+        fprintf(stderr, "%s was recorded by an incompatible dockd (version %u)\n", path, version);
+        return false;
+    }
+
+    records->clear();
+
+    size_t offset = magic + 8;
+
+    while (data.size() - offset >= SESSION_HEADER_SIZE) {
+
+        std::string recordHeader = data.substr(offset, SESSION_HEADER_SIZE);
+        SessionDecoder fields(recordHeader);
+
+        uint32_t size = fields.getU32();
+        SessionRecord record;
+
+        record.type = fields.getU8();
+        record.display = fields.getU8();
+        fields.getU8();
+        fields.getU8();
+        record.time = fields.getU64();
+
+        /* A daemon that died mid-write leaves a partial record at the end */
+        if (data.size() - offset - SESSION_HEADER_SIZE < size) {
+            fprintf(stderr, "%s ends with a truncated record, ignoring it\n", path);
+            break;
+        }
+
+        if (record.type >= SessionRecord::TYPE_COUNT) {
+            fprintf(stderr, "%s has an unknown record type %u\n", path, record.type);
+            return false;
+        }
+
+        record.payload = data.substr(offset + SESSION_HEADER_SIZE, size);
+        records->push_back(record);
+
+        offset += SESSION_HEADER_SIZE + size;
+
+    }
+
+    return true;
+
+}
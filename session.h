@@ -0,0 +1,147 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "displays.h"
+#include "randr.h"
+
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+
+#define SESSION_MAGIC "DOCKDREC"
+#define SESSION_VERSION 1
+
+/* The display of records that aren't about one display, like ACPI events */
+#define SESSION_NO_DISPLAY 0xff
+
+/*
+ * One entry of a recorded dock session: an event the
+ * daemon was given, or a RandR query, reply or request
+ * of one of its displays, stamped with the nanoseconds
+ * since the recording started
+ */
+class SessionRecord {
+
+public:
+
+    enum Type {
+        DISPLAY,
+        PROFILE_FILE,
+        ACPI_EVENT,
+        HOTPLUG,
+        CONNECT,
+        RESOURCES,
+        OUTPUT_INFOS,
+        CRTC_INFOS,
+        SCREEN_SIZE,
+        EDIDS,
+        TRANSFORMS,
+        PANNINGS,
+        PRIMARY,
+        WAIT_EVENT,
+        GRAB,
+        UNGRAB,
+        SYNC,
+        SET_CRTC,
+        SET_SCREEN_SIZE,
+        SET_TRANSFORM,
+        SET_PANNING,
+        SET_PRIMARY,
+        TYPE_COUNT
+    };
+
+    uint8_t type;
+    uint8_t display;
+    uint64_t time;
+    std::string payload;
+
+};
+
+/* Builds a record payload, every value little endian */
+class SessionEncoder {
+
+public:
+
+    std::string data;
+
+    void putU8(uint8_t value);
+    void putU32(uint32_t value);
+    void putI32(int32_t value);
+    void putU64(uint64_t value);
+    void putString(const std::string &value);
+    void putIds(const vector<XID> &ids);
+    void putResources(const ScreenResources &resources);
+    void putOutputInfo(const OutputInfo &info);
+    void putCrtcInfo(const CrtcInfo &info);
+    void putScreenSize(const ScreenSize &size);
+    void putTransform(const CrtcTransform &transform);
+    void putPanning(const Panning &panning);
+
+};
+
+/* Reads a payload back, a short or garbled one marks the decoder as failed */
+class SessionDecoder {
+
+private:
+
+    const std::string &data;
+    size_t offset = 0;
+    bool failed = false;
+
+    bool take(size_t size);
+
+public:
+
+    SessionDecoder(const std::string &data);
+
+    bool ok() const { return !failed; }
+
+    uint8_t getU8();
+    uint32_t getU32();
+    int32_t getI32();
+    uint64_t getU64();
+    std::string getString();
+    void getIds(vector<XID> *ids);
+    void getResources(ScreenResources *resources);
+    void getOutputInfo(OutputInfo *info);
+    void getCrtcInfo(CrtcInfo *info);
+    void getScreenSize(ScreenSize *size);
+    void getTransform(CrtcTransform *transform);
+    void getPanning(Panning *panning);
+
+};
+
+/*
+ * Records the dock sessions of a running daemon into
+ * a file, for dockd --replay. Every record is written
+ * with a single write() as it happens, so the file is
+ * complete up to the moment the daemon died. Besides
+ * the events and the RandR traffic, the profiles the
+ * displays start with are stored too, which makes the
+ * file enough to replay the session on any machine.
+ */
+class Session {
+
+public:
+
+    static bool start(const char *path, int debounceMs);
+    static bool isRecording();
+
+    static void display(int index, const DisplayConfig &config);
+    static void acpiEvent(int event, bool sane, bool docked);
+    static void hotplug(const std::string &devpath, bool docked);
+    static void write(SessionRecord::Type type, int display, const SessionEncoder &payload);
+
+    static bool load(const char *path, int *debounceMs, vector<SessionRecord> *records);
+
+private:
+
+    static int fd;
+    static uint64_t started;
+    static pthread_mutex_t lock;
+
+    static void profileFile(int index, const std::string &directory, const std::string &name);
+
+};
+
+#endif // SESSION_H
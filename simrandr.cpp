@@ -0,0 +1,541 @@
+#include "simrandr.h"
+#include "stats.h"
+
+#include <cstring>
+#include <ctime>
+
+/* About the size of a connection setup reply with a few screens and visuals */
+#define SIM_SETUP_SIZE 4096
+
+static void sleepNs(uint64_t ns)
+{
+    /* Even a zero nanosleep costs a timer slack */
+    if (ns == 0) {
+        return;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (time_t) (ns / 1000000000ULL);
+    ts.tv_nsec = (long) (ns % 1000000000ULL);
+
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+SimRandR::SimRandR()
+{
+    size.width = 0;
+    size.height = 0;
+    size.mm_width = 0;
+    size.mm_height = 0;
+    seen = size;
+}
+
+RRMode SimRandR::addMode(const char *name, unsigned int width, unsigned int height, unsigned long dotClock)
+{
+
+    ModeInfo mode;
+
+    mode.id = nextId++;
+    mode.name = name;
+    mode.width = width;
+    mode.height = height;
+    mode.dotClock = dotClock;
+    mode.hSyncStart = width + 48;
+    mode.hSyncEnd = width + 80;
+    mode.hTotal = width + 160;
+    mode.hSkew = 0;
+    mode.vSyncStart = height + 3;
+    mode.vSyncEnd = height + 8;
+    mode.vTotal = height + 30;
+    mode.modeFlags = 0;
+
+    modes.push_back(mode);
+    configTimestamp++;
+
+    return mode.id;
+
+}
+
+RROutput SimRandR::addOutput(const char *name, const vector<RRMode> &modes, long connectDelayMs)
+{
+
+    Output output;
+
+    output.id = nextId++;
+    output.name = name;
+    output.modes = modes;
+    output.connectDelayMs = connectDelayMs;
+    output.edid = std::string("EDID-") + name;
+
+    outputs.push_back(output);
+    configTimestamp++;
+
+    return output.id;
+
+}
+
+RRCrtc SimRandR::addCrtc()
+{
+
+    CrtcInfo crtc;
+
+    crtc.crtc = nextId++;
+    crtc.x = 0;
+    crtc.y = 0;
+    crtc.mode = None;
+    crtc.rotation = RR_Rotate_0;
+
+    CrtcExtras crtcExtras;
+
+    crtcExtras.transform.reset();
+    crtcExtras.pendingTransform.reset();
+    memset(&crtcExtras.panning, 0, sizeof(crtcExtras.panning));
+
+    crtcs.push_back(crtc);
+    extras.push_back(crtcExtras);
+    configTimestamp++;
+
+    return crtc.crtc;
+
+}
+
+void SimRandR::setEdid(RROutput id, const std::string &edid)
+{
+    for (Output &output : outputs) {
+        if (output.id == id) {
+            output.edid = edid;
+        }
+    }
+}
+
+void SimRandR::setLatency(long us)
+{
+    latencyUs = us;
+}
+
+void SimRandR::setPipelined(bool pipelined)
+{
+    this->pipelined = pipelined;
+}
+
+void SimRandR::refuseCrtc(RRCrtc crtc)
+{
+    refusedCrtc = crtc;
+}
+
+void SimRandR::blankCrtc(RRCrtc crtc)
+{
+    blankedCrtc = crtc;
+}
+
+void SimRandR::plug()
+{
+    pluggedAt = Stats::now();
+}
+
+void SimRandR::roundTrip()
+{
+    roundTrips++;
+
+    if (latencyUs > 0) {
+        sleepNs((uint64_t) latencyUs * 1000ULL);
+    }
+}
+
+bool SimRandR::isConnected(const SimRandR::Output &output, uint64_t now) const
+{
+    if (output.connectDelayMs < 0) {
+        return false;
+    }
+
+    return now >= pluggedAt + (uint64_t) output.connectDelayMs * 1000000ULL;
+}
+
+bool SimRandR::connect()
+{
+    roundTrip();
+    setup.assign(SIM_SETUP_SIZE, '\0');
+    seen = size;
+    return true;
+}
+
+void SimRandR::disconnect()
+{
+    std::string().swap(setup);
+}
+
+bool SimRandR::getScreenResources(ScreenResources *resources)
+{
+
+    roundTrip();
+
+    uint64_t now = Stats::now();
+
+    /* Modes appear on connect, so every connected output is a config change */
+    Time timestamp = configTimestamp;
+
+    for (const Output &output : outputs) {
+        if (isConnected(output, now)) {
+            timestamp++;
+        }
+    }
+
+    resources->configTimestamp = timestamp;
+    resources->crtcs.clear();
+    resources->outputs.clear();
+    resources->modes = modes;
+
+    for (const CrtcInfo &crtc : crtcs) {
+        resources->crtcs.push_back(crtc.crtc);
+    }
+
+    for (const Output &output : outputs) {
+        resources->outputs.push_back(output.id);
+    }
+
+    return true;
+
+}
+
+void SimRandR::getOutputInfos(const vector<RROutput> &ids, vector<OutputInfo> *infos)
+{
+
+    uint64_t now = Stats::now();
+
+    infos->resize(ids.size());
+
+    if (pipelined) {
+        roundTrip();
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        if (!pipelined) {
+            roundTrip();
+        }
+
+        OutputInfo &info = (*infos)[i];
+
+        info.output = None;
+
+        for (const Output &output : outputs) {
+
+            if (output.id != ids[i]) {
+                continue;
+            }
+
+            info.output = ids[i];
+            info.name = output.name;
+            info.connection = isConnected(output, now) ? RR_Connected : RR_Disconnected;
+            info.crtc = None;
+            info.npreferred = 1;
+
+            if (info.connection == RR_Connected) {
+                info.modes = output.modes;
+            } else {
+                info.modes.clear();
+            }
+
+            for (const CrtcInfo &crtc : crtcs) {
+                for (RROutput crtcOutput : crtc.outputs) {
+                    if (crtcOutput == ids[i]) {
+                        info.crtc = crtc.crtc;
+                    }
+                }
+            }
+
+        }
+
+    }
+
+}
+
+void SimRandR::getCrtcInfos(const vector<RRCrtc> &ids, vector<CrtcInfo> *infos)
+{
+
+    infos->resize(ids.size());
+
+    if (pipelined) {
+        roundTrip();
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        if (!pipelined) {
+            roundTrip();
+        }
+
+        (*infos)[i].crtc = None;
+
+        for (const CrtcInfo &crtc : crtcs) {
+            if (crtc.crtc == ids[i]) {
+                (*infos)[i] = crtc;
+            }
+        }
+
+    }
+
+}
+
+void SimRandR::getScreenSize(ScreenSize *size)
+{
+    *size = seen;
+}
+
+void SimRandR::getOutputEdids(const vector<RROutput> &ids, vector<std::string> *edids)
+{
+
+    uint64_t now = Stats::now();
+
+    edids->assign(ids.size(), std::string());
+
+    if (pipelined) {
+        roundTrip();
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        if (!pipelined) {
+            roundTrip();
+        }
+
+        for (const Output &output : outputs) {
+            if (output.id == ids[i] && isConnected(output, now)) {
+                (*edids)[i] = output.edid;
+            }
+        }
+
+    }
+
+}
+
+void SimRandR::getCrtcTransforms(const vector<RRCrtc> &ids, vector<CrtcTransform> *transforms)
+{
+
+    transforms->resize(ids.size());
+
+    if (pipelined) {
+        roundTrip();
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        if (!pipelined) {
+            roundTrip();
+        }
+
+        (*transforms)[i].reset();
+
+        for (size_t j = 0; j < crtcs.size(); j++) {
+            if (crtcs[j].crtc == ids[i]) {
+                (*transforms)[i] = extras[j].transform;
+            }
+        }
+
+    }
+
+}
+
+void SimRandR::getPannings(const vector<RRCrtc> &ids, vector<Panning> *pannings)
+{
+
+    pannings->resize(ids.size());
+
+    if (pipelined) {
+        roundTrip();
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+
+        if (!pipelined) {
+            roundTrip();
+        }
+
+        memset(&(*pannings)[i], 0, sizeof(Panning));
+
+        for (size_t j = 0; j < crtcs.size(); j++) {
+            if (crtcs[j].crtc == ids[i]) {
+                (*pannings)[i] = extras[j].panning;
+            }
+        }
+
+    }
+
+}
+
+RROutput SimRandR::getPrimaryOutput()
+{
+    roundTrip();
+    return primary;
+}
+
+bool SimRandR::waitForEvent(int timeoutMs)
+{
+
+    uint64_t now = Stats::now();
+    uint64_t deadline = now + (uint64_t) timeoutMs * 1000000ULL;
+    uint64_t next = 0;
+
+    /* The screen change notifications of earlier requests are queued by now */
+    seen = size;
+
+    /* The next output to connect is the next notification */
+    for (const Output &output : outputs) {
+
+        if (output.connectDelayMs < 0 || isConnected(output, now)) {
+            continue;
+        }
+
+        uint64_t at = pluggedAt + (uint64_t) output.connectDelayMs * 1000000ULL;
+
+        if (next == 0 || at < next) {
+            next = at;
+        }
+
+    }
+
+    if (next != 0 && next <= deadline) {
+        sleepNs(next - now);
+        return true;
+    }
+
+    sleepNs(deadline - now);
+
+    return false;
+
+}
+
+void SimRandR::grab()
+{
+}
+
+void SimRandR::ungrab()
+{
+}
+
+void SimRandR::sync()
+{
+    roundTrip();
+}
+
+bool SimRandR::setCrtcConfig(RRCrtc id, int x, int y, RRMode mode, Rotation rotation,
+                             const RROutput *outputs, int noutputs)
+{
+
+    roundTrip();
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        CrtcInfo &crtc = crtcs[i];
+
+        if (crtc.crtc != id) {
+            continue;
+        }
+
+        if (mode != None && id == refusedCrtc) {
+            return false;
+        }
+
+        if (mode != None && id == blankedCrtc) {
+            blankedCrtc = None;
+            x = 0;
+            y = 0;
+            mode = None;
+            noutputs = 0;
+        }
+
+        /* Like the server, refuse CRTCs that don't fit the current screen */
+        if (mode != None && !fits(x, y, mode, rotation, extras[i].pendingTransform, size.width, size.height)) {
+            rejected++;
+            return false;
+        }
+
+        /* The pending transform takes effect with the mode set */
+        extras[i].transform = extras[i].pendingTransform;
+
+        crtc.x = x;
+        crtc.y = y;
+        crtc.mode = mode;
+        crtc.rotation = rotation;
+        crtc.outputs.assign(outputs, outputs + noutputs);
+
+        return true;
+
+    }
+
+    return false;
+
+}
+
+void SimRandR::setScreenSize(int width, int height, int mm_width, int mm_height)
+{
+
+    /* A lit CRTC has to be disabled before the screen shrinks under it */
+    for (size_t i = 0; i < crtcs.size(); i++) {
+        const CrtcInfo &crtc = crtcs[i];
+        if (crtc.mode != None && !fits(crtc.x, crtc.y, crtc.mode, crtc.rotation, extras[i].transform, width, height)) {
+            rejected++;
+            return;
+        }
+    }
+
+    size.width = width;
+    size.height = height;
+    size.mm_width = mm_width;
+    size.mm_height = mm_height;
+}
+
+void SimRandR::setCrtcTransform(RRCrtc id, const CrtcTransform &transform)
+{
+    for (size_t i = 0; i < crtcs.size(); i++) {
+        if (crtcs[i].crtc == id) {
+            extras[i].pendingTransform = transform;
+        }
+    }
+}
+
+bool SimRandR::setPanning(RRCrtc id, const Panning &panning)
+{
+
+    roundTrip();
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+        if (crtcs[i].crtc == id) {
+            extras[i].panning = panning;
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+void SimRandR::setPrimaryOutput(RROutput output)
+{
+    primary = output;
+}
+
+bool SimRandR::fits(int x, int y, RRMode mode, Rotation rotation, const CrtcTransform &transform,
+                    int width, int height) const
+{
+
+    for (const ModeInfo &info : modes) {
+
+        if (info.id != mode) {
+            continue;
+        }
+
+        bool sideways = (rotation & (RR_Rotate_90 | RR_Rotate_270)) != 0;
+        int w, h;
+
+        transform.bounds((int) (sideways ? info.height : info.width), (int) (sideways ? info.width : info.height),
+                         &w, &h);
+
+        return x + w <= width && y + h <= height;
+
+    }
+
+    return false;
+
+}
@@ -0,0 +1,122 @@
+#ifndef SIMRANDR_H
+#define SIMRANDR_H
+
+#include "randr.h"
+
+#include <cstdint>
+
+/*
+ * An in-memory RandR server for benchmarks. It models
+ * CRTCs, outputs and modes, outputs that take a while
+ * to connect after plug(), a fixed latency for every
+ * request that waits for a reply, and the server's
+ * checks that CRTCs fit into the screen. Like Xlib,
+ * the client only learns the screen size from events.
+ */
+class SimRandR : public RandR {
+
+private:
+
+    class Output {
+    public:
+        RROutput id;
+        std::string name;
+        vector<RRMode> modes;
+        long connectDelayMs;
+        std::string edid;
+    };
+
+    /* What CrtcInfo doesn't carry, by the CRTC's index */
+    class CrtcExtras {
+    public:
+        CrtcTransform transform;
+        CrtcTransform pendingTransform;
+        Panning panning;
+    };
+
+    vector<ModeInfo> modes;
+    vector<Output> outputs;
+    vector<CrtcInfo> crtcs;
+    vector<CrtcExtras> extras;
+    ScreenSize size;
+    RROutput primary = None;
+
+    /* The size as Xlib's cache has it, updated by connecting and by processing events */
+    ScreenSize seen;
+
+    RRCrtc refusedCrtc = None;
+    RRCrtc blankedCrtc = None;
+
+    XID nextId = 0x40;
+    Time configTimestamp = 1;
+    uint64_t pluggedAt = 0;
+
+    /* Stands in for what XOpenDisplay allocates, so a reconnect shows up in the benchmark */
+    std::string setup;
+
+    long latencyUs = 0;
+    bool pipelined = false;
+    unsigned long rejected = 0;
+
+    void roundTrip();
+    bool fits(int x, int y, RRMode mode, Rotation rotation, const CrtcTransform &transform,
+              int width, int height) const;
+    bool isConnected(const Output &output, uint64_t now) const;
+
+public:
+
+    SimRandR();
+
+    RRMode addMode(const char *name, unsigned int width, unsigned int height, unsigned long dotClock);
+    RROutput addOutput(const char *name, const vector<RRMode> &modes, long connectDelayMs);
+    RRCrtc addCrtc();
+
+    /* Swaps the monitor on an output, outputs default to an EDID derived from the name */
+    void setEdid(RROutput output, const std::string &edid);
+
+    /* Every request that waits for a reply sleeps this long */
+    void setLatency(long us);
+
+    /* Batched queries cost one round trip, like the xcb backend */
+    void setPipelined(bool pipelined);
+
+    /* Simulates a dock event, delayed outputs connect relative to now */
+    void plug();
+
+    /* Refuses every mode set that lights the CRTC, like a driver out of bandwidth */
+    void refuseCrtc(RRCrtc crtc);
+
+    /* Accepts the next mode set that lights the CRTC, but leaves it dark */
+    void blankCrtc(RRCrtc crtc);
+
+    /* Requests the server refused because of their order, like BadMatch */
+    unsigned long getRejected() const { return rejected; }
+
+    bool connect();
+    void disconnect();
+
+    bool getScreenResources(ScreenResources *resources);
+    void getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos);
+    void getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos);
+    void getScreenSize(ScreenSize *size);
+    void getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids);
+    void getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms);
+    void getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings);
+    RROutput getPrimaryOutput();
+
+    bool waitForEvent(int timeoutMs);
+
+    void grab();
+    void ungrab();
+    void sync();
+
+    bool setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                       const RROutput *outputs, int noutputs);
+    void setScreenSize(int width, int height, int mm_width, int mm_height);
+    void setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform);
+    bool setPanning(RRCrtc crtc, const Panning &panning);
+    void setPrimaryOutput(RROutput output);
+
+};
+
+#endif // SIMRANDR_H
@@ -0,0 +1,119 @@
+#include "stats.h"
+
+#include <cstdio>
+#include <ctime>
+
+/* Upper bucket bounds in microseconds, the last bucket is +Inf */
+const uint64_t Stats::bounds[STATS_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000
+};
+
+std::atomic<uint64_t> Stats::buckets[PHASE_COUNT][STATS_BUCKETS + 1];
+std::atomic<uint64_t> Stats::sums[PHASE_COUNT];
+std::atomic<uint64_t> Stats::counters[COUNTER_COUNT];
+
+static const char *phaseNames[Stats::PHASE_COUNT] = {
+    "acpi_delivery",
+    "profile_lookup",
+    "output_resolution",
+    "set_crtc",
+    "set_screen",
+    "server_grab",
+    "blank",
+    "hook",
+    "apply"
+};
+
+static const char *counterNames[Stats::COUNTER_COUNT] = {
+    "dockd_events_total",
+    "dockd_drm_hotplugs_total",
+    "dockd_dropped_events_total",
+    "dockd_applies_total",
+    "dockd_apply_failures_total",
+    "dockd_output_retries_total",
+    "dockd_plan_cache_hits_total",
+    "dockd_resume_skips_total",
+    "dockd_rollbacks_total",
+    "dockd_profile_fallbacks_total",
+    "dockd_hook_failures_total",
+    "dockd_hook_timeouts_total"
+};
+
+uint64_t Stats::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void Stats::observe(Stats::Phase phase, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (bucket < STATS_BUCKETS && us > bounds[bucket]) {
+        bucket++;
+    }
+
+    buckets[phase][bucket].fetch_add(1, std::memory_order_relaxed);
+    sums[phase].fetch_add(us, std::memory_order_relaxed);
+}
+
+void Stats::observeSince(Stats::Phase phase, uint64_t start)
+{
+    observe(phase, now() - start);
+}
+
+void Stats::count(Stats::Counter counter, uint64_t n)
+{
+    counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+std::string Stats::format()
+{
+
+    std::string out;
+    char line[256];
+
+    out += "# HELP dockd_phase_duration_seconds Time spent in each phase of a dock event\n";
+    out += "# TYPE dockd_phase_duration_seconds histogram\n";
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+
+        /* Prometheus buckets are cumulative */
+        uint64_t cumulative = 0;
+
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+            cumulative += buckets[phase][bucket].load(std::memory_order_relaxed);
+            snprintf(line, sizeof(line), "dockd_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                     phaseNames[phase], bounds[bucket] / 1e6, (unsigned long long) cumulative);
+            out += line;
+        }
+
+        cumulative += buckets[phase][STATS_BUCKETS].load(std::memory_order_relaxed);
+
+        snprintf(line, sizeof(line), "dockd_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                 phaseNames[phase], (unsigned long long) cumulative);
+        out += line;
+
+        snprintf(line, sizeof(line), "dockd_phase_duration_seconds_sum{phase=\"%s\"} %g\n",
+                 phaseNames[phase], sums[phase].load(std::memory_order_relaxed) / 1e6);
+        out += line;
+
+        snprintf(line, sizeof(line), "dockd_phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+                 phaseNames[phase], (unsigned long long) cumulative);
+        out += line;
+
+    }
+
+    for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+        snprintf(line, sizeof(line), "# TYPE %s counter\n%s %llu\n", counterNames[counter], counterNames[counter],
+                 (unsigned long long) counters[counter].load(std::memory_order_relaxed));
+        out += line;
+    }
+
+    return out;
+
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#define STATS_BUCKETS 14
+
+/*
+ * Per-phase latency histograms and event counters,
+ * updated lock-free from any thread and rendered
+ * in the Prometheus text exposition format
+ */
+class Stats {
+
+public:
+
+    enum Phase {
+        ACPI_DELIVERY,
+        PROFILE_LOOKUP,
+        OUTPUT_RESOLUTION,
+        SET_CRTC,
+        SET_SCREEN,
+        SERVER_GRAB,
+        BLANK,
+        HOOK,
+        APPLY,
+        PHASE_COUNT
+    };
+
+    enum Counter {
+        EVENTS,
+        HOTPLUGS,
+        DROPPED_EVENTS,
+        APPLIES,
+        APPLY_FAILURES,
+        OUTPUT_RETRIES,
+        PLAN_HITS,
+        RESUME_SKIPS,
+        ROLLBACKS,
+        FALLBACKS,
+        HOOK_FAILURES,
+        HOOK_TIMEOUTS,
+        COUNTER_COUNT
+    };
+
+    /* Monotonic clock in nanoseconds */
+    static uint64_t now();
+
+    static void observe(Phase phase, uint64_t ns);
+    static void observeSince(Phase phase, uint64_t start);
+    static void count(Counter counter, uint64_t n = 1);
+
+    static std::string format();
+
+private:
+
+    static const uint64_t bounds[STATS_BUCKETS];
+
+    static std::atomic<uint64_t> buckets[PHASE_COUNT][STATS_BUCKETS + 1];
+    static std::atomic<uint64_t> sums[PHASE_COUNT];
+    static std::atomic<uint64_t> counters[COUNTER_COUNT];
+
+};
+
+#endif // STATS_H
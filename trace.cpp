@@ -0,0 +1,461 @@
+#include "trace.h"
+#include "stats.h"
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define TRACE_MASK (TRACE_RECORDS - 1)
+
+Trace::Slot Trace::ring[TRACE_RECORDS];
+std::atomic<uint64_t> Trace::head(0);
+std::atomic<uint64_t> Trace::logs(0);
+std::atomic<bool> Trace::running(false);
+std::atomic<bool> Trace::dumpRequested(false);
+uint64_t Trace::drainFrom = 0;
+uint64_t Trace::drainLogsFrom = 0;
+int Trace::wakeFd = -1;
+
+static const char *categoryNames[Trace::CATEGORY_COUNT] = {
+    "event",
+    "phase",
+    "x11",
+    "retry",
+    "hook",
+    "log"
+};
+
+static uint32_t threadId()
+{
+    static thread_local uint32_t id = 0;
+
+    if (id == 0) {
+        id = (uint32_t) syscall(SYS_gettid);
+    }
+
+    return id;
+}
+
+Trace::Record *Trace::claim(uint64_t *sequence)
+{
+
+    *sequence = head.fetch_add(1, std::memory_order_relaxed);
+
+    Slot &slot = ring[*sequence & TRACE_MASK];
+
+    /* Readers skip the slot until it's published again */
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return &slot.record;
+
+}
+
+void Trace::publish(uint64_t sequence)
+{
+    ring[sequence & TRACE_MASK].sequence.store(sequence + 1, std::memory_order_release);
+}
+
+bool Trace::read(uint64_t sequence, Trace::Record *record)
+{
+
+    Slot &slot = ring[sequence & TRACE_MASK];
+
+    if (slot.sequence.load(std::memory_order_acquire) != sequence + 1) {
+        return false;
+    }
+
+    memcpy(record, &slot.record, sizeof(*record));
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    /* A writer that lapped the ring while we copied tore the record */
+    return slot.sequence.load(std::memory_order_relaxed) == sequence + 1;
+
+}
+
+void Trace::instant(Trace::Category category, const char *name,
+                    const char *key0, int64_t value0, const char *key1, int64_t value1, const char *detail)
+{
+    span(category, name, Stats::now(), key0, value0, key1, value1, detail);
+}
+
+void Trace::span(Trace::Category category, const char *name, uint64_t start,
+                 const char *key0, int64_t value0, const char *key1, int64_t value1, const char *detail)
+{
+
+    uint64_t now = Stats::now();
+    uint64_t sequence;
+    Record *record = claim(&sequence);
+
+    record->start = start;
+    record->duration = now - start;
+    record->name = name;
+    record->keys[0] = key0;
+    record->keys[1] = key1;
+    record->values[0] = value0;
+    record->values[1] = value1;
+    record->thread = threadId();
+    record->category = (uint8_t) category;
+    record->priority = 0;
+
+    if (detail) {
+        snprintf(record->text, sizeof(record->text), "%s", detail);
+    } else {
+        record->text[0] = '\0';
+    }
+
+    publish(sequence);
+
+}
+
+void Trace::log(int priority, const char *format, ...)
+{
+
+    char text[TRACE_TEXT_SIZE];
+    va_list args;
+
+    va_start(args, format);
+
+    if (!running.load(std::memory_order_relaxed)) {
+        /* No formatter thread, e.g. the command line tools, log it right away */
+        va_list copy;
+        va_copy(copy, args);
+        vsyslog(priority, format, copy);
+        va_end(copy);
+    }
+
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    uint64_t sequence;
+    uint64_t index = logs.fetch_add(1, std::memory_order_relaxed);
+    Record *record = claim(&sequence);
+
+    record->start = Stats::now();
+    record->duration = 0;
+    record->name = "log";
+    record->keys[0] = NULL;
+    record->keys[1] = NULL;
+    /* Numbers the log messages, so the formatter can tell how many it missed */
+    record->values[0] = (int64_t) index;
+    record->values[1] = 0;
+    record->thread = threadId();
+    record->category = LOG;
+    record->priority = (uint8_t) priority;
+    memcpy(record->text, text, sizeof(text));
+
+    publish(sequence);
+
+    if (running.load(std::memory_order_relaxed)) {
+        wake();
+    }
+
+}
+
+void Trace::wake()
+{
+    uint64_t one = 1;
+
+    /* The eventfd is non-blocking, a full counter already means a pending wake up */
+    if (write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        return;
+    }
+}
+
+void Trace::onSignal(int signal)
+{
+    (void) signal;
+
+    int saved = errno;
+
+    dumpRequested = true;
+    wake();
+
+    errno = saved;
+}
+
+bool Trace::start()
+{
+
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (wakeFd < 0) {
+        syslog(LOG_ERR, "Failed to create the trace wake up: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* From here on log messages are only queued, the formatter picks them up */
+    running = true;
+
+    /* The formatter starts with the first record that was only queued */
+    drainFrom = head.load();
+    drainLogsFrom = logs.load();
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, &Trace::drain, NULL) != 0) {
+        running = false;
+        syslog(LOG_ERR, "Failed to start the trace formatter\n");
+        close(wakeFd);
+        wakeFd = -1;
+        return false;
+    }
+
+    pthread_detach(thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &Trace::onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGUSR1, &action, NULL) != 0) {
+        syslog(LOG_ERR, "Can't dump the trace on SIGUSR1: %s\n", strerror(errno));
+    }
+
+    return true;
+
+}
+
+void *Trace::drain(void *unused)
+{
+
+    (void) unused;
+
+    uint64_t tail = drainFrom;
+    uint64_t nextLog = drainLogsFrom;
+    uint64_t lost = 0;
+    bool waiting = false;
+    Record record;
+
+    for (;;) {
+
+        struct pollfd pfd;
+        pfd.fd = wakeFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, waiting ? TRACE_POLL_MS : -1) > 0) {
+            uint64_t count;
+            if (::read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN && errno != EINTR) {
+                syslog(LOG_ERR, "Trace formatter stopped: %s\n", strerror(errno));
+                return NULL;
+            }
+        }
+
+        waiting = false;
+
+        uint64_t end = head.load(std::memory_order_acquire);
+
+        for (; tail < end; tail++) {
+
+            if (end - tail > TRACE_RECORDS) {
+                tail = end - TRACE_RECORDS;
+            }
+
+            if (!read(tail, &record)) {
+
+                /* Overwritten by a newer record, or still being written */
+                if (head.load(std::memory_order_acquire) - tail > TRACE_RECORDS) {
+                    continue;
+                }
+
+                waiting = true;
+                break;
+
+            }
+
+            if (record.category != LOG || (uint64_t) record.values[0] < nextLog) {
+                continue;
+            }
+
+            lost += (uint64_t) record.values[0] - nextLog;
+            nextLog = (uint64_t) record.values[0] + 1;
+
+            syslog(record.priority, "%s", record.text);
+
+        }
+
+        if (lost > 0) {
+            syslog(LOG_WARNING, "Logging fell behind, %llu messages were overwritten\n",
+                   (unsigned long long) lost);
+            lost = 0;
+        }
+
+        if (dumpRequested.exchange(false)) {
+            dump();
+        }
+
+    }
+
+}
+
+std::string Trace::dumpPath()
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime && runtime[0] == '/') {
+        return std::string(runtime) + "/dockd-trace.json";
+    }
+
+    return "/tmp/dockd-trace-" + std::to_string(getuid()) + ".json";
+}
+
+bool Trace::dump()
+{
+
+    std::string path = dumpPath();
+    std::string temporary = path + ".tmp";
+    std::string json = format();
+
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "Can't write the trace to %s: %s\n", temporary.c_str(), strerror(errno));
+        return false;
+    }
+
+    const char *data = json.data();
+    size_t left = json.size();
+
+    while (left > 0) {
+
+        ssize_t written = write(fd, data, left);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            syslog(LOG_ERR, "Can't write the trace to %s: %s\n", temporary.c_str(), strerror(errno));
+            close(fd);
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        data += written;
+        left -= (size_t) written;
+
+    }
+
+    close(fd);
+
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        syslog(LOG_ERR, "Can't write the trace to %s: %s\n", path.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    syslog(LOG_INFO, "Trace written to %s\n", path.c_str());
+
+    return true;
+
+}
+
+static void appendEscaped(std::string *json, const char *text)
+{
+
+    for (const char *c = text; *c; c++) {
+
+        if (*c == '"' || *c == '\\') {
+            json->push_back('\\');
+            json->push_back(*c);
+        } else if ((unsigned char) *c < 0x20) {
+            /* Log lines end with a newline, the rest is never wanted either */
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", *c);
+            json->append(escape);
+        } else {
+            json->push_back(*c);
+        }
+
+    }
+
+}
+
+std::string Trace::format()
+{
+
+    /*
+     * Chrome's JSON trace format: spans are complete ("X")
+     * events, everything else is a thread scoped instant
+     */
+
+    char line[256];
+    std::string json;
+    Record record;
+
+    int pid = (int) getpid();
+
+    snprintf(line, sizeof(line), "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                                 "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"dockd\"}}",
+             pid);
+    json += line;
+
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t begin = end > TRACE_RECORDS ? end - TRACE_RECORDS : 0;
+
+    for (uint64_t sequence = begin; sequence < end; sequence++) {
+
+        if (!read(sequence, &record)) {
+            continue;
+        }
+
+        bool isSpan = record.category == PHASE || record.category == X_REQUEST || record.category == HOOK;
+
+        snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+                 record.name, categoryNames[record.category], isSpan ? "X" : "i", record.start / 1e3);
+        json += line;
+
+        if (isSpan) {
+            snprintf(line, sizeof(line), "\"dur\":%.3f,", record.duration / 1e3);
+        } else {
+            snprintf(line, sizeof(line), "\"s\":\"t\",");
+        }
+        json += line;
+
+        snprintf(line, sizeof(line), "\"pid\":%d,\"tid\":%u,\"args\":{", pid, record.thread);
+        json += line;
+
+        bool first = true;
+
+        for (int i = 0; i < 2; i++) {
+            if (record.keys[i]) {
+                snprintf(line, sizeof(line), "%s\"%s\":%lld", first ? "" : ",", record.keys[i],
+                         (long long) record.values[i]);
+                json += line;
+                first = false;
+            }
+        }
+
+        if (record.category == LOG) {
+            snprintf(line, sizeof(line), "%s\"priority\":%d", first ? "" : ",", record.priority);
+            json += line;
+            first = false;
+        }
+
+        if (record.text[0]) {
+            json += first ? "\"detail\":\"" : ",\"detail\":\"";
+            appendEscaped(&json, record.text);
+            json += "\"";
+        }
+
+        json += "}}";
+
+    }
+
+    json += "\n]}\n";
+
+    return json;
+
+}
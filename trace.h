@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/* Must be a power of two */
+#define TRACE_RECORDS 4096
+#define TRACE_TEXT_SIZE 192
+
+/* Wake up this often when a writer was caught mid-record */
+#define TRACE_POLL_MS 100
+
+/*
+ * A flight recorder of the last TRACE_RECORDS events,
+ * phases, X requests, retries, hooks and log messages.
+ * Writers claim a slot with one atomic increment and
+ * never block, the oldest records get overwritten. Log
+ * messages are passed on to syslog by a background
+ * thread once start() ran, synchronously before that.
+ * The ring is dumped as Chrome trace JSON on SIGUSR1
+ * and over the control socket, open it in Perfetto or
+ * chrome://tracing.
+ */
+class Trace {
+
+public:
+
+    enum Category {
+        EVENT,
+        PHASE,
+        X_REQUEST,
+        RETRY,
+        HOOK,
+        LOG,
+        CATEGORY_COUNT
+    };
+
+    /* Name and keys must be string literals, only the pointers are stored */
+    static void instant(Category category, const char *name,
+                        const char *key0 = NULL, int64_t value0 = 0,
+                        const char *key1 = NULL, int64_t value1 = 0,
+                        const char *detail = NULL);
+    static void span(Category category, const char *name, uint64_t start,
+                     const char *key0 = NULL, int64_t value0 = 0,
+                     const char *key1 = NULL, int64_t value1 = 0,
+                     const char *detail = NULL);
+    static void log(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    static bool start();
+
+    static std::string format();
+    static std::string dumpPath();
+
+private:
+
+    class Record {
+    public:
+        uint64_t start;
+        uint64_t duration;
+        const char *name;
+        const char *keys[2];
+        int64_t values[2];
+        uint32_t thread;
+        uint8_t category;
+        uint8_t priority;
+        char text[TRACE_TEXT_SIZE];
+    };
+
+    class Slot {
+    public:
+        /* Sequence number + 1 of the record in it, 0 while it's being written */
+        std::atomic<uint64_t> sequence;
+        Record record;
+    };
+
+    static Slot ring[TRACE_RECORDS];
+    static std::atomic<uint64_t> head;
+    static std::atomic<uint64_t> logs;
+    static std::atomic<bool> running;
+    static std::atomic<bool> dumpRequested;
+    static uint64_t drainFrom;
+    static uint64_t drainLogsFrom;
+    static int wakeFd;
+
+    static Record *claim(uint64_t *sequence);
+    static void publish(uint64_t sequence);
+    static bool read(uint64_t sequence, Record *record);
+    static void wake();
+    static void onSignal(int signal);
+    static void *drain(void *unused);
+    static bool dump();
+
+};
+
+#endif // TRACE_H
@@ -0,0 +1,290 @@
+#include "uevent.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* Multicast group of the uevents sent by the kernel itself, udev rebroadcasts on 2 */
+#define UEVENT_GROUP_KERNEL 1
+
+/* A dock brings up several connectors at once, don't drop the burst */
+#define UEVENT_RECEIVE_BUFFER (1024 * 1024)
+
+bool UEvent::parse(const char *buffer, size_t length)
+{
+
+    action.clear();
+    devpath.clear();
+    subsystem.clear();
+    hotplug = false;
+
+    /* The header is "ACTION@DEVPATH", udev's own "libudev" messages have none */
+
+    const char *end = buffer + length;
+    const char *header = buffer;
+    size_t headerLength = strnlen(header, length);
+    const char *at = (const char *) memchr(header, '@', headerLength);
+
+    if (at == NULL) {
+        return false;
+    }
+
+    action.assign(header, at - header);
+    devpath.assign(at + 1, header + headerLength - (at + 1));
+
+    for (const char *field = header + headerLength + 1; field < end; ) {
+
+        size_t fieldLength = strnlen(field, end - field);
+
+        if (fieldLength > 10 && strncmp(field, "SUBSYSTEM=", 10) == 0) {
+            subsystem.assign(field + 10, fieldLength - 10);
+        } else if (fieldLength == 9 && strncmp(field, "HOTPLUG=1", 9) == 0) {
+            hotplug = true;
+        } else if (fieldLength > 7 && strncmp(field, "ACTION=", 7) == 0) {
+            action.assign(field + 7, fieldLength - 7);
+        }
+
+        field += fieldLength + 1;
+
+    }
+
+    return !action.empty();
+
+}
+
+UEventMonitor::UEventMonitor(const std::string &drmDirectory) : drmDirectory(drmDirectory)
+{
+
+}
+
+bool UEventMonitor::start(UEventHandler *handler)
+{
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to open the uevent socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = UEVENT_GROUP_KERNEL;
+
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        syslog(LOG_ERR, "Failed to listen for uevents: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    int size = UEVENT_RECEIVE_BUFFER;
+
+    /* Forcing needs CAP_NET_ADMIN, the normal limit is fine otherwise */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    if (!listenOn(handler, fd, true)) {
+        close(fd);
+        return false;
+    }
+
+    return true;
+
+}
+
+bool UEventMonitor::start(UEventHandler *handler, int fd)
+{
+
+    /* An injected stream has no kernel sender to check */
+    return listenOn(handler, fd, false);
+
+}
+
+bool UEventMonitor::listenOn(UEventHandler *handler, int fd, bool fromKernel)
+{
+
+    this->fd = fd;
+    this->handler = handler;
+    this->fromKernel = fromKernel;
+
+    if (pthread_create(&thread, NULL, &UEventMonitor::listen, this) != 0) {
+        syslog(LOG_ERR, "Failed to start the uevent listener\n");
+        this->fd = -1;
+        return false;
+    }
+
+    pthread_detach(thread);
+
+    return true;
+
+}
+
+bool UEventMonitor::receive(char *buffer, size_t size, size_t *length, bool *closed)
+{
+
+    struct sockaddr_nl sender;
+    memset(&sender, 0, sizeof(sender));
+
+    struct iovec vector;
+    vector.iov_base = buffer;
+    vector.iov_len = size;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = fromKernel ? &sender : NULL;
+    message.msg_namelen = fromKernel ? sizeof(sender) : 0;
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    ssize_t len = recvmsg(fd, &message, 0);
+
+    if (len < 0) {
+        return false;
+    }
+
+    *length = (size_t) len;
+    *closed = false;
+
+    /*
+     * An injected stream reads empty once its writer is gone, but
+     * a seqpacket socket can also carry an empty message. Only
+     * stop if the other end really hung up.
+     */
+    if (len == 0 && !fromKernel) {
+        struct pollfd peer = { fd, POLLRDHUP, 0 };
+        *closed = poll(&peer, 1, 0) == 1 && (peer.revents & (POLLRDHUP | POLLHUP));
+    }
+
+    /* Cut off events can't be trusted to have all their fields */
+    if (message.msg_flags & MSG_TRUNC) {
+        *length = 0;
+    }
+
+    /* Anyone can send to the group, only trust the kernel */
+    if (fromKernel && (message.msg_namelen != sizeof(sender) || sender.nl_pid != 0)) {
+        *length = 0;
+    }
+
+    return true;
+
+}
+
+void *UEventMonitor::listen(void *monitor)
+{
+
+    UEventMonitor *self = (UEventMonitor *) monitor;
+
+    char buffer[UEVENT_BUFFER_SIZE];
+    UEvent event;
+
+    for (;;) {
+
+        size_t length;
+        bool closed;
+
+        if (!self->receive(buffer, sizeof(buffer), &length, &closed)) {
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* The socket overflowed, some hotplug may be lost so report one */
+            if (errno == ENOBUFS) {
+                syslog(LOG_INFO, "Uevents were dropped, rechecking the connectors\n");
+                event.action = "change";
+                event.devpath.clear();
+                event.subsystem = "drm";
+                event.hotplug = true;
+                self->handler->handleUEvent(event);
+                continue;
+            }
+
+            syslog(LOG_ERR, "Uevent listener stopped: %s\n", strerror(errno));
+            return NULL;
+
+        }
+
+        /* An injected stream ends with its writer */
+        if (closed) {
+            syslog(LOG_INFO, "Uevent stream closed\n");
+            return NULL;
+        }
+
+        if (length == 0 || !event.parse(buffer, length)) {
+            continue;
+        }
+
+        /* Connector changes only, not render nodes or backlights */
+        if (event.subsystem != "drm" || !event.hotplug) {
+            continue;
+        }
+
+        self->handler->handleUEvent(event);
+
+    }
+
+}
+
+int UEventMonitor::countExternalConnected() const
+{
+
+    DIR *directory = opendir(drmDirectory.c_str());
+
+    if (directory == NULL) {
+        return 0;
+    }
+
+    int connected = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(directory)) != NULL) {
+
+        /* Connectors are named card<N>-<connector>, e.g. card0-DP-1 */
+
+        if (strncmp(entry->d_name, "card", 4) != 0) {
+            continue;
+        }
+
+        const char *connector = strchr(entry->d_name, '-');
+
+        if (connector == NULL) {
+            continue;
+        }
+
+        connector++;
+
+        if (strncmp(connector, "eDP", 3) == 0 || strncmp(connector, "LVDS", 4) == 0 ||
+            strncmp(connector, "DSI", 3) == 0) {
+            continue;
+        }
+
+        std::string path = drmDirectory + "/" + entry->d_name + "/status";
+        int status = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (status < 0) {
+            continue;
+        }
+
+        char state[16];
+        ssize_t len = read(status, state, sizeof(state));
+        close(status);
+
+        if (len >= 9 && strncmp(state, "connected", 9) == 0) {
+            connected++;
+        }
+
+    }
+
+    closedir(directory);
+
+    return connected;
+
+}
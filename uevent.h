@@ -0,0 +1,69 @@
+#ifndef UEVENT_H
+#define UEVENT_H
+
+#include <pthread.h>
+#include <string>
+
+#define UEVENT_DRM_DIRECTORY "/sys/class/drm"
+
+/* Kernel uevents are limited to a page of environment */
+#define UEVENT_BUFFER_SIZE 8192
+
+/*
+ * A kernel uevent, "ACTION@DEVPATH" followed by
+ * NUL separated KEY=VALUE pairs
+ */
+class UEvent {
+
+public:
+
+    std::string action;
+    std::string devpath;
+    std::string subsystem;
+    bool hotplug = false;
+
+    bool parse(const char *buffer, size_t length);
+
+};
+
+class UEventHandler {
+public:
+    virtual void handleUEvent(const UEvent &event) = 0;
+};
+
+/*
+ * Listens to kernel uevents on a netlink socket and
+ * hands DRM connector hotplugs to the handler. The
+ * kernel sends them once the connector was probed,
+ * so unlike the ACPI dock event the monitors are
+ * usually ready by then. start() can also be given
+ * any datagram or seqpacket socket, which lets a
+ * fake uevent stream be injected through a socketpair.
+ */
+class UEventMonitor {
+
+private:
+
+    int fd = -1;
+    bool fromKernel = true;
+    UEventHandler *handler = NULL;
+    std::string drmDirectory;
+    pthread_t thread;
+
+    bool listenOn(UEventHandler *handler, int fd, bool fromKernel);
+    bool receive(char *buffer, size_t size, size_t *length, bool *closed);
+    static void *listen(void *monitor);
+
+public:
+
+    UEventMonitor(const std::string &drmDirectory = UEVENT_DRM_DIRECTORY);
+
+    bool start(UEventHandler *handler);
+    bool start(UEventHandler *handler, int fd);
+
+    /* Connected connectors other than the laptop panel */
+    int countExternalConnected() const;
+
+};
+
+#endif // UEVENT_H
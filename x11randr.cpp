@@ -0,0 +1,668 @@
+#include "x11randr.h"
+#include "stats.h"
+
+#ifdef DOCKD_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
+#endif // DOCKD_XCB
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <syslog.h>
+
+/* A base EDID block plus up to three extension blocks */
+#define EDID_MAX_LONGS 128
+
+X11RandR::X11RandR(const std::string &displayName, int screenNumber) :
+    displayName(displayName), screenNumber(screenNumber)
+{
+
+}
+
+X11RandR::~X11RandR()
+{
+    disconnect();
+}
+
+bool X11RandR::connect()
+{
+
+    display = XOpenDisplay(displayName.empty() ? NULL : displayName.c_str());
+
+    if (!display) {
+        syslog(LOG_ERR, "Error opening display %s!\n", XDisplayName(displayName.empty() ? NULL : displayName.c_str()));
+        return false;
+    }
+
+    screen = DefaultScreen(display);
+
+    if (screenNumber >= 0) {
+
+        if (screenNumber >= ScreenCount(display)) {
+            syslog(LOG_ERR, "Display %s has no screen %d!\n", DisplayString(display), screenNumber);
+            XCloseDisplay(display);
+            display = NULL;
+            return false;
+        }
+
+        screen = screenNumber;
+
+    }
+    window = RootWindow(display, screen);
+
+    if (!XRRQueryExtension(display, &randrEventBase, &randrErrorBase)) {
+        syslog(LOG_ERR, "RandR extension missing!\n");
+        XCloseDisplay(display);
+        display = NULL;
+        return false;
+    }
+
+    roundTrips++;
+
+    edidAtom = XInternAtom(display, RR_PROPERTY_RANDR_EDID, True);
+    roundTrips++;
+
+    /* Subscribe before fetching the resources so no change is missed */
+    XRRSelectInput(display, window, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+
+    return true;
+
+}
+
+void X11RandR::disconnect()
+{
+
+    if (resources) {
+        XRRFreeScreenResources(resources);
+        resources = NULL;
+    }
+
+    if (display) {
+        XCloseDisplay(display);
+        display = NULL;
+    }
+
+}
+
+bool X11RandR::getScreenResources(ScreenResources *out)
+{
+
+    if (resources) {
+        XRRFreeScreenResources(resources);
+    }
+
+    resources = XRRGetScreenResources(display, window);
+    roundTrips++;
+
+    if (!resources) {
+        return false;
+    }
+
+    out->configTimestamp = resources->configTimestamp;
+    out->crtcs.assign(resources->crtcs, resources->crtcs + resources->ncrtc);
+    out->outputs.assign(resources->outputs, resources->outputs + resources->noutput);
+    out->modes.resize(resources->nmode);
+
+    for (int i = 0; i < resources->nmode; i++) {
+
+        XRRModeInfo *mode = (resources->modes + i);
+        ModeInfo &info = out->modes[i];
+
+        info.id = mode->id;
+        info.name.assign(mode->name, mode->nameLength);
+        info.width = mode->width;
+        info.height = mode->height;
+        info.dotClock = mode->dotClock;
+        info.hSyncStart = mode->hSyncStart;
+        info.hSyncEnd = mode->hSyncEnd;
+        info.hTotal = mode->hTotal;
+        info.hSkew = mode->hSkew;
+        info.vSyncStart = mode->vSyncStart;
+        info.vSyncEnd = mode->vSyncEnd;
+        info.vTotal = mode->vTotal;
+        info.modeFlags = mode->modeFlags;
+
+    }
+
+    return true;
+
+}
+
+void X11RandR::getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos)
+{
+
+    /* Filled in place, so a warm vector keeps its strings and mode lists */
+    infos->resize(outputs.size());
+
+#ifdef DOCKD_XCB
+
+    /*
+     * Send every request before reading any reply,
+     * so the whole batch costs a single round trip
+     */
+
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    outputCookies.resize(outputs.size());
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+        outputCookies[i] = xcb_randr_get_output_info(connection, (xcb_randr_output_t) outputs[i],
+                                                     (xcb_timestamp_t) resources->configTimestamp);
+    }
+
+    roundTrips++;
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+
+        OutputInfo &info = (*infos)[i];
+
+        xcb_randr_get_output_info_reply_t *reply =
+            xcb_randr_get_output_info_reply(connection, outputCookies[i], NULL);
+
+        if (!reply) {
+            info.output = None;
+            continue;
+        }
+
+        xcb_randr_mode_t *modes = xcb_randr_get_output_info_modes(reply);
+        int nmode = xcb_randr_get_output_info_modes_length(reply);
+
+        info.output = outputs[i];
+        info.name.assign((const char *) xcb_randr_get_output_info_name(reply),
+                         (size_t) xcb_randr_get_output_info_name_length(reply));
+        info.connection = reply->connection;
+        info.crtc = reply->crtc;
+        info.npreferred = reply->num_preferred;
+        info.modes.assign(modes, modes + nmode);
+
+        free(reply);
+
+    }
+
+#else
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+
+        OutputInfo &info = (*infos)[i];
+
+        XRROutputInfo *outputInfo = XRRGetOutputInfo(display, resources, outputs[i]);
+        roundTrips++;
+
+        if (!outputInfo) {
+            info.output = None;
+            continue;
+        }
+
+        info.output = outputs[i];
+        info.name = outputInfo->name;
+        info.connection = outputInfo->connection;
+        info.crtc = outputInfo->crtc;
+        info.npreferred = outputInfo->npreferred;
+        info.modes.assign(outputInfo->modes, outputInfo->modes + outputInfo->nmode);
+
+        XRRFreeOutputInfo(outputInfo);
+
+    }
+
+#endif // DOCKD_XCB
+
+}
+
+void X11RandR::getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos)
+{
+
+    infos->resize(crtcs.size());
+
+#ifdef DOCKD_XCB
+
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    crtcCookies.resize(crtcs.size());
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+        crtcCookies[i] = xcb_randr_get_crtc_info(connection, (xcb_randr_crtc_t) crtcs[i],
+                                                 (xcb_timestamp_t) resources->configTimestamp);
+    }
+
+    roundTrips++;
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        CrtcInfo &info = (*infos)[i];
+
+        xcb_randr_get_crtc_info_reply_t *reply = xcb_randr_get_crtc_info_reply(connection, crtcCookies[i], NULL);
+
+        if (!reply) {
+            info.crtc = None;
+            continue;
+        }
+
+        xcb_randr_output_t *outputs = xcb_randr_get_crtc_info_outputs(reply);
+        int noutput = xcb_randr_get_crtc_info_outputs_length(reply);
+
+        info.crtc = crtcs[i];
+        info.x = reply->x;
+        info.y = reply->y;
+        info.mode = reply->mode;
+        info.rotation = reply->rotation;
+        info.outputs.assign(outputs, outputs + noutput);
+
+        free(reply);
+
+    }
+
+#else
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        CrtcInfo &info = (*infos)[i];
+
+        XRRCrtcInfo *crtcInfo = XRRGetCrtcInfo(display, resources, crtcs[i]);
+        roundTrips++;
+
+        if (!crtcInfo) {
+            info.crtc = None;
+            continue;
+        }
+
+        info.crtc = crtcs[i];
+        info.x = crtcInfo->x;
+        info.y = crtcInfo->y;
+        info.mode = crtcInfo->mode;
+        info.rotation = crtcInfo->rotation;
+        info.outputs.assign(crtcInfo->outputs, crtcInfo->outputs + crtcInfo->noutput);
+
+        XRRFreeCrtcInfo(crtcInfo);
+
+    }
+
+#endif // DOCKD_XCB
+
+}
+
+void X11RandR::getScreenSize(ScreenSize *size)
+{
+    /* Kept current by XRRUpdateConfiguration, no request needed */
+    size->width = DisplayWidth(display, screen);
+    size->height = DisplayHeight(display, screen);
+    size->mm_width = DisplayWidthMM(display, screen);
+    size->mm_height = DisplayHeightMM(display, screen);
+}
+
+void X11RandR::getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids)
+{
+
+    edids->assign(outputs.size(), std::string());
+
+    /* The atom only exists once an output published an EDID, which may be after we connected */
+    if (edidAtom == None) {
+        edidAtom = XInternAtom(display, RR_PROPERTY_RANDR_EDID, True);
+        roundTrips++;
+    }
+
+    /* No output ever reported an EDID on this server */
+    if (edidAtom == None) {
+        return;
+    }
+
+#ifdef DOCKD_XCB
+
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    vector<xcb_randr_get_output_property_cookie_t> cookies(outputs.size());
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+        cookies[i] = xcb_randr_get_output_property(connection, (xcb_randr_output_t) outputs[i],
+                                                   (xcb_atom_t) edidAtom, XCB_ATOM_ANY, 0, EDID_MAX_LONGS, 0, 0);
+    }
+
+    roundTrips++;
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+
+        xcb_randr_get_output_property_reply_t *reply =
+                xcb_randr_get_output_property_reply(connection, cookies[i], NULL);
+
+        if (!reply) {
+            continue;
+        }
+
+        if (reply->format == 8) {
+            (*edids)[i].assign((const char *) xcb_randr_get_output_property_data(reply),
+                               (size_t) xcb_randr_get_output_property_data_length(reply));
+        }
+
+        free(reply);
+
+    }
+
+#else
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+
+        Atom type;
+        int format;
+        unsigned long nitems;
+        unsigned long bytesAfter;
+        unsigned char *data = NULL;
+
+        int ret = XRRGetOutputProperty(display, outputs[i], edidAtom, 0, EDID_MAX_LONGS, False, False,
+                                       AnyPropertyType, &type, &format, &nitems, &bytesAfter, &data);
+        roundTrips++;
+
+        if (ret == Success && format == 8 && data) {
+            (*edids)[i].assign((const char *) data, nitems);
+        }
+
+        if (data) {
+            XFree(data);
+        }
+
+    }
+
+#endif // DOCKD_XCB
+
+}
+
+void X11RandR::getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms)
+{
+
+    transforms->resize(crtcs.size());
+
+#ifdef DOCKD_XCB
+
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    transformCookies.resize(crtcs.size());
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+        transformCookies[i] = xcb_randr_get_crtc_transform(connection, (xcb_randr_crtc_t) crtcs[i]);
+    }
+
+    roundTrips++;
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        CrtcTransform &transform = (*transforms)[i];
+
+        xcb_randr_get_crtc_transform_reply_t *reply =
+                xcb_randr_get_crtc_transform_reply(connection, transformCookies[i], NULL);
+
+        transform.reset();
+
+        if (!reply) {
+            continue;
+        }
+
+        const xcb_render_transform_t &current = reply->current_transform;
+        xcb_render_fixed_t *params = xcb_randr_get_crtc_transform_current_params(reply);
+
+        XFixed (&matrix)[3][3] = transform.matrix.matrix;
+
+        matrix[0][0] = current.matrix11;
+        matrix[0][1] = current.matrix12;
+        matrix[0][2] = current.matrix13;
+        matrix[1][0] = current.matrix21;
+        matrix[1][1] = current.matrix22;
+        matrix[1][2] = current.matrix23;
+        matrix[2][0] = current.matrix31;
+        matrix[2][1] = current.matrix32;
+        matrix[2][2] = current.matrix33;
+
+        transform.filter.assign(xcb_randr_get_crtc_transform_current_filter_name(reply),
+                                (size_t) xcb_randr_get_crtc_transform_current_filter_name_length(reply));
+        transform.params.assign(params, params + xcb_randr_get_crtc_transform_current_params_length(reply));
+
+        free(reply);
+
+    }
+
+#else
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        CrtcTransform &transform = (*transforms)[i];
+        XRRCrtcTransformAttributes *attributes = NULL;
+
+        transform.reset();
+
+        Status status = XRRGetCrtcTransform(display, crtcs[i], &attributes);
+        roundTrips++;
+
+        if (!status || !attributes) {
+            continue;
+        }
+
+        transform.matrix = attributes->currentTransform;
+        transform.filter.assign(attributes->currentFilter ? attributes->currentFilter : "");
+        transform.params.assign(attributes->currentParams, attributes->currentParams + attributes->currentNparams);
+
+        XFree(attributes);
+
+    }
+
+#endif // DOCKD_XCB
+
+}
+
+void X11RandR::getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings)
+{
+
+    pannings->resize(crtcs.size());
+
+#ifdef DOCKD_XCB
+
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    panningCookies.resize(crtcs.size());
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+        panningCookies[i] = xcb_randr_get_panning(connection, (xcb_randr_crtc_t) crtcs[i]);
+    }
+
+    roundTrips++;
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        Panning &panning = (*pannings)[i];
+
+        xcb_randr_get_panning_reply_t *reply = xcb_randr_get_panning_reply(connection, panningCookies[i], NULL);
+
+        memset(&panning, 0, sizeof(panning));
+
+        if (!reply) {
+            continue;
+        }
+
+        panning.left = reply->left;
+        panning.top = reply->top;
+        panning.width = reply->width;
+        panning.height = reply->height;
+        panning.trackLeft = reply->track_left;
+        panning.trackTop = reply->track_top;
+        panning.trackWidth = reply->track_width;
+        panning.trackHeight = reply->track_height;
+        panning.borderLeft = reply->border_left;
+        panning.borderTop = reply->border_top;
+        panning.borderRight = reply->border_right;
+        panning.borderBottom = reply->border_bottom;
+
+        free(reply);
+
+    }
+
+#else
+
+    for (size_t i = 0; i < crtcs.size(); i++) {
+
+        Panning &panning = (*pannings)[i];
+
+        memset(&panning, 0, sizeof(panning));
+
+        XRRPanning *info = XRRGetPanning(display, resources, crtcs[i]);
+        roundTrips++;
+
+        if (!info) {
+            continue;
+        }
+
+        panning.left = (int) info->left;
+        panning.top = (int) info->top;
+        panning.width = (int) info->width;
+        panning.height = (int) info->height;
+        panning.trackLeft = (int) info->track_left;
+        panning.trackTop = (int) info->track_top;
+        panning.trackWidth = (int) info->track_width;
+        panning.trackHeight = (int) info->track_height;
+        panning.borderLeft = info->border_left;
+        panning.borderTop = info->border_top;
+        panning.borderRight = info->border_right;
+        panning.borderBottom = info->border_bottom;
+
+        XRRFreePanning(info);
+
+    }
+
+#endif // DOCKD_XCB
+
+}
+
+RROutput X11RandR::getPrimaryOutput()
+{
+    RROutput output = XRRGetOutputPrimary(display, window);
+    roundTrips++;
+
+    return output;
+}
+
+bool X11RandR::waitForEvent(int timeoutMs)
+{
+
+    int fd = ConnectionNumber(display);
+    uint64_t deadline = Stats::now() + (uint64_t) timeoutMs * 1000000ULL;
+    bool changed = false;
+
+    for (;;) {
+
+        /* Drain everything Xlib has already queued */
+        while (XPending(display)) {
+
+            XEvent event;
+            XNextEvent(display, &event);
+
+            int type = event.type - randrEventBase;
+
+            if (type == RRScreenChangeNotify || type == RRNotify) {
+                XRRUpdateConfiguration(&event);
+                changed = true;
+            }
+
+        }
+
+        if (changed) {
+            return true;
+        }
+
+        uint64_t now = Stats::now();
+
+        if (now >= deadline) {
+            return false;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int ret = poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000));
+
+        if (ret < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to wait for RandR events: %s\n", strerror(errno));
+            return false;
+        }
+
+    }
+
+}
+
+void X11RandR::grab()
+{
+    XGrabServer(display);
+}
+
+void X11RandR::ungrab()
+{
+    XUngrabServer(display);
+}
+
+void X11RandR::sync()
+{
+    XSync(display, 0);
+    roundTrips++;
+}
+
+bool X11RandR::setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                             const RROutput *outputs, int noutputs)
+{
+
+    Status status = XRRSetCrtcConfig(display,
+                                     resources,
+                                     crtc,
+                                     CurrentTime,
+                                     x,
+                                     y,
+                                     mode,
+                                     rotation,
+                                     (RROutput *) outputs,
+                                     noutputs);
+    roundTrips++;
+
+    return status == RRSetConfigSuccess;
+
+}
+
+void X11RandR::setScreenSize(int width, int height, int mm_width, int mm_height)
+{
+    XRRSetScreenSize(display, window, width, height, mm_width, mm_height);
+}
+
+void X11RandR::setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform)
+{
+    XTransform matrix = transform.matrix;
+
+    XRRSetCrtcTransform(display, crtc, &matrix, transform.filter.c_str(),
+                        (XFixed *) transform.params.data(), (int) transform.params.size());
+}
+
+bool X11RandR::setPanning(RRCrtc crtc, const Panning &panning)
+{
+
+    XRRPanning info;
+
+    info.timestamp = CurrentTime;
+    info.left = (unsigned int) panning.left;
+    info.top = (unsigned int) panning.top;
+    info.width = (unsigned int) panning.width;
+    info.height = (unsigned int) panning.height;
+    info.track_left = (unsigned int) panning.trackLeft;
+    info.track_top = (unsigned int) panning.trackTop;
+    info.track_width = (unsigned int) panning.trackWidth;
+    info.track_height = (unsigned int) panning.trackHeight;
+    info.border_left = panning.borderLeft;
+    info.border_top = panning.borderTop;
+    info.border_right = panning.borderRight;
+    info.border_bottom = panning.borderBottom;
+
+    Status status = XRRSetPanning(display, resources, crtc, &info);
+    roundTrips++;
+
+    return status == RRSetConfigSuccess;
+
+}
+
+void X11RandR::setPrimaryOutput(RROutput output)
+{
+    XRRSetOutputPrimary(display, window, output);
+}
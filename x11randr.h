@@ -0,0 +1,73 @@
+#ifndef X11RANDR_H
+#define X11RANDR_H
+
+#include "randr.h"
+
+#ifdef DOCKD_XCB
+#include <xcb/randr.h>
+#endif // DOCKD_XCB
+
+/*
+ * RandR on a live X server, through Xlib or, when
+ * built with DOCKD_XCB, through pipelined xcb-randr
+ * requests that cost one round trip per batch
+ */
+class X11RandR : public RandR {
+
+private:
+
+    std::string displayName;
+    int screenNumber;
+
+    Display *display = NULL;
+    int screen;
+    Window window;
+
+    XRRScreenResources *resources = NULL;
+
+    int randrEventBase;
+    int randrErrorBase;
+
+    Atom edidAtom;
+
+#ifdef DOCKD_XCB
+    /* Reused between batches */
+    vector<xcb_randr_get_output_info_cookie_t> outputCookies;
+    vector<xcb_randr_get_crtc_info_cookie_t> crtcCookies;
+    vector<xcb_randr_get_crtc_transform_cookie_t> transformCookies;
+    vector<xcb_randr_get_panning_cookie_t> panningCookies;
+#endif // DOCKD_XCB
+
+public:
+
+    X11RandR(const std::string &displayName = "", int screenNumber = -1);
+    ~X11RandR();
+
+    bool connect();
+    void disconnect();
+
+    bool getScreenResources(ScreenResources *resources);
+    void getOutputInfos(const vector<RROutput> &outputs, vector<OutputInfo> *infos);
+    void getCrtcInfos(const vector<RRCrtc> &crtcs, vector<CrtcInfo> *infos);
+    void getScreenSize(ScreenSize *size);
+    void getOutputEdids(const vector<RROutput> &outputs, vector<std::string> *edids);
+    void getCrtcTransforms(const vector<RRCrtc> &crtcs, vector<CrtcTransform> *transforms);
+    void getPannings(const vector<RRCrtc> &crtcs, vector<Panning> *pannings);
+    RROutput getPrimaryOutput();
+
+    bool waitForEvent(int timeoutMs);
+
+    void grab();
+    void ungrab();
+    void sync();
+
+    bool setCrtcConfig(RRCrtc crtc, int x, int y, RRMode mode, Rotation rotation,
+                       const RROutput *outputs, int noutputs);
+    void setScreenSize(int width, int height, int mm_width, int mm_height);
+    void setCrtcTransform(RRCrtc crtc, const CrtcTransform &transform);
+    bool setPanning(RRCrtc crtc, const Panning &panning);
+    void setPrimaryOutput(RROutput output);
+
+};
+
+#endif // X11RANDR_H